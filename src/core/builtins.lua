@@ -14,6 +14,7 @@ local macro = common.macro
 local pfunction = common.pfunction
 local ast = import "ast"
 local lpeg = import "lpeg"
+local dictionary = import "dictionary"
 
 local locale = common.locale
 
@@ -106,29 +107,36 @@ local function macro_findall(...)
    return ast.repetition.new{min=1, exp=find, cooked=false, sourceref=exp.sourceref}
 end
 
--- The argument, char, MUST be a string containing one UTF-8 encoded character
--- or a single byte (which will be in 0x80-0xFF).
-local function generate_ci_expression_for_char(char, sref)
-   local char_literal = ast.literal.new{value=char, sourceref=sref}
-   local other_case = ustring.upper(char) or ustring.lower(char)
-   if other_case then
-      local upper_lower_choices =
-	 { char_literal,
-	   ast.literal.new{value=other_case, sourceref=sref} }
-      return ast.choice.new{exps=upper_lower_choices, sourceref=sref}
-   end
-   -- there is no other case for this char
-   return char_literal
-end
-
 -- to_case_insensitive: literals
+-- Each ASCII letter becomes the set of its two cases, which compiles to a single test of one
+-- input byte, and each run of other characters stays a literal.  Only ASCII letters have another
+-- case (see ustring.upper), and no byte of a multi-byte character is an ASCII letter, so the
+-- literal can be taken apart byte by byte.
 local function to_ci_literal(exp)
-   local input = ustring.explode(exp.value)
-   local disjunctions = list.new()
-   for _, char in ipairs(input) do
-      table.insert(disjunctions, generate_ci_expression_for_char(char, exp.sourceref))
-   end -- for each char in the input literal
-   return ast.raw.new{exp=ast.sequence.new{exps=disjunctions, sourceref=exp.sourceref},
+   local str = ustring.unescape_string(exp.value)
+   if (not str) or (#str == 0) then return exp; end -- the compiler reports any error
+   local exps, run = list.new(), {}
+   local function end_run()
+      if #run > 0 then
+	 table.insert(exps, ast.literal.new{value=ustring.escape_string(table.concat(run)),
+					    sourceref=exp.sourceref})
+	 run = {}
+      end
+   end
+   for i = 1, #str do
+      local char = str:sub(i,i)
+      local other_case = ustring.upper(char) or ustring.lower(char)
+      if other_case then
+	 end_run()
+	 table.insert(exps, ast.cs_list.new{complement=false,
+					    chars={char, other_case},
+					    sourceref=exp.sourceref})
+      else
+	 table.insert(run, char)
+      end
+   end
+   end_run()
+   return ast.raw.new{exp=ast.sequence.new{exps=exps, sourceref=exp.sourceref},
 		      sourceref=exp.sourceref}
 end
 
@@ -153,14 +161,21 @@ local function to_ci_named_charset(exp)
 end
 
 -- to_case_insensitive: character lists
--- FUTURE: flatten the choices?
+-- The other case of each letter is added to the list, which stays a single set.
 local function to_ci_list_charset(exp)
-   local disjunctions = list.new()
+   local chars, seen = {}, {}
+   local function add(char)
+      if not seen[char] then
+	 seen[char] = true
+	 table.insert(chars, char)
+      end
+   end
    for _, char in ipairs(exp.chars) do
-      table.insert(disjunctions, generate_ci_expression_for_char(char, exp.sourceref))
-   end -- for each char in the input literal
-   return ast.raw.new{exp=ast.choice.new{exps=disjunctions, sourceref=exp.sourceref},
-		      sourceref=exp.sourceref}
+      add(char)
+      local other_case = ustring.upper(char) or ustring.lower(char)
+      if other_case then add(other_case); end
+   end
+   return ast.cs_list.new{complement=exp.complement, chars=chars, sourceref=exp.sourceref}
 end
 
 local function to_range_or_char(r, exp)
@@ -296,6 +311,35 @@ local function error_peg(...)
    return lpeg.rconstcap(message_text, message_typename or "error") * lpeg.Halt()
 end
 
+-- -----------------------------------------------------------------------------
+-- Dictionaries
+-- -----------------------------------------------------------------------------
+
+-- dictionary:#name matches the longest entry of the dictionary called name, and
+-- dictionary:(#name, #shortest) the shortest one.  See dictionary.lua.
+local function dictionary_peg(...)
+   local args = {...}
+   if #args~=1 and #args~=2 then
+      error("function takes one or two arguments: " .. tostring(#args) .. " given")
+   end
+   local arg, mode = args[1], args[2]
+   if not (common.taggedvalue.is(arg) and (arg.type=="string" or arg.type=="hashtag")) then
+      error("first argument to function not a string or tag: " .. tostring(arg))
+   elseif (mode and
+	   not (common.taggedvalue.is(mode) and mode.type=="hashtag"
+		and (mode.value=="longest" or mode.value=="shortest"))) then
+      error("second argument to function not #longest or #shortest: " .. tostring(mode))
+   end
+   if not dictionary.current then
+      error("no dictionaries are available to this engine")
+   end
+   local d, msg = dictionary.lookup(dictionary.current, arg.value)
+   if not d then
+      error("cannot load dictionary " .. arg.value .. ": " .. tostring(msg))
+   end
+   return dictionary.peg(d, mode and mode.value=="shortest")
+end
+
 -- -----------------------------------------------------------------------------
 -- Standard prelude, reified as the store of an environment
 -- -----------------------------------------------------------------------------
@@ -312,12 +356,13 @@ builtins.sourceref = common.source.new{s=0, e=0,
 				       parent=nil}
 
 local prelude_entries = {
-   {dot_id, pattern, utf8_char_peg, true},
-   {eol_id, pattern, lpeg.P(-1), true},
-   {sol_id, pattern, -lpeg.B(1), true},		    -- start of input
-   {b_id, pattern, boundary, true},		    -- token boundary
+   {dot_id, pattern, utf8_char_peg, true, common.first_set(lpeg.P(1))},
+   {eol_id, pattern, lpeg.P(-1), true, {empty=true}},
+   {sol_id, pattern, -lpeg.B(1), true, {empty=true}},	    -- start of input
+   {b_id, pattern, boundary, true, common.first_set(s_peg, true)}, -- token boundary
    {"message", pfunction, message_peg},
    {"error", pfunction, error_peg},
+   {"dictionary", pfunction, dictionary_peg},
    {"keepto", macro, macro_keepto},
    {"find", macro, macro_find},
    {"findall", macro, macro_findall},
@@ -338,7 +383,7 @@ function builtins.make_standard_prelude_store()
    local ENV = {}
    for _, e in ipairs(prelude_entries) do
       if e[2]==pattern then
-	 pat = e[2].new{name=e[1]; peg=e[3]; alias=e[4]}
+	 pat = e[2].new{name=e[1]; peg=e[3]; alias=e[4]; first=e[5]; nocap=true}
       elseif e[2]==pfunction then
 	 pat = e[2].new{primop=e[3]}
       elseif e[2]==macro then
@@ -0,0 +1,107 @@
+-- -*- Mode: Lua; -*-
+--
+-- cli-bench.lua         Implements the cli command 'bench'
+--
+-- © Copyright Jamie A. Jennings 2018.
+-- LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)
+-- AUTHOR: Jamie A. Jennings
+
+-- The bench command matches a pattern against every line of its input files (or against each
+-- whole file, with --wholefile) for a number of iterations, and reports:
+--   throughput in MB/s and lines/s, from the processor time spent in the iterations;
+--   the 50th and 99th percentile of the time to match one line;
+--   the time spent in the matching vm, as a fraction of the total match time; and
+--   the peak size of the Lua heap, sampled after each match.
+-- The inputs are read into memory before the first iteration, so that reading them is not
+-- part of the measurement.
+
+local bench = {}
+
+local write_error = function(...) io.stderr:write(...) end
+
+local function read_inputs(filename, wholefile)
+   local f, msg = io.open(filename, "r")
+   if not f then return nil, msg; end
+   local inputs, bytes = {}, 0
+   if wholefile then
+      local data = f:read("a")
+      table.insert(inputs, data)
+      bytes = #data
+   else
+      for line in f:lines() do
+	 table.insert(inputs, line)
+	 bytes = bytes + #line + 1		    -- count the newline, as matchfile reads it
+      end
+   end
+   f:close()
+   return inputs, bytes
+end
+
+local function percentile(sorted, p)
+   if #sorted == 0 then return 0; end
+   local i = math.ceil(#sorted * p / 100)
+   return sorted[math.max(i, 1)]
+end
+
+-- Match every input, iterations times.  The times reported by the vm are in microseconds.
+local function run(compiled_pattern, inputs, encoder, iterations)
+   local latencies = {}
+   local total, vm, matched = 0, 0, 0
+   local peak_heap = collectgarbage("count")
+   local t0 = os.clock()
+   for _ = 1, iterations do
+      for _, input in ipairs(inputs) do
+	 local m, leftover, abend, ttotal, tmatch = compiled_pattern:match(input, 1, encoder, 0, 0)
+	 if m then matched = matched + 1; end
+	 latencies[#latencies+1] = ttotal
+	 total, vm = total + ttotal, vm + tmatch
+	 local heap = collectgarbage("count")
+	 if heap > peak_heap then peak_heap = heap; end
+      end
+   end
+   local elapsed = os.clock() - t0
+   table.sort(latencies)
+   return {elapsed=elapsed, total=total, vm=vm, matched=matched, peak_heap=peak_heap,
+	   p50=percentile(latencies, 50), p99=percentile(latencies, 99)}
+end
+
+function bench.process_pattern_against_file(rosie, en, args, compiled_pattern, infilename)
+   assert(compiled_pattern, "Rosie: missing pattern?")
+   assert(engine_module.rplx.is(compiled_pattern), "Rosie: compiled pattern not rplx?")
+   local encoder = (args.encoder and (args.encoder ~= "default") and args.encoder) or "bool"
+   local iterations = tonumber(args.iterations)
+   if (not iterations) or (iterations < 1) then
+      write_error("Number of iterations must be a positive integer: ", tostring(args.iterations), "\n")
+      return
+   end
+   local inputs, bytes = read_inputs(infilename, args.wholefile)
+   if not inputs then
+      write_error(infilename, ": ", bytes, "\n")
+      return
+   end
+   collectgarbage("collect")
+   run(compiled_pattern, {inputs[1] or ""}, encoder, 1) -- warm up
+   local r = run(compiled_pattern, inputs, encoder, iterations)
+   local elapsed = math.max(r.elapsed, 1e-9)
+   local count = #inputs * iterations
+   local fmt = "%-12s %s\n"
+   io.write(string.format(fmt, "pattern:", args.pattern))
+   io.write(string.format(fmt, "input:",
+			  string.format("%s (%d %s, %d bytes), %d iteration%s, encoder %s",
+					infilename, #inputs, args.wholefile and "file" or "lines",
+					bytes, iterations, (iterations ~= 1) and "s" or "", encoder)))
+   io.write(string.format(fmt, "matched:", string.format("%d of %d", r.matched, count)))
+   io.write(string.format(fmt, "throughput:",
+			  string.format("%.2f MB/s, %.0f lines/s",
+					(bytes * iterations) / elapsed / (1024 * 1024),
+					count / elapsed)))
+   io.write(string.format(fmt, "latency:",
+			  string.format("p50 %d us, p99 %d us", math.floor(r.p50), math.floor(r.p99))))
+   io.write(string.format(fmt, "time:",
+			  string.format("%.1f ms total, %.1f ms in vm (%.0f%%)",
+					r.total / 1000, r.vm / 1000,
+					(r.total > 0) and (100 * r.vm / r.total) or 0)))
+   io.write(string.format(fmt, "peak heap:", string.format("%d KB", math.floor(r.peak_heap))))
+end
+
+return bench
@@ -83,6 +83,11 @@ function p.setup_engine(rosie, en, args)
       en:set_libpath(args.libpath, "CLI")
    end
 
+   -- Turn on the parse cache if there is a cache directory on the command line
+   if args.cachedir then
+      rosie.set_cachedir(args.cachedir)
+   end
+
    -- Override the colors if there is one on the command line
    if args.colors then
       en:set_encoder_parm("colors", args.colors, "CLI")
@@ -8,6 +8,7 @@
 
 local match = {}
 local cli_common = import("cli-common")
+local common = import("common")
 
 local write_error = function(...) io.stderr:write(...) end
 
@@ -48,10 +49,13 @@ function match.process_pattern_against_file(rosie, en, args, compiled_pattern, i
    
    local default_encoder = (args.command=="grep") and "line" or "color"
    local encoder = ((args.encoder ~= "default") and args.encoder) or default_encoder
+   local maxcount = args.maxcount
+   if args.count or args.quiet then encoder = "count"; end
+   if args.quiet then maxcount = 1; end
    
    local ok, msg = readable_file(infilename)
    local printable_infilename = (infilename ~= "") and infilename or "stdin"
-   if (args.verbose) or (#args.filename > 1) then
+   if ((args.verbose) or (#args.filename > 1)) and (not args.quiet) then
       if ok then io.write(printable_infilename, ":\n"); end    -- print name of file before its output
    end
    if not ok then
@@ -66,9 +70,18 @@ function match.process_pattern_against_file(rosie, en, args, compiled_pattern, i
       pcall(match_function, en, compiled_pattern,
 	    infilename, outfilename, errfilename,
 	    encoder,
-	    args.wholefile)
+	    args.wholefile,
+	    maxcount)
 
    if not ok then write_error(cin, "\n"); return; end	-- cin is error message (a string) in this case
+   if cin == -1 then				    -- cout is an error code
+      if cout == common.ERR_CORRUPT_INPUT then
+	 write_error(printable_infilename, ": compressed input could not be decompressed\n")
+      else
+	 write_error(printable_infilename, ": could not be read (error ", tostring(cout), ")\n")
+      end
+      return
+   end
    
    -- (6) Print summary
    if args.verbose then
@@ -77,6 +90,8 @@ function match.process_pattern_against_file(rosie, en, args, compiled_pattern, i
       local cerr_plural = (cerr ~= 1) and "s" or ""
       write_error(string.format(fmt, cin, cin_plural, cout, cerr, cerr_plural))
    end
+   if args.count and (not args.quiet) then io.write(tostring(cout), "\n"); end
+   return cin and cout
 end
 
 return match
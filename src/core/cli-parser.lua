@@ -75,6 +75,21 @@ function p.create(rosie)
    :target("libpath")				    -- args.libpath
    :default(false)
 
+   parser:option("--cachedir", "Directory in which to cache rpl parse trees")
+   :args(1)
+   :target("cachedir")				    -- args.cachedir
+   :default(false)
+
+   parser:flag("--profile", "Count attempts, matches, and failures for each named pattern, and print them to stderr")
+   :default(false)
+   :action("store_true")
+   :target("profile")				    -- args.profile
+
+   parser:flag("--profile-time", "Like --profile, also counting bytes consumed and time (slower)")
+   :default(false)
+   :action("store_true")
+   :target("profile_time")			    -- args.profile_time
+
    parser:option("--colors", "Color/pattern assignments for color output")
    :args(1)
    :target("colors")				    -- args.colors
@@ -135,7 +150,38 @@ function p.create(rosie)
    :default("condensed")
    :target("encoder")
 
-   for _, cmd in ipairs{cmd_match, cmd_trace, cmd_grep} do
+   -- bench command
+   local cmd_bench = parser:command("bench")
+   :description("Measure the throughput and latency of matching the pattern against the input")
+   cmd_bench:option("-o --output", "Output style, one of: " .. output_choices_string)
+   :convert(validate_output_encoder_choice)
+   :args(1) -- consume argument after option
+   :default("bool")
+   :target("encoder")
+   cmd_bench:option("-n --iterations", "Number of times to match the whole input")
+   :args(1)
+   :default("10")
+   :target("iterations")
+
+   for _, cmd in ipairs{cmd_match, cmd_grep} do
+      -- match/grep counting and early exit
+      cmd:flag("-c --count", "Print only the number of matching lines")
+      :default(false)
+      :action("store_true")
+      cmd:flag("-q --quiet", "Print nothing, and stop at the first match; the exit status is zero only if a line matched")
+      :default(false)
+      :action("store_true")
+      cmd:option("-m --max-count", "Stop reading a file after this many matching lines")
+      :convert(function(a)
+		  local n = math.tointeger(tonumber(a))
+		  if n and n > 0 then return n; end
+		  return nil, "max count must be a positive integer, not '" .. a .. "'"
+	       end)
+      :args(1)
+      :target("maxcount")
+   end
+
+   for _, cmd in ipairs{cmd_match, cmd_trace, cmd_grep, cmd_bench} do
       -- match/trace/grep flags (true/false)
       cmd:flag("-w --wholefile", "Read the whole input file as single string")
       :default(false)
@@ -60,6 +60,15 @@ local function greeting()
    io.write("Rosie " .. ROSIE_VERSION .. "\n")
 end
 
+local function print_profile(en, timed)
+   local fmt = timed and "%-40s %10s %10s %10s %12s %10s\n" or "%-40s %10s %10s %10s\n"
+   io.stderr:write(string.format(fmt, "Pattern", "Attempts", "Matches", "Failures", "Bytes", "Time (ms)"))
+   for _, r in ipairs(en:profile_report()) do
+      io.stderr:write(string.format(fmt, r.name, r.attempts, r.matches, r.failures, r.bytes,
+				    string.format("%.1f", r.time)))
+   end
+end
+
 local function make_help_epilog(en)
    return false
 end
@@ -90,6 +99,14 @@ local function run(args)
       return
    end
    
+   -- Profiling counters are compiled into the patterns, so profiling starts before setup
+   if args.profile_time then
+      args.profile = true
+      en:set_profile(true, true)
+   elseif args.profile then
+      en:set_profile(true)
+   end
+
    local compiled_pattern = cli_common.setup_engine(rosie, en, args);
    if type(compiled_pattern)=="number" then -- return the error
       return compiled_pattern
@@ -172,6 +189,13 @@ local function run(args)
 	 print(msg)
 	 return cli_common.ERROR_RESULT
       end
+   elseif args.command == "bench" then
+      local cli_bench = assert(rosie.import("cli-bench"), "failed to open cli bench package")
+      for _,fn in ipairs(args.filename) do
+	 cli_bench.process_pattern_against_file(rosie, en, args, compiled_pattern, fn)
+      end
+      if args.profile then print_profile(en, args.profile_time); end
+      return
    elseif args.command == "repl" then
       local repl_mod = assert(rosie.import("repl"), "failed to open the repl package")
       if not args.verbose then greeting(); end
@@ -179,9 +203,14 @@ local function run(args)
       return
    else
       -- match, trace, grep
+      local matched = 0
       for _,fn in ipairs(args.filename) do
-	 cli_match.process_pattern_against_file(rosie, en, args, compiled_pattern, fn)
+	 -- nil when the file could not be processed (see cli-match)
+	 matched = matched + (cli_match.process_pattern_against_file(rosie, en, args, compiled_pattern, fn) or 0)
+	 if args.quiet and (matched > 0) then break; end
       end
+      if args.profile then print_profile(en, args.profile_time); end
+      if args.quiet and (matched == 0) then return cli_common.ERROR_RESULT; end
    end -- if command is list or repl or other
 end -- function run
 
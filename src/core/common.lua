@@ -115,6 +115,18 @@ common.utf8_char_peg = b1_lead +
 -- > utf8_char_peg:match(face)
 -- 5
 -- >
+
+-- The first set of a pattern is the set of bytes that can begin a match, plus the flag 'empty'
+-- when the pattern can match the empty string.  It is a table with byte values (0-255) as keys.
+-- The compiler uses first sets to skip over input that cannot begin a match.  This function
+-- makes the first set of a peg that matches single bytes.
+function common.first_set(peg, empty)
+   local set = {empty=(empty or nil)}
+   for b = 0, 255 do
+      if peg:match(string.char(b)) then set[b] = true; end
+   end
+   return set
+end
 	    
 common.dirsep = package.config:sub(1, (package.config:find("\n"))-1)
 assert(#common.dirsep==1, "directory separator should be a forward or a backward slash")
@@ -328,7 +340,7 @@ function common.pkgtableset(tbl, importpath, prefix, p, e)
 end
 
 ----------------------------------------------------------------------------------------
--- Binding types: novalue, pattern, macro, pfunction, value, environment
+-- Binding types: novalue, lazy, pattern, macro, pfunction, value, environment
 ----------------------------------------------------------------------------------------
 
 -- environment is defined in environment.lua
@@ -339,6 +351,17 @@ common.novalue =
 		   ast=NIL;
 		})
 
+-- A binding in a lazily imported package that has not been compiled yet (see compile.lua)
+common.lazy =
+   recordtype.new("lazy",
+		  {exported=true;
+		   ast=NIL;			    -- the binding
+		   env=NIL;			    -- the package environment
+		   prefix=NIL;
+		   value=false;			    -- the pattern, once compiled
+		   forcing=false;
+		})
+
 common.taggedvalue =
    recordtype.new("taggedvalue",		    -- tagged values that are not patterns
 		  { type=NIL;
@@ -367,9 +390,15 @@ common.pattern =
 		    peg=NIL;		 -- lpeg pattern
 		    exported=true;	 -- true when the binding to this pattern is exported
 		    uncap=false;	 -- peg without the top-level capture
+		    label=false;	 -- name of the top-level capture, when uncap is set
 		    alias=false;	 -- is this an alias or not
 		    ast=false;		 -- ast that generated this pattern, for pattern debugging
 		    extra=false;	 -- extra info that depends on node type
+		    search_skip=false;	 -- for a search loop, the peg that skips input (see compile.lua)
+		    memoized=false;	 -- for a grammar, true when compiled with memo tables
+		    profiled=false;	 -- for a grammar, true when compiled with profiling counters
+		    first=false;	 -- first set (see common.first_set), or false if unknown
+		    nocap=false;	 -- true when peg is known to produce no captures
 --                  source=unspecified;  -- source (rpl filename and line)
   }
 )
@@ -380,6 +409,10 @@ common.end_of_input_identifier = "$"
 common.start_of_input_identifier = "^"
 common.halt_pattern_identifier = "halt"
 
+-- Milliseconds of processor time, used for match deadlines.  Librosie replaces this with a
+-- monotonic wall clock.
+common.clock_ms = function() return os.clock() * 1000; end
+
 -- This function is connected to the definition in rpl_1_1 of the tokens that constitute
 -- "atmosphere", which is ambient blank lines and comments that should be ignored when creating an
 -- ast. 
@@ -474,6 +507,8 @@ common.MATCH_WITHOUT_DATA = 1   -- for 'bool' output encoder
 common.ERR_NO_ENCODER = 2	-- /* also used for "no trace style" */
 common.ERR_NO_FILE = 3		-- /* no such file or directory */
 common.ERR_NO_PATTERN = 4       -- Not a valid rplx 
+common.ERR_BUFFER_TOO_SMALL = 5 -- Only used by librosie (rosie_match_into)
+common.ERR_CORRUPT_INPUT = 6    -- Compressed input could not be decompressed
 
 local match_without_data = common.MATCH_WITHOUT_DATA -- locals are faster
 
@@ -489,9 +524,27 @@ common.encoder_table =
 		  json = {common.JSON_ENCODING, identity_fn},
 		  byte = {common.BYTE_ENCODING, identity_fn},
 		  bool = {common.LINE_ENCODING, function(...) return match_without_data end},
+		  count = {common.BYTE_ENCODING, function(...) return match_without_data end},
 	       },
 	     {__index = function(...) return error_encoder end})
 
+-- The 'count' encoder returns what 'bool' does, but the match is done with the peg returned by
+-- count_peg, which produces a single empty match node.  The captures made by the original peg
+-- are discarded by the vm (a predicate produces no captures), so no match data is built or
+-- encoded.  Matchfile does not write anything when the encoder is 'count'.
+common.COUNT_ENCODER = "count"
+
+local count_pegs = setmetatable({}, {__mode="k"})
+
+function common.count_peg(peg)
+   local cpeg = count_pegs[peg]
+   if not cpeg then
+      cpeg = lpeg.rcap(-(-peg), "count")
+      count_pegs[peg] = cpeg
+   end
+   return cpeg
+end
+
 function common.lookup_encoder(name)
    if not name then return common.BYTE_ENCODING, common.byte_to_lua; end
    local entry = common.encoder_table[name]
@@ -21,6 +21,7 @@ local locale = common.locale
 
 local ustring = require "ustring"
 local novalue = common.novalue
+local lazy = common.lazy
 local taggedvalue = common.taggedvalue
 local pattern = common.pattern
 local pfunction = common.pfunction
@@ -32,6 +33,7 @@ local recordtype = require "recordtype"
 parent = recordtype.parent
 local environment = require "environment"
 local expand = require "expand"
+local parsecache = require "parsecache"
 
 local function raise_error(msg, a)
    return violation.raise(violation.compile.new{who='compiler',
@@ -105,7 +107,9 @@ local function enqueue_syntax_error(pt, err, source_record, messages)
    return ok
 end
 
-local function make_parser_from(parse_something, expected_pt_node)
+-- When cache_tag is given, parse trees are looked up in (and saved to) the parse cache under
+-- that tag, which must identify the parser.
+local function make_parser_from(parse_something, expected_pt_node, cache_tag)
    return function(source_record, messages)
 	     assert(common.source.is(source_record))
 	     assert(type(messages)=="table", "missing messages arg?")
@@ -126,7 +130,17 @@ local function make_parser_from(parse_something, expected_pt_node)
 	     end
 
 
-	     local pt, syntax_errors, leftover = parse_something(src)
+	     local pt, syntax_errors, leftover
+	     if cache_tag then
+		pt, leftover = parsecache.lookup(cache_tag, src)
+		syntax_errors = {}
+	     end
+	     if not pt then
+		pt, syntax_errors, leftover = parse_something(src)
+		if cache_tag and pt and #syntax_errors==0 and leftover==0 then
+		   parsecache.store(cache_tag, src, pt, leftover)
+		end
+	     end
 	     if PROFILE then
 		profile_println("compile.parse_block time = ", time(t0), "ms")
 	     end
@@ -177,7 +191,9 @@ end
 
 function c2.make_parse_block(rplx_preparse, rplx_statements, supported_version)
    local parse_block = parse.make_parse_block(rplx_preparse, rplx_statements, supported_version)
-   return make_parser_from(parse_block, "rpl_statements")
+   local cache_tag = "rpl_statements " .. tostring(supported_version.major) .. "." ..
+      tostring(supported_version.minor)
+   return make_parser_from(parse_block, "rpl_statements", cache_tag)
 end
 
 function c2.make_parse_expression(rplx_expression)
@@ -194,18 +210,88 @@ c2.dependencies_of = ast.dependencies_of
 c2.expand_block = expand.block
 c2.expand_expression = expand.expression
 
+---------------------------------------------------------------------------------------------------
+-- First sets
+---------------------------------------------------------------------------------------------------
+
+-- Each pattern records its first set (see common.first_set) when it can be computed cheaply, and
+-- false otherwise (e.g. for grammars and function applications).  A first set may contain bytes
+-- that cannot in fact begin a match, but never omits one.
+
+local ALL_BYTES = common.first_set(P(1))
+
+local function add_bytes(new, set)
+   for b = 0, 255 do
+      if set[b] then new[b] = true; end
+   end
+end
+
+local function first_copy(set, empty)
+   if not set then return false; end
+   local new = {empty=(empty or set.empty)}
+   add_bytes(new, set)
+   return new
+end
+
+-- Any of the alternatives may match
+local function first_union(sets)
+   local new = {}
+   for _, set in ipairs(sets) do
+      if not set then return false; end
+      add_bytes(new, set)
+      new.empty = new.empty or set.empty
+   end
+   return new
+end
+
+-- The matches of each item can begin where the items before it matched the empty string
+local function first_sequence(sets)
+   local new = {}
+   for _, set in ipairs(sets) do
+      if not set then return false; end
+      add_bytes(new, set)
+      if not set.empty then return new; end
+   end
+   new.empty = true
+   return new
+end
+
+-- The first set of (dot - p) where p matches single characters, and set is the first set of p.
+-- An ascii byte is a character by itself, so it begins a match of (dot - p) only if p does not
+-- match it.  Other bytes may begin a multi-byte character that p does not match.
+local function first_complement(set)
+   local new = {}
+   for b = 0, 255 do
+      if (b >= 0x80) or not set[b] then new[b] = true; end
+   end
+   return new
+end
+
+local function first_of_range(b1, b2)
+   local new = {}
+   for b = b1, b2 do new[b] = true; end
+   return new
+end
+
+local function first_of_chars(chars)
+   local new = {}
+   for _, char in ipairs(chars) do new[string.byte(char)] = true; end
+   return new
+end
+
 ---------------------------------------------------------------------------------------------------
 -- Compile expressions
 ---------------------------------------------------------------------------------------------------
 
-local expression;
+local expression, compile_expression;
 
 local function literal(a, env, prefix, messages)
    local str, offense = ustring.unescape_string(a.value)
    if not str then
       raise_error(tostring(offense), a)
    end
-   a.pat = pattern.new{name="literal"; peg=P(str); ast=a}
+   local first = (#str > 0) and {[string.byte(str)]=true} or {empty=true}
+   a.pat = pattern.new{name="literal"; peg=P(str); ast=a; first=first; nocap=true}
    return a.pat
 end
 
@@ -242,7 +328,7 @@ local function sequence(a, env, prefix, messages)
    -- The meaning of a sequence of 1 item is the meaning of the item itself.
    if #a.exps == 1 then
       if pattern.is(e) then
-	 a.pat = pattern.new{name="sequence", peg=e.peg, ast=a}
+	 a.pat = pattern.new{name="sequence", peg=e.peg, ast=a, first=e.first, nocap=e.nocap}
 	 return a.pat
       else
 	 return e				    -- a taggedvalue
@@ -251,39 +337,109 @@ local function sequence(a, env, prefix, messages)
 --   assert(#a.exps > 1)
    check_pattern(e, a.exps[1])
    local peg = e.peg
+   local firsts, nocap = {e.first}, e.nocap
    for i = 2, #a.exps do
       e = expression(a.exps[i], env, prefix, messages)
       check_pattern(e, a.exps[i])
       peg = peg * e.peg
+      firsts[i], nocap = e.first, nocap and e.nocap
    end
-   a.pat = pattern.new{name="sequence", peg=peg, ast=a}
+   a.pat = pattern.new{name="sequence", peg=peg, ast=a, first=first_sequence(firsts), nocap=nocap}
    return a.pat
 end
 
+-- A wide ordered choice is tried one alternative after another.  When the first sets of the
+-- alternatives show that, for most input bytes, most alternatives cannot match, the choice is
+-- compiled instead into a binary decision tree on the next input byte.  Each leaf of the tree
+-- is the ordered choice of the alternatives that can begin with the bytes of that leaf, in
+-- their original order, so the semantics of ordered choice are unchanged.  The alternatives
+-- that can match the empty string (or whose first set is unknown) are in every leaf, and are
+-- the only ones tried at the end of the input.
+
+local CHOICE_DISPATCH_MIN = 8			    -- fewer alternatives are tried in order
+
+local function choice_dispatch(pegs, firsts)
+   local n = #pegs
+   if n < CHOICE_DISPATCH_MIN then return nil; end
+   local leaves, leaf_for = {}, {}
+   local anywhere = {}
+   local tries, bytes = 0, 0
+   for i = 1, n do
+      if (not firsts[i]) or firsts[i].empty then table.insert(anywhere, i); end
+   end
+   for b = 0, 255 do
+      local alts = {}
+      for i = 1, n do
+	 if (not firsts[i]) or firsts[i].empty or firsts[i][b] then table.insert(alts, i); end
+      end
+      if #alts > 0 then
+	 tries, bytes = tries + #alts, bytes + 1
+	 local key = table.concat(alts, ",")
+	 local leaf = leaf_for[key]
+	 if not leaf then
+	    leaf = {bytes={}, alts=alts}
+	    leaf_for[key] = leaf
+	    table.insert(leaves, leaf)
+	 end
+	 table.insert(leaf.bytes, string.char(b))
+      end
+   end
+   -- Each alternative is copied into every leaf it appears in, which limits how much overlap
+   -- among the first sets is worth it.
+   local size = 0
+   for _, leaf in ipairs(leaves) do size = size + #leaf.alts; end
+   if (#leaves < 2) or (tries > bytes * n / 2) or (size > 2 * n) then return nil; end
+   local function ordered(alts)
+      local peg = pegs[alts[1]]
+      for k = 2, #alts do peg = peg + pegs[alts[k]]; end
+      return peg
+   end
+   local function byteset(i, j)
+      local chars = {}
+      for k = i, j do table.insert(chars, table.concat(leaves[k].bytes)); end
+      return S(table.concat(chars))
+   end
+   local function tree(i, j)
+      if i == j then return ordered(leaves[i].alts); end
+      local mid = (i + j) // 2
+      return #byteset(i, mid) * tree(i, mid) + #byteset(mid+1, j) * tree(mid+1, j)
+   end
+   local peg = #P(1) * tree(1, #leaves)
+   if #anywhere > 0 then peg = peg + (-P(1)) * ordered(anywhere); end
+   return peg
+end
+
 local function choice(a, env, prefix, messages)
 --   assert(#a.exps > 0, "empty choice?")
-   local peg = expression(a.exps[1], env, prefix, messages).peg
+   local e = expression(a.exps[1], env, prefix, messages)
+   local peg, pegs, firsts, nocap = e.peg, {e.peg}, {e.first}, e.nocap
    for i = 2, #a.exps do
-      peg = peg + expression(a.exps[i], env, prefix, messages).peg
+      e = expression(a.exps[i], env, prefix, messages)
+      peg = peg + e.peg
+      pegs[i], firsts[i], nocap = e.peg, e.first, nocap and e.nocap
    end
-   a.pat = pattern.new{name="choice", peg=peg, ast=a}
+   peg = choice_dispatch(pegs, firsts) or peg
+   a.pat = pattern.new{name="choice", peg=peg, ast=a, first=first_union(firsts), nocap=nocap}
    return a.pat
 end
 
 local function and_exp(a, env, prefix, messages)
 --   assert(#a.exps > 0, "empty and_exp?")
    local last = #a.exps
-   local peg = expression(a.exps[last], env, prefix, messages).peg
+   local e = expression(a.exps[last], env, prefix, messages)
+   local peg, nocap = e.peg, e.nocap
    for i = last-1, 1, -1 do
       local lookat = expression(a.exps[i], env, prefix, messages)
       peg = #lookat.peg * peg
+      nocap = nocap and lookat.nocap
    end
-   a.pat = pattern.new{name="and_exp", peg=peg, ast=a}
+   a.pat = pattern.new{name="and_exp", peg=peg, ast=a, first=e.first, nocap=nocap}
    return a.pat
 end
 
 local function predicate(a, env, prefix, messages)
-   local peg = expression(a.exp, env, prefix, messages).peg
+   local e = expression(a.exp, env, prefix, messages)
+   local peg = e.peg
    if a.type=="lookahead" then
       peg = #peg
    elseif a.type=="lookbehind" then
@@ -306,7 +462,7 @@ local function predicate(a, env, prefix, messages)
    else
       raise_error("invalid predicate type: " .. tostring(a.type), a)
    end
-   a.pat = pattern.new{name="predicate", peg=peg, ast=a}
+   a.pat = pattern.new{name="predicate", peg=peg, ast=a, first={empty=true}, nocap=e.nocap}
    return a.pat
 end
 
@@ -317,27 +473,72 @@ local function lookup_builtin(name, env, a)
    return pat.peg
 end
 
+local named_first = {}
+
 local function cs_named(a, env, prefix, messages)
    local dot = lookup_builtin('.', env, a)
    local peg = locale[a.name]
    if not peg then
       raise_error("unknown named charset: " .. a.name, a)
    end
-   a.pat = pattern.new{name="cs_named", peg=((a.complement and dot-peg) or peg), ast=a}
+   local first = named_first[a.name] or common.first_set(peg)
+   named_first[a.name] = first
+   a.pat = pattern.new{name="cs_named",
+		       peg=((a.complement and dot-peg) or peg),
+		       ast=a,
+		       first=((a.complement and first_complement(first)) or first),
+		       nocap=true}
    return a.pat
 end
 
--- FUTURE optimization: The multi-byte chars can be organized by common prefix. 
-local function utf8_range_to_peg(cp1, cp2)
-   local peg = lpeg.P(false)
-   for cp = cp1, cp2 do
-      local char = utf8.char(cp)
-      if not char then return nil, "invalid unicode codepoint: " .. tostring(cp); end
-      peg = peg + lpeg.P(char)
+-- A range of codepoints is compiled the way regex engines do it: it is split into
+-- sub-ranges whose UTF-8 encodings differ only in their trailing bytes, and each sub-range
+-- becomes a sequence of byte ranges.  E.g. [\u4e00-\u9fff] becomes two sequences, the first
+-- of which is R("\xE4\xE4") * R("\xB8\xBF") * R("\x80\xBF").  (A choice among the
+-- codepoints would have one alternative per codepoint.)
+
+local utf8_length_limits = {0x7F, 0x7FF, 0xFFFF, 0x1FFFFF, 0x3FFFFFF}
+
+local function utf8_byte_ranges(cp1, cp2)
+   local first, last = utf8.char(cp1), utf8.char(cp2)
+   local peg = P(true)
+   for i = 1, #first do
+      peg = peg * R(first:sub(i,i) .. last:sub(i,i))
    end
    return peg
 end
 
+local function utf8_split_range(cp1, cp2)
+   -- Split where the length of the encoding changes
+   for _, limit in ipairs(utf8_length_limits) do
+      if cp1 <= limit and cp2 > limit then
+	 return utf8_split_range(cp1, limit) + utf8_split_range(limit+1, cp2)
+      end
+   end
+   if cp2 <= 0x7F then return R(string.char(cp1, cp2)); end
+   -- Split until all the bytes after the first differing one span their full range
+   for i = 1, #utf8.char(cp1) - 1 do
+      local m = (1 << (6*i)) - 1
+      if (cp1 & ~m) ~= (cp2 & ~m) then
+	 if (cp1 & m) ~= 0 then
+	    return utf8_split_range(cp1, cp1 | m) + utf8_split_range((cp1 | m) + 1, cp2)
+	 end
+	 if (cp2 & m) ~= m then
+	    return utf8_split_range(cp1, (cp2 & ~m) - 1) + utf8_split_range(cp2 & ~m, cp2)
+	 end
+      end
+   end
+   return utf8_byte_ranges(cp1, cp2)
+end
+
+local function utf8_range_to_peg(cp1, cp2)
+   local ok, char = pcall(utf8.char, cp2)
+   if (not ok) or (not char) or (cp1 < 0) then
+      return nil, "invalid unicode codepoint: " .. tostring((cp1 < 0) and cp1 or cp2)
+   end
+   return utf8_split_range(cp1, cp2)
+end
+
 local function cs_range(a, env, prefix, messages)
    local dot = lookup_builtin('.', env, a)
    local c1, c2 = a.first, a.last
@@ -349,7 +550,12 @@ local function cs_range(a, env, prefix, messages)
 	 raise_error("character range contains only one character", a)
       end
       local peg = R(c1..c2)
-      a.pat = pattern.new{name="cs_range", peg=(a.complement and (dot-peg)) or peg, ast=a}
+      local first = first_of_range(string.byte(c1), string.byte(c2))
+      a.pat = pattern.new{name="cs_range",
+			  peg=(a.complement and (dot-peg)) or peg,
+			  ast=a,
+			  first=(a.complement and first_complement(first)) or first,
+			  nocap=true}
       return a.pat
    else
       -- At least one edge is a multi-byte character
@@ -372,29 +578,67 @@ local function cs_range(a, env, prefix, messages)
       end
       local peg, msg = utf8_range_to_peg(cp1, cp2)
       if not peg then raise_error(msg, a); end
-      a.pat = pattern.new{name="cs_range", peg=(a.complement and (dot-peg)) or peg, ast=a}
+      -- The lead byte of an encoding increases with the codepoint
+      local first = first_of_range(string.byte(utf8.char(cp1)), string.byte(utf8.char(cp2)))
+      a.pat = pattern.new{name="cs_range",
+			  peg=(a.complement and (dot-peg)) or peg,
+			  ast=a,
+			  first=(a.complement and first_complement(first)) or first,
+			  nocap=true}
       return a.pat
    end
 end
 
--- FUTURE optimization: The multi-byte chars can be organized by common prefix. 
--- Note that this approach works for non-UTF8 characters as well.  
+-- The chars are organized in a trie by common prefix, so that matching costs one test per
+-- byte instead of one per char.  Note that this approach works for non-UTF8 characters as
+-- well.  Ordered choice is preserved because no char is a prefix of another (when one is, we
+-- fall back to a plain choice).
+local function charlist_trie_to_peg(node)
+   local singles, peg = {}, P(false)
+   for byte, child in pairs(node) do
+      if next(child) then
+	 peg = peg + P(byte) * charlist_trie_to_peg(child)
+      else
+	 table.insert(singles, byte)
+      end
+   end
+   if #singles > 0 then peg = S(table.concat(singles)) + peg; end
+   return peg
+end
+
 local function utf8_charlist_to_peg(chars)
-   local peg = lpeg.P(false)
+   local trie = {}
    for _, char in ipairs(chars) do
       -- Length 1 is enforced by ustring.explode, called during ast creation:
 --      assert(ustring.len(char)==1)	
-      peg = peg + lpeg.P(char)
+      local node = trie
+      for i = 1, #char do
+	 local byte = char:sub(i,i)
+	 if node[byte] and (i==#char or not next(node[byte])) then
+	    node = nil				    -- char is a prefix of another char
+	    break
+	 end
+	 node[byte] = node[byte] or {}
+	 node = node[byte]
+      end
+      if not node then
+	 local peg = P(false)
+	 for _, char in ipairs(chars) do peg = peg + P(char); end
+	 return peg
+      end
    end
-   return peg
+   return charlist_trie_to_peg(trie)
 end
 
 function cs_list(a, env, prefix, messages)
    local dot = lookup_builtin('.', env, a)
    local alternatives = utf8_charlist_to_peg(a.chars)
+   local first = first_of_chars(a.chars)
    a.pat = pattern.new{name="cs_list",
 		      peg=(a.complement and (dot-alternatives) or alternatives),
-		      ast=a}
+		      ast=a,
+		      first=(a.complement and first_complement(first)) or first,
+		      nocap=true}
    return a.pat
 end
 
@@ -412,7 +656,11 @@ function bracket(a, env, prefix, messages)
       end
    else
       local p = expression(a.cexp, env, prefix, messages)
-      a.pat = pattern.new{name="bracket", peg=((a.complement and (dot-p.peg)) or p.peg), ast=a}
+      a.pat = pattern.new{name="bracket",
+			  peg=((a.complement and (dot-p.peg)) or p.peg),
+			  ast=a,
+			  first=((a.complement and ALL_BYTES) or p.first),
+			  nocap=p.nocap}
       return a.pat
    end
 end
@@ -436,6 +684,8 @@ local function wrap_pattern(pat, name, optional_force_flag)
       pat.uncap = pat.peg
       pat.peg = common.match_node_wrap(pat.peg, name)
    end
+   pat.label = name
+   pat.nocap = false
 end
 
 local function throw_grammar_error(a, message)
@@ -449,6 +699,299 @@ local function throw_grammar_error(a, message)
    raise_error("peg compilation error: " .. message, a)
 end
 
+-- We cannot just run peg:match("") because a lookahead expression will return nil (i.e. it will
+-- not match the empty string), even though it cannot be put into a loop (because it consumes no
+-- input).
+local function matches_empty(peg)
+   local ok, msg = pcall(function() return peg^1 end)
+   return (not ok) and msg:find("loop body may accept empty string")
+end
+
+---------------------------------------------------------------------------------------------------
+-- Profiling
+---------------------------------------------------------------------------------------------------
+-- While an engine is profiling (see engine:set_profile), each reference to a named pattern in
+-- the patterns it compiles is wrapped with counters for that name: the number of matches and the
+-- number of failures (backtracks), which add up to the attempts.  Each exit from the pattern
+-- costs one Cmt, on success or on failure.  With timing on, a third Cmt on entry records where
+-- and when each attempt started, so that the bytes consumed by the matches and the time from
+-- each attempt to its exit are counted as well.  This time is inclusive: it counts the time
+-- spent in the patterns that the named pattern refers to.
+--
+-- The counters are kept in the engine's profile table, so they accumulate across matches until
+-- the engine resets them.  Like the match limits, profiling is a compile-time setting, so to
+-- profile the patterns in a package, turn profiling on before importing it.
+
+local profile = false				    -- engine profile table when compiling counters
+local profile_compiled = false
+local profile_pos, profile_time, profile_depth = {}, {}, 0
+
+local prelude_ids = {[common.any_char_identifier]=true,
+		     [common.boundary_identifier]=true,
+		     [common.end_of_input_identifier]=true,
+		     [common.start_of_input_identifier]=true}
+
+-- Set the profile table {on=, time=, rules=} of the engine that is compiling
+function c2.set_profile(p)
+   profile = p or false
+end
+
+-- Return peg wrapped with the counters for name, if counters are being compiled
+local function profiled(peg, name)
+   if not (profile and profile.on) then return peg; end
+   profile_compiled = true
+   local counters = profile.rules[name]
+   if not counters then
+      counters = {matches=0, failures=0, bytes=0, time=0}
+      profile.rules[name] = counters
+   end
+   if not profile.time then
+      local function matched()
+	 counters.matches = counters.matches + 1
+	 return true
+      end
+      local function failed()
+	 counters.failures = counters.failures + 1
+	 return false
+      end
+      return peg * Cmt(P(true), matched) + Cmt(P(true), failed)
+   end
+   local function enter(s, i)
+      local d = profile_depth + 1
+      profile_pos[d] = i
+      profile_time[d] = common.clock_ms()
+      profile_depth = d
+      return true
+   end
+   local function leave(d)
+      counters.time = counters.time + (common.clock_ms() - profile_time[d])
+      profile_depth = d - 1
+   end
+   local function matched(s, i)
+      local d = profile_depth
+      counters.matches = counters.matches + 1
+      counters.bytes = counters.bytes + (i - profile_pos[d])
+      leave(d)
+      return true
+   end
+   local function failed(s, i)
+      counters.failures = counters.failures + 1
+      leave(profile_depth)
+      return false
+   end
+   return Cmt(P(true), enter) * (peg * Cmt(P(true), matched) + Cmt(P(true), failed))
+end
+
+---------------------------------------------------------------------------------------------------
+-- Limits on the work done by one match
+---------------------------------------------------------------------------------------------------
+-- While an engine has a step limit or a time limit (see engine:set_match_limits), the patterns
+-- it compiles contain checkpoints: one at the start of each grammar rule, and one before each
+-- iteration of a search loop (see search_skip).  Other repetitions do not backtrack into
+-- themselves, so the work they do is bounded by the input.  Each checkpoint is a Cmt that counts
+-- a step, and when the match has taken more steps than the limit, or has run past its deadline,
+-- the match is halted.  A halted match returns with abend set, as if it had matched 'halt'.
+--
+-- Whether a pattern is limited is fixed when it is compiled: a pattern compiled (or imported)
+-- while the engine had no limit contains no checkpoints, and setting a limit later does not
+-- change it.  The values of the limits are read from the engine's table when each match starts,
+-- so they can be changed, or turned off, between calls.  Once any checkpoint has been compiled,
+-- every pattern compiled afterwards starts by resetting the budget (one Cmt per match), so that
+-- the checkpoints in the bindings it refers to count against that match.
+
+local match_limits = false			    -- engine limits when compiling checkpoints
+local checkpoints_compiled = false		    -- never reset (see above)
+local budget = {count=0, steps=false, deadline=false, limits=false}
+
+-- The deadline is checked every 'clock_interval' steps, because reading the clock costs more
+-- than counting.
+local clock_interval = 256
+
+local function over_limit()
+   local limits = budget.limits
+   if not (limits and (limits.steps or limits.ms)) then return false; end
+   local n = budget.count + 1
+   budget.count = n
+   if budget.steps and n > budget.steps then return true; end
+   return budget.deadline and (n % clock_interval == 0) and (common.clock_ms() > budget.deadline)
+end
+
+local function start_match(limits)
+   return function()
+	     budget.limits = limits
+	     budget.count = 0
+	     budget.steps = limits and limits.steps
+	     budget.deadline = limits and limits.ms and (common.clock_ms() + limits.ms)
+	     profile_depth = 0			    -- a halted match may have left it set
+	     return true
+	  end
+end
+
+-- A peg that starts a match for the checkpoints and profiling counters of an engine with the
+-- given limits table.  See c2.compile_expression, and trace.internal, which matches pegs of its
+-- own.
+function c2.match_start(limits)
+   return Cmt(P(true), start_match(limits))
+end
+
+-- Set the limits table {steps=, ms=} of the engine that is compiling
+function c2.set_match_limits(limits)
+   match_limits = limits or false
+end
+
+-- Return peg preceded by a checkpoint, if checkpoints are being compiled
+local function checkpoint(peg)
+   if not (match_limits and (match_limits.steps or match_limits.ms)) then return peg; end
+   checkpoints_compiled = true
+   return (Cmt(P(true), over_limit) * lpeg.Halt() + P(true)) * peg
+end
+
+---------------------------------------------------------------------------------------------------
+-- Memoization of grammar rules
+---------------------------------------------------------------------------------------------------
+-- A grammar can backtrack exponentially, trying the same rule at the same position over and
+-- over.  When memoization is on (see c2.set_memoize), each rule of a grammar records the
+-- positions at which it failed, and fails at once when tried there again.  A rule that produces
+-- no captures also records where each of its matches ended, and is not run again at the same
+-- position.  A rule that captures is run again each time it is tried where it succeeded before,
+-- because captures cannot be replayed.  Only failures are saved for such rules, so a grammar
+-- whose rules mostly capture and mostly succeed gains little.
+--
+-- Each entry of a memo table holds the generation in which it was made, and the generation is
+-- incremented each time the grammar is entered, so the tables do not need to be cleared between
+-- matches.  They grow, though, to one entry per position tried, so when the grammar is entered
+-- and its tables hold more than memo_table_limit entries, they are replaced by empty ones.
+--
+-- Memoization is a compile-time setting: it applies to the grammars compiled while it is on.
+
+local memoize = false
+local compiling_grammar = false			    -- innermost grammar being memoized
+local memo_table_limit = 65536
+
+function c2.set_memoize(flag)
+   memoize = (flag and true) or false
+end
+
+local function new_memo_tables(tables)
+   tables.failed, tables.matched, tables.ends = {}, {}, {}
+   return tables
+end
+
+local function memoize_rule(peg, memo, nocap, nullable)
+   local tables = new_memo_tables({})
+   table.insert(memo.tables, tables)
+   local function not_failed(s, i) return tables.failed[i] ~= memo.generation; end
+   local function record_failure(s, i)
+      tables.failed[i] = memo.generation
+      memo.entries = memo.entries + 1
+      return false
+   end
+   local fail = Cmt(P(true), record_failure) * P(false)
+   if not nocap then
+      return Cmt(P(true), not_failed) * (peg + fail)
+   end
+   local function record_match(s, i, start)
+      tables.matched[start], tables.ends[start] = memo.generation, i
+      memo.entries = memo.entries + 1
+      return true
+   end
+   local hit
+   if nullable then
+      hit = Cmt(P(true), function(s, i)
+			    return (tables.matched[i] == memo.generation) and tables.ends[i]
+			 end)
+   else
+      -- Consuming a byte here keeps lpeg from considering the rule nullable
+      hit = Cmt(P(1), function(s, i)
+			 return (tables.matched[i-1] == memo.generation) and tables.ends[i-1]
+		      end)
+   end
+   return hit + Cmt(P(true), not_failed) * (Cmt(lpeg.Cp() * peg, record_match) + fail)
+end
+
+-- TRUE when the expression a, in a grammar whose rules are nullable as recorded in nullable
+-- (so far), can match the empty string.  Where the first set of a node is known, it says.
+-- Otherwise the node refers to a rule, directly or not, and is taken apart.  A node that cannot
+-- be taken apart is assumed nullable unless lpeg can show otherwise.
+local function nullable_exp(a, nullable)
+   local pat = a.pat
+   if pat and pat.first then return pat.first.empty and true or false; end
+   if ast.ref.is(a) and (not a.packagename) and (nullable[a.localname] ~= nil) then
+      return nullable[a.localname]
+   elseif ast.sequence.is(a) then
+      for _, exp in ipairs(a.exps) do
+	 if not nullable_exp(exp, nullable) then return false; end
+      end
+      return true
+   elseif ast.choice.is(a) then
+      for _, exp in ipairs(a.exps) do
+	 if nullable_exp(exp, nullable) then return true; end
+      end
+      return false
+   elseif ast.and_exp.is(a) then
+      return nullable_exp(a.exps[#a.exps], nullable)
+   elseif ast.atleast.is(a) then
+      return (a.min == 0) or nullable_exp(a.exp, nullable)
+   elseif ast.atmost.is(a) or ast.predicate.is(a) then
+      return true
+   end
+   return (not pat) or (not pcall(function() return pat.peg^1 end))
+end
+
+-- Here t is the table of rule pegs (with the start rule name at t[1]), exps holds the ast of
+-- the expression of each rule, and info holds the rules that each rule refers to.  Returns
+-- the memoizing grammar peg, or nil and an error.
+local function memoize_grammar(t, pats, exps, info)
+   -- A rule produces no captures if it is an alias, if its own expression produces none, and
+   -- if the same is true of each rule it refers to.
+   local nocap = {}
+   for id, pat in pairs(pats) do nocap[id] = pat.nocap and (not info.outer[id]); end
+   local changed = true
+   while changed do
+      changed = false
+      for id, deps in pairs(info.deps) do
+	 if nocap[id] then
+	    for dep in pairs(deps) do
+	       if not nocap[dep] then
+		  nocap[id], changed = false, true
+		  break
+	       end
+	    end
+	 end
+      end
+   end
+   -- A rule is nullable if its expression is, given the rules found nullable so far.  Starting
+   -- with none, this reaches the least fixed point in at most one pass per rule.
+   local nullable = {}
+   for id in pairs(pats) do nullable[id] = false; end
+   changed = true
+   while changed do
+      changed = false
+      for id, exp in pairs(exps) do
+	 if (not nullable[id]) and nullable_exp(exp, nullable) then
+	    nullable[id], changed = true, true
+	 end
+      end
+   end
+   local memo = {generation=0, entries=0, tables={}}
+   local mt = {t[1]}
+   for id, peg in pairs(t) do
+      if type(id)=="string" then
+	 mt[id] = memoize_rule(peg, memo, nocap[id], nullable[id])
+      end
+   end
+   local ok, peg = pcall(P, mt)
+   if not ok then return nil, peg; end
+   return Cmt(P(true), function()
+			  memo.generation = memo.generation + 1
+			  if memo.entries > memo_table_limit then
+			     for _, tables in ipairs(memo.tables) do new_memo_tables(tables); end
+			     memo.entries = 0
+			  end
+			  return true
+		       end) * peg
+end
+
 ---------------------------------------------------------------------------------------------------
 -- How captures in a grammar are labeled:
 ---------------------------------------------------------------------------------------------------
@@ -488,6 +1031,7 @@ local function grammar(a, env, prefix, messages)
    end
    local grammar_id = rules[1].ref.localname
    local labels = {}
+   local info = memoize and {deps={}, outer={}, current=false, parent=compiling_grammar}
    -- First pass: Collect rule names as V() refs into a new env, and create a capture label for
    -- each one.  Also do some error checking.
    for _, rule in ipairs(rules) do
@@ -496,25 +1040,35 @@ local function grammar(a, env, prefix, messages)
       assert(type(rule.ref.localname)=="string")
       local id = rule.ref.localname
       labels[id] = (id == grammar_id) and common.compose_id{prefix, id} or common.compose_id{prefix, grammar_id, id}
-      gtable:bind(id, pattern.new{name=id, peg=V(id), alias=rule.is_alias})
+      gtable:bind(id, pattern.new{name=id, peg=V(id), alias=rule.is_alias,
+				  -- When memoizing, assume for now that an alias captures nothing
+				  nocap=(info and rule.is_alias) or false,
+				  extra=(info and {grammar=info, id=id}) or false})
       common.note("grammar: binding " .. id)
    end
    -- Second pass: compile right hand sides in gtable environment
-   local pats = {}
+   local pats, exps = {}, {}
    local start, grammar_is_local
+   if info then compiling_grammar = info; end
    for _, rule in ipairs(rules) do
       local id = rule.ref.localname
       if not start then
 	 start=id				    -- first rule is start rule
 	 grammar_is_local = rule.is_local
       end
+      if info then
+	 info.current = id
+	 info.deps[id] = {}
+      end
       common.note("grammar: compiling " .. tostring(rule.exp))
       pats[id] = expression(rule.exp, gtable, prefix, messages)
+      exps[id] = rule.exp
       if (not rule.is_alias) then wrap_pattern(pats[id], labels[id]); end
    end -- for
+   if info then compiling_grammar = info.parent; end
    -- Third pass: create the table that will create the LPEG grammar 
    local t = {}
-   for id, pat in pairs(pats) do t[id] = pat.peg; end
+   for id, pat in pairs(pats) do t[id] = checkpoint(pat.peg); end
    t[1] = start					    -- first rule is start rule
    local aliasflag = gtable:lookup(t[1]).alias
    local success, peg_or_msg = pcall(P, t)	    -- P(t)
@@ -522,21 +1076,50 @@ local function grammar(a, env, prefix, messages)
       assert(type(peg_or_msg)=="string")
       throw_grammar_error(a, peg_or_msg)
    end
+   if info then
+      local peg, msg = memoize_grammar(t, pats, exps, info)
+      if not peg then throw_grammar_error(a, msg); end
+      peg_or_msg = peg
+   end
    a.pat = pattern.new{name="grammar",
 		      peg=peg_or_msg,
 		      uncap=nil,		    -- Even if this grammar is an alias.
 		      ast=a,
 		      alias=aliasflag,
-		      exported=(not grammar_is_local)}
+		      exported=(not grammar_is_local),
+		      memoized=(info and true) or false,
+		      profiled=(profile and profile.on) or false}
    return a.pat
 end
 
--- We cannot just run peg:match("") because a lookahead expression will return nil (i.e. it will
--- not match the empty string), even though it cannot be put into a loop (because it consumes no
--- input).
-local function matches_empty(peg)
-   local ok, msg = pcall(function() return peg^1 end)
-   return (not ok) and msg:find("loop body may accept empty string")
+-- A search loop, {!x .}*, tries x at every character.  When the first set of x is known and x
+-- cannot match the empty string, the characters that cannot begin a match of x are skipped
+-- without trying x.  If the first set holds only ascii bytes, which always begin a character,
+-- the skipping can go a byte at a time, which lpeg does with a single span instruction.
+local function search_skip(a, env)
+   if not (ast.sequence.is(a) and #a.exps==2) then return nil; end
+   local neg, any = a.exps[1], a.exps[2]
+   if not (ast.predicate.is(neg) and neg.type=="negation" and
+	   ast.ref.is(any) and any.localname==common.any_char_identifier and
+	   (not any.packagename)) then
+      return nil
+   end
+   local first = pattern.is(neg.exp.pat) and neg.exp.pat.first
+   if (not first) or first.empty then return nil; end
+   local bytes, ascii = {}, true
+   for b = 0, 255 do
+      if first[b] then
+	 table.insert(bytes, string.char(b))
+	 ascii = ascii and (b < 0x80)
+      end
+   end
+   if #bytes == 256 then return nil; end
+   local set = S(table.concat(bytes))
+   if ascii then
+      return (P(1) - set)^1
+   else
+      return (-set * lookup_builtin(common.any_char_identifier, env, any))^1
+   end
 end
 
 local function rep(a, env, prefix, messages)
@@ -547,21 +1130,85 @@ local function rep(a, env, prefix, messages)
    end
    a.exp.pat = epat
    if ast.atleast.is(a) then
-      a.pat = pattern.new{name="atleast", peg=(epeg)^(a.min), ast=a}
+      local skip = (a.min==0) and search_skip(a.exp, env)
+      local first = first_copy(epat.first, (a.min==0))
+      if skip then
+	 a.pat = pattern.new{name="atleast", peg=(skip + checkpoint(epeg))^0, ast=a, first=first,
+			     nocap=epat.nocap, search_skip=skip}
+      else
+	 a.pat = pattern.new{name="atleast", peg=epeg^(a.min), ast=a, first=first,
+			     nocap=epat.nocap}
+      end
    elseif ast.atmost.is(a) then
-      a.pat = pattern.new{name="atmost", peg=(epeg)^(-a.max), ast=a}
+      a.pat = pattern.new{name="atmost", peg=epeg^(-a.max), ast=a,
+			  first=first_copy(epat.first, true), nocap=epat.nocap}
    else
       assert(false, "invalid ast node dispatched to 'rep': " .. tostring(a))
    end
    return a.pat
 end
 
+---------------------------------------------------------------------------------------------------
+-- Lazy import
+---------------------------------------------------------------------------------------------------
+
+-- When lazy is true, the bindings of an imported package are not compiled when the package is
+-- loaded.  Each is bound to a lazy object, which is compiled the first time a reference to it
+-- is compiled.  The resulting pattern replaces the lazy object in the package environment, and
+-- is kept in the lazy object for other environments that hold it (e.g. after 'import foo as .').
+
+local lazy_import = false
+
+function c2.set_lazy_import(flag)
+   lazy_import = (flag and true) or false
+end
+
+local bind_pattern;
+
+local function force(thunk, name, a, messages)
+   if thunk.value then return thunk.value; end
+   if thunk.forcing then
+      raise_error("mutual dependencies detected among the bindings of " .. name, a)
+   end
+   local b = thunk.ast
+   local inner_grammar = compiling_grammar
+   thunk.forcing = true
+   local pat = compile_expression(b.exp, thunk.env, thunk.prefix, messages)
+   thunk.forcing = false
+   compiling_grammar = inner_grammar
+   if not pat then violation.raise(table.remove(messages)); end
+   check_pattern(pat, b)
+   bind_pattern(b, pat, thunk.env, thunk.prefix)
+   thunk.value = pat
+   return pat
+end
+
 local function ref(a, env, prefix, messages)
    local pat = env:lookup(a.localname, a.packagename)
    local name = common.compose_id{a.packagename, a.localname}
    if (not pat) then raise_error("unbound identifier: " .. name, a); end
+   if lazy.is(pat) then pat = force(pat, name, a, messages); end
    check_pattern(pat, a)
-   a.pat = pattern.new{name=a.localname, peg=pat.peg, alias=pat.alias, ast=pat.ast, uncap=pat.uncap}
+   local rule = pat.extra
+   if rule and rule.grammar then
+      -- A reference to a rule of a grammar being memoized.  When it is made from inside another
+      -- grammar (e.g. one made by the find macro), the rule making it in the inner grammar must
+      -- be treated as capturing, because the referenced rule may capture.
+      local g = rule.grammar
+      g.deps[g.current][rule.id] = true
+      local inner = compiling_grammar
+      while inner and inner ~= g do
+	 inner.outer[inner.current] = true
+	 inner = inner.parent
+      end
+   end
+   -- Profiling counters are kept by the name of the pattern in its package
+   local peg = pat.peg
+   if a.packagename or (not prelude_ids[a.localname]) then
+      peg = profiled(peg, common.compose_id{a.packagename or prefix, a.localname})
+   end
+   a.pat = pattern.new{name=a.localname, peg=peg, alias=pat.alias, ast=pat.ast, uncap=pat.uncap,
+		       label=pat.label, first=pat.first, nocap=pat.nocap}
    return a.pat
 end
 
@@ -636,7 +1283,7 @@ function expression(a, env, prefix, messages)
    return a.pat
 end
 
-local function compile_expression(exp, env, prefix, messages)
+function compile_expression(exp, env, prefix, messages)
 
    -- local t0
    -- if PROFILE then
@@ -644,6 +1291,7 @@ local function compile_expression(exp, env, prefix, messages)
    --    t0 = os.clock()
    -- end
 
+   compiling_grammar = false			    -- in case an error left it set
    local ok, value = catch(expression, exp, env, prefix, messages)
 
    -- if PROFILE then
@@ -671,11 +1319,91 @@ local function compile_expression(exp, env, prefix, messages)
    return value
 end
 
+---------------------------------------------------------------------------------------------------
+-- Capture projection
+---------------------------------------------------------------------------------------------------
+
+-- A projection of a compiled expression matches exactly what the expression matches, but its
+-- output holds only the captures whose names are in the set 'keep', wherever they occur in the
+-- match tree.  The lpeg vm has no way to skip a capture, so the projection is a second peg,
+-- put together from the ast and the pegs already compiled for each node: a node that makes no
+-- captures contributes its own peg, and any other node is rebuilt from the projections of its
+-- subs, with its top-level capture only when that label is kept.
+--
+-- Some nodes cannot be taken apart, e.g. the result of a macro, a negation, or a grammar that
+-- was compiled memoized (its memo tables were made for the original rules) or with profiling
+-- counters (which a rebuilt grammar would drop).  Those keep their captures, minus their own
+-- label.  Profiling counters on references outside a grammar are not carried into a projection.
+
+local project
+
+local function projected_subs(a, keep, memo)
+   local pat = a.pat
+   if ast.sequence.is(a) then
+      local peg = P(true)
+      for _, exp in ipairs(a.exps) do peg = peg * project(exp, keep, memo); end
+      return peg
+   elseif ast.choice.is(a) then
+      local peg, pegs, firsts = P(false), {}, {}
+      for i, exp in ipairs(a.exps) do
+	 pegs[i], firsts[i] = project(exp, keep, memo), exp.pat.first
+	 peg = peg + pegs[i]
+      end
+      return choice_dispatch(pegs, firsts) or peg
+   elseif ast.and_exp.is(a) then
+      local last = #a.exps
+      local peg = project(a.exps[last], keep, memo)
+      for i = last-1, 1, -1 do peg = #project(a.exps[i], keep, memo) * peg; end
+      return peg
+   elseif ast.ref.is(a) then
+      -- The pattern of a reference holds the ast of the expression bound to the name
+      if pat.ast and (pat.ast ~= a) and pattern.is(pat.ast.pat) then
+	 return projected_subs(pat.ast, keep, memo)
+      end
+   elseif ast.atleast.is(a) then
+      local epeg = project(a.exp, keep, memo)
+      if pat.search_skip then				    -- the search loop (see above)
+	 return (pat.search_skip + checkpoint(epeg))^0
+      end
+      return epeg^(a.min)
+   elseif ast.atmost.is(a) then
+      return project(a.exp, keep, memo)^(-a.max)
+   elseif ast.predicate.is(a) and (a.type=="lookahead") then
+      return #project(a.exp, keep, memo)
+   elseif ast.bracket.is(a) and (not a.complement) then
+      return project(a.cexp, keep, memo)
+   elseif ast.grammar.is(a) and not (pat.memoized or pat.profiled) then
+      local rules = append(list.from(a.public_rules), list.from(a.private_rules))
+      local t = {}
+      for _, rule in ipairs(rules) do
+	 t[rule.ref.localname] = checkpoint(project(rule.exp, keep, memo))
+      end
+      t[1] = rules[1].ref.localname
+      local ok, peg = pcall(P, t)
+      if ok then return peg; end
+   end
+   return (pat.label and pat.uncap) or pat.peg
+end
+
+function project(a, keep, memo)
+   local pat = a.pat
+   if pat.nocap then return pat.peg; end
+   local peg = memo[a]
+   if not peg then
+      peg = projected_subs(a, keep, memo)
+      if pat.label and keep[pat.label] then peg = common.match_node_wrap(peg, pat.label); end
+      memo[a] = peg
+   end
+   return peg
+end
+
 -- 'c2.compile_expression' compiles a top-level expression for matching.  If the expression is
 -- simply a reference, the match output will have the name of the referenced pattern.  If the
 -- expression is a reference to an alias, or if the expression is not a reference at all, then the
--- match output will have the name "*" (meaning "anonymous") at the top level.
-function c2.compile_expression(a, env, messages)
+-- match output will have the name "*" (meaning "anonymous") at the top level.  When 'keep' is a
+-- set of capture names, the peg is the projection of the expression onto those names (see
+-- above), and the match output is always named "*".
+function c2.compile_expression(a, env, messages, keep)
    local pat = compile_expression(a, env, nil, messages)
    if not pat then return false; end		    -- error will be in messages
    if pat and (not pattern.is(pat)) then
@@ -686,13 +1414,23 @@ function c2.compile_expression(a, env, messages)
       return false
    end
    local peg, name = pat.peg, pat.name
+   local projected = keep and project(a, keep, {})
    if ast.ref.is(a) then
       if pat.alias then
 	 pat.peg = common.match_node_wrap(pat.peg, "*")
+	 pat.nocap = false
       end
    else -- not a reference
       wrap_pattern(pat, "*", true)		    -- force wrap, even if pat is a grammar
    end
+   if projected then
+      pat.peg = common.match_node_wrap(projected, "*")
+      pat.nocap = false
+   end
+   if checkpoints_compiled or profile_compiled then
+      -- The pattern may refer to bindings that contain checkpoints or profiling counters
+      pat.peg = c2.match_start(match_limits) * pat.peg
+   end
    pat.alias = false
    return pat
 end
@@ -730,24 +1468,27 @@ function initialize_bindings(stmts, pkgenv, prefix, messages)
    return true
 end
 
+function bind_pattern(b, pat, pkgenv, prefix)
+   -- Sigh.  Grammars are already wrapped.  This is ugly.
+   if (not b.is_alias) and (not ast.grammar.is(b.exp)) then
+      local fullname = common.compose_id{prefix, b.ref.localname}
+      wrap_pattern(pat, fullname);
+   end
+   pat.alias = b.is_alias
+   if b.is_local then pat.exported = false; end
+   common.note("Binding value to " .. b.ref.localname)
+   pkgenv:bind(b.ref.localname, pat)
+end
+
 function compile_statements(stmts, pkgenv, prefix, messages)
    local uncompiled = {}
    for _, b in ipairs(stmts) do
-      local ref, exp = b.ref, b.exp
-      local pat = compile_expression(exp, pkgenv, prefix, messages)
+      local pat = compile_expression(b.exp, pkgenv, prefix, messages)
       if not pat then return false; end 	    -- error is in messages
       if novalue.is(pat) then
 	 table.insert(uncompiled, b)
       elseif pattern.is(pat) then
-	 -- Sigh.  Grammars are already wrapped.  This is ugly.
-	 if (not b.is_alias) and (not ast.grammar.is(exp)) then
-	    local fullname = common.compose_id{prefix, ref.localname}
-	    wrap_pattern(pat, fullname);
-	 end
-	 pat.alias = b.is_alias
-	 if b.is_local then pat.exported = false; end
-	 common.note("Binding value to " .. ref.localname)
-	 pkgenv:bind(ref.localname, pat)
+	 bind_pattern(b, pat, pkgenv, prefix)
       else
 	 assert(false,
 		"Internal error: unexpected return value from expression compiler: " ..
@@ -775,6 +1516,13 @@ function c2.compile_block(a, pkgenv, request, messages)
    if not initialize_bindings(a.stmts, pkgenv, prefix, messages) then
       return false				    -- info is in messages
    end
+   if lazy_import and request and request.importpath then
+      for _, b in ipairs(a.stmts) do
+	 pkgenv:bind(b.ref.localname,
+		     lazy.new{exported=(not b.is_local), ast=b, env=pkgenv, prefix=prefix})
+      end
+      return true
+   end
    -- Step 2: Compile the rhs (expression) for each binding, repeating until either all statements
    -- have compiled, or there's a compilation error, or we cannot make progress because there are
    -- mutual dependencies (mutual recursion).
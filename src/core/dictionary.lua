@@ -0,0 +1,187 @@
+-- -*- Mode: Lua; -*-
+--
+-- dictionary.lua    literal dictionaries, matched with a byte trie
+--
+-- © Copyright Jamie A. Jennings 2018.
+-- LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)
+-- AUTHOR: Jamie A. Jennings
+
+-- A dictionary is a set of literal strings, such as a list of domain names or file hashes,
+-- that would be a very large choice of literals if written in rpl.  Its entries are kept in a
+-- byte trie, packed into a single Lua string.  A match follows the trie one input byte at a
+-- time, so it takes time proportional to the length of the entry, however many entries there
+-- are.
+--
+-- Each node of the packed trie starts at a byte offset in the string (the root at 0) and holds
+-- a flag byte (1 when an entry ends at the node), the number n of its edges as a 2-byte little
+-- endian integer, the n bytes that label its edges in increasing order, and then the offsets of
+-- the n children as 4-byte little endian integers.  A node therefore takes 3 bytes plus 5 for
+-- each edge, so entries that share few prefixes, such as hashes, need about 8 bytes of memory
+-- for every byte of the dictionary.  The trie is first built in Lua tables, which take 40 or
+-- more bytes per node, and those are garbage once it has been packed.
+--
+-- In rpl, dictionary:#name matches the longest entry that starts at the current position, and
+-- dictionary:(#name, #shortest) the shortest one.  The name is one that was given to
+-- e:set_dictionary(name, entries), or else the name of a file that holds one entry per line.
+--
+-- A compiled pattern holds the dictionary object, and looks up its trie when matching, so
+-- giving a dictionary new entries (or reading its file again) with e:set_dictionary changes
+-- what the patterns already compiled from it match, without compiling them again.
+
+local lpeg = require "lpeg"
+
+local dictionary = {}
+
+-- The dictionaries of the engine that is compiling (see set_compiler_options in
+-- engine_module.lua), a table of dictionary objects by name
+dictionary.current = false
+
+-- The trie while it is being built: edges maps node*256+byte to the child node, for nodes
+-- numbered from 1 (the root), and final holds the nodes at which an entry ends.
+local function add(trie, entry)
+   local edges, node = trie.edges, 1
+   for i = 1, #entry do
+      local key = node * 256 + entry:byte(i)
+      local child = edges[key]
+      if not child then
+	 trie.nodes = trie.nodes + 1
+	 child = trie.nodes
+	 edges[key] = child
+      end
+      node = child
+   end
+   if not trie.final[node] then
+      trie.final[node] = true
+      trie.count = trie.count + 1
+   end
+end
+
+-- Return the packed form of trie (see above)
+local function pack(trie)
+   local labels = {}				    -- node -> list of edge bytes
+   for key in pairs(trie.edges) do
+      local node = key // 256
+      local l = labels[node]
+      if not l then l = {}; labels[node] = l; end
+      l[#l+1] = key % 256
+   end
+   local offsets, size = {}, 0
+   for node = 1, trie.nodes do
+      offsets[node] = size
+      size = size + 3 + 5 * (labels[node] and #labels[node] or 0)
+   end
+   if size >= 2^32 then return nil, "dictionary is too large"; end
+   local edges, parts = trie.edges, {}
+   for node = 1, trie.nodes do
+      local l = labels[node] or {}
+      table.sort(l)
+      local children = {}
+      for k, b in ipairs(l) do children[k] = offsets[edges[node * 256 + b]]; end
+      parts[node] = string.pack("<BI2", trie.final[node] and 1 or 0, #l) ..
+	 string.char(table.unpack(l)) ..
+	 string.pack("<" .. string.rep("I4", #l), table.unpack(children))
+   end
+   return table.concat(parts)
+end
+
+-- The entries are a list of strings, or a string that holds one entry per line.  Empty entries
+-- are skipped (a dictionary match is never empty), and so is a carriage return that ends a line.
+-- Returns the packed trie and the number of entries, or nil and a message.
+local function build(entries)
+   local trie = {edges={}, final={}, nodes=1, count=0}
+   if type(entries)=="string" then
+      for line in entries:gmatch("[^\n]+") do
+	 line = line:gsub("\r$", "")
+	 if #line > 0 then add(trie, line); end
+      end
+   elseif type(entries)=="table" then
+      for _, entry in ipairs(entries) do
+	 if type(entry)~="string" then
+	    return nil, "dictionary entry is not a string: " .. tostring(entry)
+	 end
+	 if #entry > 0 then add(trie, entry); end
+      end
+   else
+      return nil, "dictionary entries are not a list or a string: " .. tostring(entries)
+   end
+   local packed, msg = pack(trie)
+   if not packed then return nil, msg; end
+   return packed, trie.count
+end
+
+local function read_file(filename)
+   local f, msg = io.open(filename, "r")
+   if not f then return nil, msg; end
+   local data = f:read("a")
+   f:close()
+   if not data then return nil, "cannot read dictionary file " .. filename; end
+   return build(data)
+end
+
+-- Define the dictionary called name in dicts, from entries, or from the file called name when
+-- entries is nil.  When the dictionary exists, its entries are replaced.  Returns the number of
+-- entries, or false and a message.
+function dictionary.set(dicts, name, entries)
+   if type(name)~="string" then return false, "dictionary name not a string: " .. tostring(name); end
+   local trie, count
+   if entries==nil then trie, count = read_file(name)
+   else trie, count = build(entries); end
+   if not trie then return false, count; end
+   local d = dicts[name]
+   if d then d.trie, d.count = trie, count
+   else dicts[name] = {name=name, trie=trie, count=count}; end
+   return count
+end
+
+-- The dictionary called name in dicts, which is read from the file called name if it is not
+-- yet defined.  Returns the dictionary object, or nil and a message.
+function dictionary.lookup(dicts, name)
+   if not dicts[name] then
+      local ok, msg = dictionary.set(dicts, name)
+      if not ok then return nil, msg; end
+   end
+   return dicts[name]
+end
+
+-- Follow the packed trie over the subject s from byte i, returning the position after the
+-- longest entry found there (or the shortest, when shortest is true), or false.  The edges of
+-- a node are found by binary search on their labels.  Under librosie this is replaced by a C
+-- function (see dictionary_walk in librosie.c) that reads in place the input buffers that
+-- librosie matches, which are not Lua strings.
+function dictionary.walk(s, i, trie, shortest)
+   local byte, unpack = string.byte, string.unpack
+   local node, last = 0, false			    -- offset of the root
+   for j = i, #s do
+      local c = byte(s, j)
+      local n = unpack("<I2", trie, node + 2)
+      local lo, hi, k = 1, n, false
+      while lo <= hi do
+	 local mid = (lo + hi) // 2
+	 local b = byte(trie, node + 3 + mid)
+	 if b == c then k = mid; break
+	 elseif b < c then lo = mid + 1
+	 else hi = mid - 1; end
+      end
+      if not k then break; end
+      node = unpack("<I4", trie, node + 4 + n + 4 * (k - 1))
+      if byte(trie, node + 1) == 1 then
+	 last = j + 1
+	 if shortest then break; end
+      end
+   end
+   return last
+end
+
+-- A peg that matches an entry of d at the current position (the longest one, or the shortest
+-- one when shortest is true), and captures nothing.  The P(1) keeps lpeg from considering the
+-- peg nullable, so it can be repeated.
+function dictionary.peg(d, shortest)
+   local walk = dictionary.walk
+   shortest = shortest and true or false
+   return lpeg.Cmt(lpeg.P(1),
+		   function(s, i)
+		      return walk(s, i - 1, d.trie, shortest)
+		   end)
+end
+
+return dictionary
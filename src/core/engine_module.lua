@@ -32,7 +32,10 @@
 --   the rpl_string has "file semantics", i.e. it can be a module.
 --   returns success code and a list of violation objects
 -- 
--- e:compile(expression) compiles the rpl expression
+-- e:compile(expression, optional_keep) compiles the rpl expression
+--   optional_keep is a list of capture names, or a string of names separated by whitespace or
+--   commas; when given, the match output holds only those captures (see "Capture projection"
+--   in compile.lua)
 --   returns an rplx object or nil, and a list of violation objects
 --   API only: instead of the rplx object, returns the (string) id of an rplx object with
 --   indefinite extent; 
@@ -43,8 +46,11 @@
 -- r:trace(input, optional_start) like e:trace but r is a compiled rplx object
 --   returns a trace object
 --
+-- e:compile_cached(expression) is like e:compile, but returns the same rplx object for the same
+--   expression until the environment changes (see "Cache of compiled expressions" below)
+--
 -- e:match(expression, input, optional_start, optional_acc0, optional_acc1)
---   behaves like: r=e:compile(expression);
+--   behaves like: r=e:compile_cached(expression);
 --                 r:match(input, optional_start, optional_acc0, optional_acc1)
 --   optional_start is an integer index into the input (defaults to 1, the first character)
 --   optional_acc0 is an integer accumulator of total match time (defaults to 0)
@@ -57,6 +63,10 @@
 --   ??? API only: expression can be an rplx id, in which case that compiled expression is used
 --   returns a trace object
 -- 
+-- e:set_dictionary(name, optional_entries) defines the dictionary used by dictionary:#name
+--   entries is a list of strings or a string of lines; when nil, the file called name is read
+--   returns the number of entries, or false and a message
+--
 -- e:output(optional_formatter) sets or returns the formatter (a function)
 --   an engine calls formatter on each successful match result;
 --
@@ -84,6 +94,8 @@ local recordtype = require "recordtype"
 local common = require "common"
 local match = common.match
 local lookup_encoder = common.lookup_encoder
+local count_peg = common.count_peg
+local COUNT_ENCODER = common.COUNT_ENCODER
 local pfunction = common.pfunction
 local macro = common.macro
 local environment = require "environment"
@@ -93,6 +105,7 @@ local loadpkg = require "loadpkg"
 local co = require "color"
 local trace = require "trace"
 local rcfile = require "rcfile"
+local dictionary = require "dictionary"
 
 local engine, rplx				    -- forward reference
 local engine_error				    -- forward reference
@@ -227,8 +240,30 @@ local function macro_expand(en, expression)
    return {expansion, top_level, raw_parse}, messages
 end
 
-local function compile_expression(e, input)
+-- Settings of the compiler that are kept per engine are made before each compilation, because
+-- engines may share a compiler.
+local function set_compiler_options(e)
+   if e.compiler.set_memoize then e.compiler.set_memoize(e.memoize); end
+   if e.compiler.set_match_limits then e.compiler.set_match_limits(e.match_limits); end
+   if e.compiler.set_profile then e.compiler.set_profile(e.profile); end
+   if e.compiler.set_lazy_import then e.compiler.set_lazy_import(e.lazy_import); end
+   dictionary.current = e.dictionaries
+end
+
+-- The names in keep, as a set of capture names
+local function capture_set(keep)
+   local set = {}
+   if type(keep)=="string" then
+      for name in keep:gmatch("[^%s,]+") do set[name] = true; end
+   else
+      for _, name in ipairs(keep) do set[name] = true; end
+   end
+   return set
+end
+
+local function compile_expression(e, input, keep)
    local messages = {}
+   set_compiler_options(e)
    local ast = input
    if type(input)=="string" then
       ast = e.compiler.parse_expression(common.source.new{text=input}, messages)
@@ -241,13 +276,78 @@ local function compile_expression(e, input)
    ast = e.compiler.expand_expression(ast, e.env, messages)
    -- Errors will be in messages table
    if not ast then return false, messages; end
-   local pat = e.compiler.compile_expression(ast, e.env, messages)
+   local pat = e.compiler.compile_expression(ast, e.env, messages, keep and capture_set(keep))
    if not pat then return false, messages; end
    return rplx.new(e, pat), messages
 end
 
+----------------------------------------------------------------------------------------
+-- Cache of compiled expressions
+--
+-- When e:match, e:trace or e:matchfile is given an expression as a string, the rplx compiled
+-- from it is kept in a cache of (at most) e.compile_cache.size entries, from which the least
+-- recently used entry is evicted.  Anything that can change what an expression compiles to
+-- (load, import, or a change to the compiler options) empties the cache.  A size of zero
+-- turns the cache off.
+
+local function new_compile_cache(size)
+   local head = {}
+   head.prev, head.next = head, head		    -- sentinel of a circular list, most recent first
+   return {size=size, count=0, entries={}, head=head, hits=0, misses=0}
+end
+
+local function clear_compile_cache(e)
+   local cache = e.compile_cache
+   cache.entries, cache.count = {}, 0
+   cache.head.prev, cache.head.next = cache.head, cache.head
+end
+
+local function unlink(node)
+   node.prev.next, node.next.prev = node.next, node.prev
+end
+
+local function push_front(head, node)
+   node.prev, node.next = head, head.next
+   head.next.prev = node
+   head.next = node
+end
+
+local function set_compile_cache_size(e, size)
+   assert(math.type(size)=="integer" and size >= 0, "cache size not a non-negative integer")
+   e.compile_cache.size = size
+   clear_compile_cache(e)
+end
+
+-- Like e:compile, but returns the cached rplx when there is one for expression.
+local function compile_cached(e, expression)
+   local cache = e.compile_cache
+   local node = cache.entries[expression]
+   if node then
+      cache.hits = cache.hits + 1
+      unlink(node)
+      push_front(cache.head, node)
+      return node.rplx, {}
+   end
+   cache.misses = cache.misses + 1
+   local r, messages = e:compile(expression)
+   if (not r) or (cache.size == 0) then return r, messages; end
+   if cache.count >= cache.size then
+      local oldest = cache.head.prev
+      unlink(oldest)
+      cache.entries[oldest.key] = nil
+      cache.count = cache.count - 1
+   end
+   node = {key=expression, rplx=r}
+   push_front(cache.head, node)
+   cache.entries[expression] = node
+   cache.count = cache.count + 1
+   return r, messages
+end
+
 local function really_load(e, source, origin)
    local messages = {}
+   set_compiler_options(e)
+   clear_compile_cache(e)
    local ok, pkgname, env = loadpkg.source(e.compiler,
 					   e.pkgtable,
 					   e.env,
@@ -277,6 +377,8 @@ end
 -- re-load a package that is already loaded.
 local function import(e, packagename, as_name)
    local messages = {}
+   set_compiler_options(e)
+   clear_compile_cache(e)
    local ok, pkgname = loadpkg.import(e.compiler,
 			     e.pkgtable,
 			     e.libpath.value,
@@ -287,6 +389,36 @@ local function import(e, packagename, as_name)
    return ok, pkgname, messages
 end
 
+-- Turning profiling on (or off) resets the counters.  With time, the counters include the bytes
+-- consumed by and the time spent matching each pattern, at some further cost in speed.
+local function set_profile(e, flag, time)
+   clear_compile_cache(e)
+   e.profile.on = (flag and true) or false
+   e.profile.time = (flag and time and true) or false
+   for _, counters in pairs(e.profile.rules) do
+      counters.matches, counters.failures, counters.bytes, counters.time = 0, 0, 0, 0
+   end
+end
+
+-- Return a list of the profiling counters of the patterns that have been attempted, with the
+-- most expensive first.
+local function profile_report(e)
+   local report = {}
+   for name, c in pairs(e.profile.rules) do
+      local attempts = c.matches + c.failures
+      if attempts > 0 then
+	 table.insert(report, {name=name, attempts=attempts, matches=c.matches,
+			       failures=c.failures, bytes=c.bytes, time=c.time})
+      end
+   end
+   local key = e.profile.time and "time" or "attempts"
+   table.sort(report, function(a, b)
+			 if a[key] ~= b[key] then return a[key] > b[key]; end
+			 return a.name < b.name
+		      end)
+   return report
+end
+
 local function get_file_contents(e, filename, nosearch)
   if nosearch or util.absolutepath(filename) then
      local data, msg = util.readfile(filename)
@@ -321,7 +453,9 @@ end
 --   Close over the peg itself to avoid looking it up in pat.
 local function _match(rplx_exp, input, start, encoder, total_time_accum, lpegvm_time_accum)
    local rmatch_encoder, fn_encoder = lookup_encoder(encoder)
-   return match(rplx_exp.pattern.peg,
+   local peg = rplx_exp.pattern.peg
+   if encoder == COUNT_ENCODER then peg = count_peg(peg); end
+   return match(peg,
 		input,
 		start,
 		rmatch_encoder,
@@ -346,7 +480,7 @@ local function engine_match_trace(e, match_trace_fn, expression, input, start, e
    local compiled_exp, msgs
    if type(expression)=="string" then
       -- Expression has not been compiled.
-      compiled_exp, msgs = e:compile(expression)
+      compiled_exp, msgs = compile_cached(e, expression)
       if not compiled_exp then return false, msgs; end
    elseif rplx.is(expression) then
       compiled_exp = expression
@@ -371,66 +505,140 @@ end
 -- because librosie is not aware of which output encoders may have been
 -- defined in Lua.  (This information hiding is deliberate, because we
 -- expect users to define their own output encoders in Lua in the future.)
+-- Cmatch is the same for every rplx object, so librosie caches it in the Lua registry.
 local function Cmatch(compiled_exp, input, start, encoder, total_time_accum, lpegvm_time_accum)
 --    assert(rplx.is(compiled_exp))
 --    assert(type(input) == "userdata")
 --    assert(type(start) == "number")
 --    assert(type(encoder) == "string")
    local rmatch_encoder, fn_encoder = lookup_encoder(encoder)
+   local peg = compiled_exp.pattern.peg
+   if encoder == COUNT_ENCODER then peg = count_peg(peg); end
    local m, leftover, abend, t1, t2 =
-      (compiled_exp.pattern.peg):rmatch(input, start, rmatch_encoder, total_time_accum, lpegvm_time_accum)
+      peg:rmatch(input, start, rmatch_encoder, total_time_accum, lpegvm_time_accum)
    if m==0 then return m, start, abend, t1, t2; end
    local parms = compiled_exp.engine.encoder_parms
    return fn_encoder(m, input, start, parms), leftover, abend, t1, t2
 end
 
+-- For a set of rplx objects that are matched at the same position of the same input, return one
+-- peg that tries each of them there, in order, and a state table.  Each time the peg is matched,
+-- it appends to state.hits the index (into rplx_list) of each pattern that matches.  Each pattern
+-- is tried as a predicate, so that its captures are discarded and the next pattern starts at the
+-- same position.  A pattern whose first set is known is tried only when the next byte is in that
+-- set.  librosie uses this to implement pattern sets.
+local function pattern_set_program(rplx_list)
+   local P = lpeg.P
+   local state = {hits={}}
+   local members = {}
+   for i, r in ipairs(rplx_list) do
+      local peg = #r.pattern.peg
+      local first = r.pattern.first
+      if first and (not first.empty) then
+	 local bytes = {}
+	 for b = 0, 255 do
+	    if first[b] then table.insert(bytes, string.char(b)); end
+	 end
+	 peg = #lpeg.S(table.concat(bytes)) * peg
+      end
+      local mark = lpeg.Cmt(P(true),
+			    function(s, pos)
+			       local hits = state.hits
+			       hits[#hits+1] = i
+			       return pos
+			    end)
+      members[i] = peg * mark + P(true)
+   end
+   if #members == 0 then return P(true), state; end
+   -- Join the members pairwise, so that the program is not copied once for each member
+   while #members > 1 do
+      local joined = {}
+      for i = 1, #members, 2 do
+	 table.insert(joined, members[i+1] and (members[i] * members[i+1]) or members[i])
+      end
+      members = joined
+   end
+   return members[1], state
+end
+
 ----------------------------------------------------------------------------------------
 
 local process_input_file = {}
 
+-- A compressed input file is read from a decompressor running in its own process, so that
+-- decompression overlaps with matching.  (Under librosie, matchfile decompresses a mapped
+-- file on a thread of its own instead, when built to do so.  See decompress.c.)  The
+-- decompressor's own error messages go to stderr, and its exit status is checked when the
+-- input is closed.  Returns the input file and whether it is a decompressor pipe.
+local decompressors = {{magic="\31\139", command="gzip -dc"},
+		       {magic="\40\181\47\253", command="zstd -dcq"}}
+
+local function open_input(infilename)
+   local infile, msg = io.open(infilename, "r")
+   if not infile then return nil, msg; end
+   if not infile:seek("set", 0) then return infile; end -- not seekable, e.g. a named pipe
+   local head = infile:read(4) or ""
+   for _, d in ipairs(decompressors) do
+      if head:sub(1, #d.magic) == d.magic then
+	 infile:close()
+	 local quoted = "'" .. infilename:gsub("'", "'\\''") .. "'"
+	 return io.popen(d.command .. " -- " .. quoted, "r"), true
+      end
+   end
+   infile:seek("set", 0)
+   return infile
+end
+
 local function open3(e, infilename, outfilename, errfilename)
    if type(infilename)~="string" then return nil, tostring(infilename)
    elseif type(outfilename)~="string" then return nil, tostring(outfilename)
    elseif type(errfilename)~="string" then return nil, tostring(errfilename)
    end
-   local infile, outfile, errfile, msg
+   local infile, outfile, errfile, piped
    if #infilename==0 then infile = io.stdin;
    else
-      infile, msg = io.open(infilename, "r");
+      infile, piped = open_input(infilename);
       if not infile then return nil, infilename; end; end
    if #outfilename==0 then outfile = io.stdout
    else
-      outfile, msg = io.open(outfilename, "w");
+      outfile = io.open(outfilename, "w");
       if not outfile then return nil, outfilename; end; end
    if #errfilename==0 then errfile = io.stderr;
    else
-      errfile, msg = io.open(errfilename, "w");
+      errfile = io.open(errfilename, "w");
       if not errfile then return nil, errfilename; end; end
-   return infile, outfile, errfile
+   return infile, outfile, errfile, piped
 end
 
-local function engine_process_file(e, expression, op, infilename, outfilename, errfilename, encoder, wholefileflag)
+-- When the encoder is "count", nothing is written: only the number of matching (and
+-- non-matching) lines is returned.  When maxcount is a positive number, processing stops after
+-- that many lines have matched, so a maxcount of 1 with the count encoder answers the question
+-- "does any line match?".
+local function engine_process_file(e, expression, op, infilename, outfilename, errfilename, encoder, wholefileflag, maxcount)
    local r, msgs
    if engine_module.rplx.is(expression) then
       r = expression
    else
-      r, msgs = e:compile(expression)
+      r, msgs = compile_cached(e, expression)
       if not r then e:error(table.concat(msgs, '\n')); end
       assert(engine_module.rplx.is(r))
    end
    local trace_flag = (op == "trace")
    local trace_style = encoder
    if trace_flag then encoder = nil; end
+   local count_only = (encoder == COUNT_ENCODER)
+   maxcount = (type(maxcount)=="number" and maxcount > 0) and maxcount or false
    local rmatch_encoder, fn_encoder = lookup_encoder(encoder)
    -- The set of simple optimizations below almost doubles performance of the loop through the
    -- file in cases where there are many lines to process.
    local parms = common.attribute_table_to_table(e.encoder_parms)
    local peg = r.pattern.peg			    -- optimization
+   if count_only then peg = count_peg(peg); end
    local matcher = function(input)
 		      return match(peg, input, 1, rmatch_encoder, fn_encoder, parms)
 		   end                              -- FUTURE: inline this for performance
 
-   local infile, outfile, errfile = open3(e, infilename, outfilename, errfilename);
+   local infile, outfile, errfile, piped = open3(e, infilename, outfilename, errfilename);
    if not infile then return nil, "No such file " .. tostring(outfile), nil; end
    local inlines, outlines, errlines = 0, 0, 0;
    local nextline
@@ -444,8 +652,18 @@ local function engine_process_file(e, expression, op, infilename, outfilename, e
    else
       nextline = infile:lines();
    end
+   if engine_module.buffered_writer then
+      -- When running under librosie, output is collected in C and written in large blocks.
+      -- The write method accepts both strings and match data (userdata).
+      outfile = engine_module.buffered_writer(outfile)
+      errfile = engine_module.buffered_writer(errfile)
+   end
    local o_write_prim, e_write = outfile.write, errfile.write
-   if common.encoder_returns_userdata(encoder) then
+   if engine_module.buffered_writer then
+      o_write = function(handle, m)
+		   o_write_prim(handle, m, '\n')
+		end
+   elseif common.encoder_returns_userdata(encoder) then
       o_write = function(handle, m)
 		   lpeg.writedata(handle, m)
 		   o_write_prim(handle, '\n')
@@ -470,22 +688,26 @@ local function engine_process_file(e, expression, op, infilename, outfilename, e
       else
 	 m, leftover = matcher(l);	  -- User might want to see leftover?
 	 if m then
-	    o_write(outfile, m);
+	    if not count_only then o_write(outfile, m); end
 	    outlines = outlines + 1
 	 else
-	    e_write(errfile, l, "\n")
+	    if not count_only then e_write(errfile, l, "\n"); end
 	    errlines = errlines + 1
 	 end
       end
       inlines = inlines + 1
+      if maxcount and (outlines >= maxcount) then break; end
       l = nextline(); 
    end -- while
-   infile:close(); outfile:close(); errfile:close();
+   local closed = infile:close(); outfile:close(); errfile:close();
+   -- A decompressor that exits with an error produced truncated or no output.  (When we stop
+   -- early at maxcount, closing the pipe ends the decompressor, so its status means nothing.)
+   if piped and (not l) and (not closed) then return -1, common.ERR_CORRUPT_INPUT, 0; end
    return inlines, outlines, errlines
 end
 
-function process_input_file.match(e, expression, infilename, outfilename, errfilename, encoder, wholefileflag)
-   return engine_process_file(e, expression, "match", infilename, outfilename, errfilename, encoder, wholefileflag)
+function process_input_file.match(e, expression, infilename, outfilename, errfilename, encoder, wholefileflag, maxcount)
+   return engine_process_file(e, expression, "match", infilename, outfilename, errfilename, encoder, wholefileflag, maxcount)
 end
 
 function process_input_file.trace(e, expression, infilename, outfilename, errfilename, trace_style, wholefileflag )
@@ -609,6 +831,10 @@ local function create_engine(name, compiler, searchpath, colorstring)
       env=environment.new(environment.make_standard_prelude()),
       pkgtable=new_package_table,
       encoder_parms = common.create_attribute_table(),
+      match_limits = {steps=false, ms=false},
+      profile = {on=false, time=false, rules={}},
+      compile_cache = new_compile_cache(256),
+      dictionaries = {},
    }
    e:set_encoder_parm("colors", colorstring, "default")
    return e
@@ -640,7 +866,48 @@ engine =
 				   end,
 		     libpath=false,
 
+		     -- When memoize is true, grammars compiled afterwards remember where their
+		     -- rules failed (see compile.lua)
+		     set_memoize = function(self, flag)
+				      self.memoize = (flag and true) or false
+				      clear_compile_cache(self)
+				   end,
+		     memoize=false,
+
+		     -- A match that takes more than steps steps (repetitions and grammar rule
+		     -- entries) or more than ms milliseconds halts, with abend set.  Only patterns
+		     -- compiled while there is a limit are limited (see compile.lua).
+		     set_match_limits = function(self, steps, ms)
+					   self.match_limits.steps = (steps and steps > 0 and steps) or false
+					   self.match_limits.ms = (ms and ms > 0 and ms) or false
+					   clear_compile_cache(self)
+					end,
+		     match_limits=false,
+
+		     set_profile = set_profile,
+		     profile_report = profile_report,
+		     profile=false,
+
+		     -- When lazy_import is true, the bindings of packages imported afterwards are
+		     -- compiled when first referenced (see compile.lua)
+		     set_lazy_import = function(self, flag)
+					  self.lazy_import = (flag and true) or false
+				       end,
+		     lazy_import=false,
+
+		     -- Define the dictionary called name from a list of entries (or from the file
+		     -- called name when entries is nil).  Patterns already compiled from it match
+		     -- the new entries (see dictionary.lua).
+		     set_dictionary = function(self, name, entries)
+					 return dictionary.set(self.dictionaries, name, entries)
+				      end,
+		     dictionaries=false,
+
 		     compile=compile_expression,
+		     compile_cached=compile_cached,
+		     clear_compile_cache=clear_compile_cache,
+		     set_compile_cache_size=set_compile_cache_size,
+		     compile_cache=false,
 		     match=engine_match,
 		     trace=engine_trace,
 
@@ -679,7 +946,6 @@ local create_rplx = function(en, pattern)
 							engine_match(en, self, input, start, encoder, t0, t1)
 						     return m, left, abend, t0, t1
 						  end,
-					    Cmatch=Cmatch,
 					 };
 		    end
 
@@ -689,7 +955,6 @@ rplx = recordtype.new("rplx",
 			--
 			match=false;
 			trace=false;
-			Cmatch=false;
 		      },
 		      create_rplx
 		   )
@@ -698,5 +963,7 @@ rplx = recordtype.new("rplx",
 
 engine_module.engine = engine
 engine_module.rplx = rplx
+engine_module.Cmatch = Cmatch
+engine_module.pattern_set_program = pattern_set_program
 
 return engine_module
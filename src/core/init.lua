@@ -107,9 +107,11 @@ local function load_all()
    parse_core = import("parse_core")
    parse = import("parse")
    ast = import("ast")
+   dictionary = import("dictionary")
    builtins = import("builtins")
    environment = import("environment")
    expand = import("expand")
+   parsecache = import("parsecache")
    compile = import("compile")
    loadpkg = import("loadpkg")
    trace = import("trace")
@@ -185,6 +187,10 @@ function create_rpl_1_1_engine(e)
 	         parse_expression = compile.make_parse_expression(rplx_expression),
 	         expand_expression = compile.expand_expression,
 	         compile_expression = compile.compile_expression,
+	         set_memoize = compile.set_memoize,
+	         set_match_limits = compile.set_match_limits,
+	         set_profile = compile.set_profile,
+	         set_lazy_import = compile.set_lazy_import,
 	   }
 
    local c2engine = engine.new("NEW RPL 1.1 engine (c2)", compiler2, ROSIE_LIBDIR)
@@ -218,6 +224,10 @@ function create_rpl_1_2_engine(e)
 	parse_expression = compile.make_parse_expression(rplx_expression),
 	expand_expression = compile.expand_expression,
 	compile_expression = compile.compile_expression,
+	set_memoize = compile.set_memoize,
+	set_match_limits = compile.set_match_limits,
+	set_profile = compile.set_profile,
+	set_lazy_import = compile.set_lazy_import,
      }
 
    local c3engine = engine.new("NEW RPL 1.2 engine (c3)", compiler3, ROSIE_LIBDIR)
@@ -314,6 +324,16 @@ rosie_package.config =
 
 ROSIE_LIBPATH = ROSIE_LIBDIR
 
+-- The parse cache is off until a directory is set.  See parsecache.lua.
+parsecache.version = ROSIE_VERSION
+rosie_package.set_cachedir = function(dir)
+				assert(dir==false or type(dir)=="string")
+				parsecache.directory = dir
+			     end
+rosie_package.get_cachedir = function()
+				return parsecache.directory
+			     end
+
 CORE_ENGINE = create_core_engine()
 assert(CORE_ENGINE)
 
@@ -0,0 +1,129 @@
+-- -*- Mode: Lua; -*-
+--
+-- parsecache.lua    on-disk cache of rpl parse trees
+--
+-- © Copyright Jamie A. Jennings 2018.
+-- LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)
+-- AUTHOR: Jamie A. Jennings
+
+-- Parsing the rpl source of the standard library is a large part of the time it takes to start
+-- rosie and import packages.  When a cache directory is set, the parse tree of each rpl block
+-- that parses without errors is written there as a Lua chunk, and the next parse of the same
+-- text by the same parser (same rpl version, same rosie version) loads the tree instead.
+--
+-- A cache file holds the full source text, which is compared on lookup, so a hash collision or
+-- an edited file can only cause a cache miss.  Writes go to a temporary file which is then
+-- renamed, so a concurrent reader never sees a partial file.  The cache is best-effort: any
+-- error reading or writing it is treated as a miss.
+--
+-- N.B. Only the parse tree is cached.  Expansion and compilation (to lpeg) still happen on every
+-- load, because an lpeg pattern cannot be serialized, so a cache hit saves the parse and nothing
+-- else.  A hit is not free either: the cached tree is a Lua chunk that is loaded and run, which
+-- is cheaper than the rpl parser but not a single read.  The cache is set per Lua state, by the
+-- cli (--cachedir), by rosie.set_cachedir, or by rosie_set_cachedir in librosie.
+--
+-- The data field of a match node is omitted when it is the matched text, and restored on load.
+
+local parsecache = {}
+
+parsecache.directory = false			    -- false means caching is off
+parsecache.suffix = ".rplpt"
+parsecache.version = ""			    -- set by init to the rosie version
+
+local format = string.format
+
+-- 64-bit FNV-1a (Lua integer arithmetic wraps), used only to choose a file name
+local function hash(str)
+   local h = -3750763034362895579		    -- 0xcbf29ce484222325
+   local byte = string.byte
+   for i = 1, #str do
+      h = (h ~ byte(str, i)) * 1099511628211
+   end
+   return h
+end
+
+local function filename_for(key)
+   return parsecache.directory .. "/" .. format("%016x", hash(key)) .. parsecache.suffix
+end
+
+local function make_key(tag, src)
+   return parsecache.version .. "\0" .. tag .. "\0" .. src
+end
+
+local function value_to_string(v)
+   if math.type(v)=="integer" then return tostring(v)
+   elseif type(v)=="number" then return format("%.17g", v)
+   elseif type(v)=="string" then return format("%q", v)
+   elseif type(v)=="boolean" then return tostring(v)
+   else error("parse cache cannot store a value of type " .. type(v))
+   end
+end
+
+-- Nodes are written in post-order, one statement each, so that deep trees do not run into the
+-- Lua parser's limit on nested table constructors.
+local function write_nodes(node, src, out, count)
+   local subs = {}
+   for _, sub in ipairs(node.subs or {}) do
+      count = write_nodes(sub, src, out, count)
+      table.insert(subs, "n[" .. count .. "]")
+   end
+   local fields = {}
+   for k, v in pairs(node) do
+      if k ~= "subs" and not (k=="data" and node.e and v==src:sub(node.s, node.e-1)) then
+	 table.insert(fields, format("[%q]=%s", k, value_to_string(v)))
+      end
+   end
+   if node.subs then
+      table.insert(fields, "subs={" .. table.concat(subs, ",") .. "}")
+   end
+   count = count + 1
+   table.insert(out, format("n[%d]={%s}\n", count, table.concat(fields, ",")))
+   return count
+end
+
+local function restore_data(node, src)
+   if node.data==nil and node.e then node.data = src:sub(node.s, node.e-1); end
+   for _, sub in ipairs(node.subs or {}) do restore_data(sub, src); end
+end
+
+-- Return pt, leftover when a tree for src (parsed by the parser named by tag) is in the cache,
+-- else nil.
+function parsecache.lookup(tag, src)
+   if not parsecache.directory then return nil; end
+   local key = make_key(tag, src)
+   local f = io.open(filename_for(key), "r")
+   if not f then return nil; end
+   local chunk = f:read("a")
+   f:close()
+   if not chunk then return nil; end
+   local loader = load(chunk, "=parsecache", "t", {})
+   if not loader then return nil; end
+   local ok, cached_key, builder, leftover = pcall(loader)
+   if (not ok) or cached_key ~= key or type(builder)~="function" then return nil; end
+   local ok, pt = pcall(builder, {})
+   if (not ok) or type(pt)~="table" then return nil; end
+   restore_data(pt, src)
+   return pt, leftover
+end
+
+function parsecache.store(tag, src, pt, leftover)
+   if not parsecache.directory then return false; end
+   local key = make_key(tag, src)
+   local out = {"return ", format("%q", key), ", function(n)\n"}
+   local ok, count = pcall(write_nodes, pt, src, out, 0)
+   if not ok then return false; end
+   table.insert(out, format("return n[%d]\nend, %d\n", count, leftover))
+   local filename = filename_for(key)
+   local tmpname = format("%s.%d.tmp", filename, hash(tostring(out) .. os.clock()))
+   local f = io.open(tmpname, "w")
+   if not f then return false; end
+   local written = f:write(table.concat(out))
+   f:close()
+   if (not written) or (not os.rename(tmpname, filename)) then
+      os.remove(tmpname)
+      return false
+   end
+   return true
+end
+
+return parsecache
@@ -161,6 +161,7 @@ function repl.repl(en)
 	       if csubs and csubs[1] then
 		  local name, pos, id, subs = common.decode_match(csubs[1])
 		  local situation = en.env:unbind(id)
+		  en:clear_compile_cache()
 		  if situation then
 		     io.write("Repl: removed binding, revealing inherited binding: ",
 			      tostring(situation), '\n')
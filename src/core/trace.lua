@@ -7,6 +7,7 @@
 -- AUTHOR: Jamie A. Jennings
 
 
+local lpeg = require "lpeg"
 local ast = require "ast"
 local builtins = require "builtins"
 local common = require "common"
@@ -225,10 +226,7 @@ local function protected_match(peg, input, start, parms)
    local ok, m, leftover =
       pcall(match, peg, input, start, BYTE_ENCODING, fn_BYTE_ENCODING, parms)
    if not ok then
-      print("\n\n\nTrace failed while working on: ", a)
-      if a.exps then print("a.exps: " .. tostring(list.from(a.exps))); end
-      print("ast.tostring(a) is: " .. ast.tostring(a))
-      print("start is: " .. tostring(start) .. " and input is: |" ..  input .. "|")
+      print("\n\n\nTrace failed at start " .. tostring(start) .. " of input: |" ..  input .. "|")
       error("match failed: " .. m)		    -- m is error message from pcall
    end
    assert(type(m)=="userdata" or m==false)
@@ -237,260 +235,143 @@ local function protected_match(peg, input, start, parms)
 end
 
 ---------------------------------------------------------------------------------------------------
--- Trace functions for each expression type
+-- Trace by matching once
 ---------------------------------------------------------------------------------------------------
 
-local expression;
+-- A trace is made by matching the input once against an instrumented copy of the pattern.  The
+-- copy is built from the ast, using the peg that was compiled for each node.  Each node of the
+-- ast becomes
+--    enter * (peg * matched + failed * false)
+-- where peg is made from the instrumented subs of the node (or is the compiled peg of the node,
+-- for leaves like literals, character sets and grammars), and enter, matched and failed are
+-- match-time captures that append an event to the log.  The log is a set of parallel arrays
+-- (kind, node, pos), from which the trace tree is built after the match.  A sequence or choice
+-- has one sub per expression that it tried; a reference has the referenced expression as its
+-- only sub (unless the referenced pattern is built-in); a repetition has one sub per attempt.
+--
+-- Each instrumented node adds Lua values to the pattern's ktable, whose size lpeg limits, so
+-- after MAX_NODES nodes have been expanded, the remaining nodes are traced as leaves.
 
--- Append to 'matches' a trace record for each item in 'exps' that we didn't even try to match,
--- which are those beginning at index 'start'.
-local function append_unattempted(exps, start, matches, input, nextstart)
-   for i = start, #exps do
-      table.insert(matches, {ast=exps[i], input=input, start=nextstart})
-   end
-end
+local P, Cmt = lpeg.P, lpeg.Cmt
+local ENTER, MATCHED, FAILED = 1, 2, 3
+local MAX_NODES = 10000
 
-local function sequence(e, a, input, start, expected, nextpos)
-   local matches = {}
-   local nextstart = start
-   for _, exp in ipairs(a.exps) do
-      local result = expression(e, exp, input, nextstart)
-      table.insert(matches, result)
-      if not result.match then break
-      else nextstart = result.nextpos; end
-   end -- for
-   local n = #matches
-   if n < #a.exps then
-      append_unattempted(a.exps, n+1, matches, input, nextstart)
-   end
-   if (n==#a.exps) and (matches[n].match) then
-      assert(expected, "sequence match differs from expected")
-      assert(matches[n].nextpos==nextpos, "sequence nextpos differs from expected")
-      return {match=expected, nextpos=nextpos, ast=a, subs=matches, input=input, start=start}
-   else
-      assert(not expected, "sequence non-match differs from expected")
-      return {match=expected, nextpos=nextpos, ast=a, subs=matches, input=input, start=start}
-   end
+local function new_log()
+   return {n=0, kind={}, node={}, pos={}, budget=MAX_NODES}
 end
 
-local function choice(e, a, input, start, expected, nextpos)
-   local matches = {}
-   for _, exp in ipairs(a.exps) do
-      local result = expression(e, exp, input, start)
-      table.insert(matches, result)
-      if result.match then break; end
-   end -- for
-   local n = #matches
-   if n < #a.exps then
-      append_unattempted(a.exps, n+1, matches, input, matches[n].nextpos)
-   end
-   if expected~=nil then
-      if matches[n].match then
-	 assert(expected, "choice match differs from expected")
-      else
-	 assert(not expected, "choice non-match differs from expected")
-      end
-   end
-   return {match=expected, nextpos=nextpos, ast=a, subs=matches, input=input, start=start}
+local function recorder(log, kind, a)
+   return function(s, pos)
+	     local n = log.n + 1
+	     log.n = n
+	     log.kind[n], log.node[n], log.pos[n] = kind, a, pos
+	     return (kind ~= FAILED) and pos
+	  end
 end
 
--- FUTURE: A qualified reference to a separately compiled module may not have an AST available
--- for debugging (unless it was compiled with debugging enabled).
+local instrument
 
-local function ref(e, a, input, start, expected, nextpos)
+local function instrument_subs(a, log, memo)
    local pat = a.pat
-   assert(pat.ast, "missing ast?")
-   if pat.ast.sourceref == builtins.sourceref then
-      -- In a trace, a reference no subs if it is built-in
-      return {match=expected, nextpos=nextpos, ast=a, input=input, start=start}
-   else
-      local result = expression(e, pat.ast, input, start)
-      if expected then
-	 assert(result.match, "reference match differs from expected")
-	 assert(nextpos==result.nextpos, "reference nextpos differs from expected")
-      else
-	 assert(not result.match)
+   if log.budget <= 0 then return pat.peg; end
+   if ast.sequence.is(a) then
+      local peg = P(true)
+      for _, exp in ipairs(a.exps) do peg = peg * instrument(exp, log, memo); end
+      return peg
+   elseif ast.choice.is(a) then
+      local peg = P(false)
+      for _, exp in ipairs(a.exps) do peg = peg + instrument(exp, log, memo); end
+      return peg
+   elseif ast.and_exp.is(a) then
+      local last = #a.exps
+      local peg = instrument(a.exps[last], log, memo)
+      for i = last-1, 1, -1 do peg = #instrument(a.exps[i], log, memo) * peg; end
+      return peg
+   elseif ast.ref.is(a) then
+      if pat.ast and (pat.ast.sourceref ~= builtins.sourceref) then
+	 return instrument(pat.ast, log, memo)
       end
-      -- In a trace, a reference has one sub (or none, if it is built-in)
-      return {match=expected, nextpos=nextpos, ast=a, subs={result}, input=input, start=start}
-   end
-end
-
--- Note: 'atleast' implements * when a.min==0
-local function atleast(e, a, input, start, expected, nextpos)
-   local matches = {}
-   local nextstart = start
-   assert(type(a.min)=="number")
-   while true do
-      local result = expression(e, a.exp, input, nextstart)
-      table.insert(matches, result)
-      if not result.match then break
-      else nextstart = result.nextpos; end
-   end -- while
-   local last = matches[#matches]
-   if (#matches > a.min) or (#matches==a.min and last.match) then
-      assert(expected, "atleast match differs from expected")
-      assert(nextstart==nextpos, "atleast nextpos differs from expected")
-      return {match=expected, nextpos=nextpos, ast=a, subs=matches, input=input, start=start}
-   else
-      assert(not expected, "atleast non-match differs from expected")
-      return {match=expected, nextpos=nextpos, ast=a, subs=matches, input=input, start=start}
-   end
-end
-
--- 'atmost' always succeeds, because it matches from 0 to a.max copies of exp, and it stops trying
--- to match after it matches a.max times.
-local function atmost(e, a, input, start, expected, nextpos)
-   local matches = {}
-   local nextstart = start
-   assert(type(a.max)=="number")
-   for i = 1, a.max do
-      local result = expression(e, a.exp, input, nextstart)
-      table.insert(matches, result)
-      if not result.match then break
-      else nextstart = result.nextpos; end
-   end -- while
-   local last = matches[#matches]
-   assert(expected, "atmost match differs from expected")
-   if last.match then
-      assert(last.nextpos==nextpos, "atmost nextpos differs from expected")
+   elseif ast.atleast.is(a) then
+      return instrument(a.exp, log, memo)^(a.min)
+   elseif ast.atmost.is(a) then
+      return instrument(a.exp, log, memo)^(-a.max)
+   elseif ast.predicate.is(a) and (a.type=="lookahead") then
+      return #instrument(a.exp, log, memo)
+   elseif ast.predicate.is(a) and (a.type=="negation") then
+      return -instrument(a.exp, log, memo)
+   elseif ast.bracket.is(a) then
+      if not a.complement then return instrument(a.cexp, log, memo); end
+      -- The sub is tried without consuming input, and the complement is matched as compiled
+      return (#instrument(a.cexp, log, memo) + P(true)) * pat.peg
    end
-   return {match=expected, nextpos=nextpos, ast=a, subs=matches, input=input, start=start}
-end
-
-local function bracket_explanation(a, input, start, m, complement)
-   return (" " .. ast.tostring(a) ..
-	   " Looking at input pos " .. tostring(start) .. ": " .. input:sub(start) .. 
-           " And there " .. (m and "was" or "was NOT") .. " a match." ..
-           " And complement is: " .. tostring(complement))
+   return pat.peg
 end
 
-local function cs_simple(e, a, input, start, expected, nextpos)
-   local complement = a.complement
-   local simple = a.pat
-   assert(pattern.is(simple))
-   local wrapped_peg = common.match_node_wrap(simple.peg, "*")
-   local m, leftover = protected_match(wrapped_peg,
-				       input,
-				       start,
-				       common.attribute_table_to_table(e.encoder_parms))
-   local nextstart = #input - leftover + 1
-   if expected ~= nil then
-      if (m and (not complement)) then
-	 assert(expected, "simple character set match differs from expected: " ..
-		bracket_explanation(a, input, start, m, complement))
-      elseif (not m) and complement then
-	 assert(not expected, "simple character set non-match differs from expected: " ..
-		bracket_explanation(a, input, start, m, complement))
-      end
-   end -- if there is an expectation that we can check against
-   return {match=m, nextpos=nextpos, ast=a, input=input, start=start}
+function instrument(a, log, memo)
+   if not pattern.is(a.pat) then
+      error("Internal error: no pattern stored in ast node " .. ast.tostring(a)
+	 .. " (found " .. tostring(a.pat) .. ")")
+   end
+   local cached = memo[a]
+   if cached then
+      log.budget = log.budget - cached.size
+      return cached.peg
+   end
+   local budget = log.budget
+   log.budget = budget - 1
+   local peg = instrument_subs(a, log, memo)
+   -- The 'false' keeps the failure branch from matching the empty string, as far as lpeg can
+   -- tell, so that an instrumented loop body is accepted when the original one is.
+   peg = Cmt(P(true), recorder(log, ENTER, a)) *
+      (peg * Cmt(P(true), recorder(log, MATCHED, a)) + Cmt(P(true), recorder(log, FAILED, a)) * P(false))
+   memo[a] = {peg=peg, size=budget - log.budget}
+   return peg
 end
 
-local function bracket(e, a, input, start, expected, nextpos)
-   local subresult_expected
-   if expected~=nil then
-      subresult_expected = (not a.complement) and expected or (not expected)
-   end
-   local result = expression(e, a.cexp, input, start, subresult_expected, nextpos)
-   -- if ast.simple_charset_p(a.cexp) then
-   --    result = cs_simple(e, a.cexp, input, start, subresult_expected, nextpos)
-   -- elseif ast.choice.is(a.cexp) then
-   --    result = choice(e, a.cexp, input, start, subresult_expected, nextpos)
-   -- elseif ast.bracket.is(a.cexp) then
-   --    result = bracket(e, a.cexp, input, start, subresult_expected, nextpos)
-   -- elseif ast.cs_intersection.is(a.cexp) then
-   --    throw("character set intersection is not implemented", a)
-   -- elseif ast.cs_difference.is(a.cexp) then
-   --    throw("character set difference is not implemented", a)
-   -- else
-   --    assert(false, "trace: unknown cexp inside bracket: " .. tostring(a.cexp))
-   -- end
---   print("*** bracket intermediate result:"); for k,v in pairs(result) do print(k,v) end
-   if a.complement then
-      result.match = not result.match
-   end
-   if expected ~= nil then
-      if result.match and (not a.complement) then
-	 assert(expected, "bracket match differs from expected" ..
-		bracket_explanation(a, input, start, result.match, a.complement))
-      elseif (not result.match) and (not a.complement) then
-	 assert(not expected, "bracket non-match differs from expected" ..
-		bracket_explanation(a, input, start, result.match, a.complement))
+-- Build the trace tree from the log.  Nodes still open at the end (after a match that halted)
+-- are marked as failed.
+local function build(log, input)
+   local root, stack = nil, {}
+   for i = 1, log.n do
+      local kind, pos = log.kind[i], log.pos[i]
+      if kind == ENTER then
+	 local t = {ast=log.node[i], input=input, start=pos}
+	 local top = stack[#stack]
+	 if top then
+	    top.subs = top.subs or {}
+	    table.insert(top.subs, t)
+	 else
+	    root = root or t
+	 end
+	 table.insert(stack, t)
+      else
+	 local t = table.remove(stack)
+	 assert(t and t.ast==log.node[i], "trace events not nested")
+	 t.match = (kind == MATCHED)
+	 t.nextpos = t.match and pos or t.start
       end
-   end -- if there is an expectation that we can check against
-   return {match=result.match, nextpos=nextpos, ast=a, subs={result}, input=input, start=start}
-end
-      
-local function predicate(e, a, input, start, expected, nextpos)
-   local result = expression(e, a.exp, input, start)
-   if (result.match and (a.type=="lookahead")) or ((not result.match) and (a.type=="negation")) then
-      assert(expected, "predicate match differs from expected")
-      -- Cannot compare nextpos to result.nextpos, because 'a.exp' is NOT a predicate (so it
-      -- advances nextpos) whereas 'a' IS a predicate (which does not advance nextpos).
-      assert(nextpos==start, "predicate was evaluated, but nextpos advanced ahead of start???")
-   else
-      assert(not expected,
-	     "predicate non-match differs from expected: " .. ast.tostring(a) ..
-	     " on input: " .. input:sub(start))
    end
-   return {match=expected, nextpos=nextpos, ast=a, subs={result}, input=input, start=start}
-end
-
-local function and_exp(e, a, input, start, expected, nextpos)
-   -- TODO: 
-   return {match=expected, nextpos=nextpos, ast=a, input=input, start=start}
-end
-
-local function grammar(e, a, input, start, expected, nextpos)
-   -- FUTURE: Simulate a grammar using its pieces.  This will require some careful bouncing in and
-   -- out of lpeg because we cannot attempt a match against an lpeg.V(rulename) peg.
-   return {match=expected, nextpos=nextpos, ast=a, input=input, start=start}
+   for _, t in ipairs(stack) do t.match, t.nextpos = false, t.start; end
+   return root
 end
 
-function expression(e, a, input, start)
-   local pat = a.pat
-   if not pattern.is(pat) then
-      error("Internal error: no pattern stored in ast node " .. ast.tostring(a)
-	 .. " (found " .. tostring(pat) .. ")")
-   end
-   local peg = common.match_node_wrap(pat.peg, "*")
-   local m, leftover = protected_match(peg,
-				       input,
-				       start,
-				       common.attribute_table_to_table(e.encoder_parms))
-   local nextpos = #input-leftover+1
-   if ast.literal.is(a) then
-      return {match=m, nextpos=nextpos, ast=a, input=input, start=start}
-   elseif ast.bracket.is(a) then
-      return bracket(e, a, input, start, m, nextpos)
-   elseif ast.simple_charset_p(a) then
-      return cs_simple(e, a, input, start, m, nextpos)
-   elseif ast.sequence.is(a) then
-      return sequence(e, a, input, start, m, nextpos)
-   elseif ast.choice.is(a) then
-      return choice(e, a, input, start, m, nextpos)
-   elseif ast.and_exp.is(a) then
-      return and_exp(e, a, input, start, m, nextpos)
-   elseif ast.ref.is(a) then
-      return ref(e, a, input, start, m, nextpos)
-   elseif ast.atleast.is(a) then
-      return atleast(e, a, input, start, m, nextpos)
-   elseif ast.atmost.is(a) then
-      return atmost(e, a, input, start, m, nextpos)
-   elseif ast.predicate.is(a) then
-      return predicate(e, a, input, start, m, nextpos)
-   elseif ast.grammar.is(a) then
-      return grammar(e, a, input, start, m, nextpos)
-   else
-      return table.concat({"Internal error: invalid ast type in trace.expression:" .. tostring(a),
-			   "Arguments to trace:",
-			   ast.tostring(a),
-			   tostring(a),
-			   tostring(start),
-			   tostring(m),
-			   tostring(nextpos)},
-			  '\n')
+-- Add a node for each expression of a sequence or choice that was not tried, and replace the
+-- match of each grammar node that matched by its match data (which shows the rule that
+-- matched).
+local function finish(t, input, parms, match_start)
+   local a = t.ast
+   if t.subs then
+      local n = #t.subs
+      if (ast.sequence.is(a) or ast.choice.is(a)) and (n < #a.exps) then
+	 local nextstart = ast.sequence.is(a) and t.subs[n].start or t.subs[n].nextpos
+	 for i = n+1, #a.exps do
+	    table.insert(t.subs, {ast=a.exps[i], input=input, start=nextstart})
+	 end
+      end
+      for _, sub in ipairs(t.subs) do finish(sub, input, parms, match_start); end
+   elseif ast.grammar.is(a) and t.match then
+      t.match = protected_match(match_start * common.match_node_wrap(a.pat.peg, "*"),
+				input, t.start, parms)
    end
 end
 
@@ -502,7 +383,17 @@ function trace.internal(r, input, start)
    assert((pcall(rawget, r.pattern, "ast")))	    -- quack: "is ast a valid key in r.pattern?"
    local a = r.pattern.ast
    assert(a, "no ast stored for pattern")
-   return expression(r.engine, a, input, start)
+   local parms = common.attribute_table_to_table(r.engine.encoder_parms)
+   local log = new_log()
+   local peg = instrument(a, log, {})
+   -- Reset the step budget and profiling state that the checkpoints and counters in the
+   -- compiled pegs rely on, as a compiled pattern does when it starts a match
+   local compiler = r.engine.compiler
+   local match_start = compiler.match_start and compiler.match_start(r.engine.match_limits) or P(true)
+   protected_match(match_start * common.match_node_wrap(peg, "*"), input, start, parms)
+   local t = build(log, input)
+   finish(t, input, parms, match_start)
+   return t
 end
 
 local function prep_for_export(t)
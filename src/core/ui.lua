@@ -27,6 +27,17 @@ function ui.properties(name, obj, colorstring)
 	      color=color_explanation,
 	      binding=binding,
 	      source=origin and (origin.importpath or origin.filename)}
+   elseif common.lazy.is(obj) then
+      if obj.value then return ui.properties(name, obj.value, colorstring); end
+      local b = obj.ast				    -- a binding that has not been compiled
+      local color, reason = co.query(name, colorstring)
+      local origin = b.sourceref and b.sourceref.origin
+      return {name=name,
+	      type="pattern",
+	      capture=(not b.is_alias),
+	      color=color,
+	      binding=ast.tostring(b.exp),
+	      source=origin and (origin.importpath or origin.filename)}
    elseif environment.is(obj) then
       local origin = obj.origin
       return {name=name,
@@ -226,7 +226,7 @@ function ustring.escape(s, inv_mandatories)
 	       elseif cp <= 0xFFFF then
 		  local hex = string.format("%04X", cp)
 		  result = result .. ESC .. "u" .. hex
-		  if cp < 0x7FF then
+		  if cp <= 0x7FF then
 		     i = i + 2
 		  else
 		     i = i + 3
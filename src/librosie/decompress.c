@@ -0,0 +1,257 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  decompress.c   Part of librosie.c                                        */
+/*                                                                           */
+/*  © Copyright Jamie A. Jennings 2018.                                      */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+/* ----------------------------------------------------------------------------------------
+ * Decompression of matchfile inputs
+ * ----------------------------------------------------------------------------------------
+ *
+ * A compressed input (gzip when built with ZLIB=1, zstd when built
+ * with ZSTD=1) is decompressed by its own thread into a ring of
+ * DECOMPRESS_RING_SIZE buffers of DECOMPRESS_BUFFER_SIZE bytes.  The
+ * matching thread takes each buffer as soon as it is full and gives
+ * it back when it is done with it, so decompression overlaps with
+ * matching.  The compressed input is mapped into memory by the
+ * caller, so decompressing is the only copy of the data.
+ */
+
+#if defined(USE_ZLIB)
+#include <zlib.h>
+#endif
+
+#if defined(USE_ZSTD)
+#include <zstd.h>
+#endif
+
+#define DECOMPRESS_BUFFER_SIZE (4 * 1024 * 1024)
+#define DECOMPRESS_RING_SIZE 4
+
+#define INPUT_PLAIN 0
+#define INPUT_GZIP 1
+#define INPUT_ZSTD 2
+
+/* The format of an input, from its first bytes */
+static int input_format(const char *data, size_t size) {
+  const unsigned char *p = (const unsigned char *) data;
+  if (!p) return INPUT_PLAIN;
+  if ((size >= 2) && (p[0] == 0x1f) && (p[1] == 0x8b)) return INPUT_GZIP;
+  if ((size >= 4) && (p[0] == 0x28) && (p[1] == 0xb5) && (p[2] == 0x2f) && (p[3] == 0xfd))
+    return INPUT_ZSTD;
+  return INPUT_PLAIN;
+}
+
+/* TRUE when this librosie was built to decompress the format */
+static int can_decompress(int format) {
+#if defined(USE_ZLIB)
+  if (format == INPUT_GZIP) return TRUE;
+#endif
+#if defined(USE_ZSTD)
+  if (format == INPUT_ZSTD) return TRUE;
+#endif
+  (void) format;
+  return FALSE;
+}
+
+typedef struct decompressor {
+  int format;
+  const unsigned char *in;	/* the compressed input */
+  size_t in_len;
+  char *buffers[DECOMPRESS_RING_SIZE];
+  size_t lens[DECOMPRESS_RING_SIZE];
+  unsigned long produced;	/* buffers filled so far */
+  unsigned long consumed;	/* buffers given back so far */
+  int finished;			/* no more buffers will be filled */
+  int error;			/* why decompression ended, or SUCCESS */
+  int stop;			/* set when the consumer wants no more */
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} decompressor;
+
+/* Wait for a free buffer.  Returns NULL when the consumer has stopped. */
+static char *free_buffer(decompressor *d) {
+  char *buf;
+  pthread_mutex_lock(&d->lock);
+  while (!d->stop && ((d->produced - d->consumed) == DECOMPRESS_RING_SIZE))
+    pthread_cond_wait(&d->cond, &d->lock);
+  buf = d->stop ? NULL : d->buffers[d->produced % DECOMPRESS_RING_SIZE];
+  pthread_mutex_unlock(&d->lock);
+  return buf;
+}
+
+/* Hand the buffer returned by free_buffer() to the consumer */
+static void publish_buffer(decompressor *d, size_t len) {
+  pthread_mutex_lock(&d->lock);
+  d->lens[d->produced % DECOMPRESS_RING_SIZE] = len;
+  d->produced++;
+  pthread_cond_broadcast(&d->cond);
+  pthread_mutex_unlock(&d->lock);
+}
+
+#if defined(USE_ZLIB)
+/* A gzip file may hold several members (e.g. after 'cat a.gz b.gz'),
+ * which are decompressed one after the other.  Zlib takes at most
+ * UINT_MAX bytes of input at a time, so a large input is given to it
+ * in pieces.
+ */
+#define INFLATE_MAX_INPUT (1024 * 1024 * 1024)
+
+static int inflate_gzip(decompressor *d) {
+  int t;
+  char *buf = NULL;
+  z_stream z;
+  const unsigned char *next = d->in, *end = d->in + d->in_len;
+  memset(&z, 0, sizeof(z));
+  if (inflateInit2(&z, 15 + 16) != Z_OK) return ERR_OUT_OF_MEMORY; /* 16: gzip format */
+  t = Z_OK;
+  while ((t == Z_OK) && (buf = free_buffer(d))) {
+    z.next_out = (Bytef *) buf;
+    z.avail_out = DECOMPRESS_BUFFER_SIZE;
+    while (z.avail_out > 0) {
+      if ((z.avail_in == 0) && (next < end)) {
+	z.next_in = (Bytef *) next;
+	z.avail_in = ((end - next) > INFLATE_MAX_INPUT) ? INFLATE_MAX_INPUT : (end - next);
+	next += z.avail_in;
+      }
+      t = inflate(&z, Z_NO_FLUSH);
+      if ((t == Z_STREAM_END) && ((z.avail_in > 0) || (next < end))) {
+	t = inflateReset(&z);	/* another member follows */
+	continue;
+      }
+      if (t != Z_OK) break;
+    }
+    publish_buffer(d, DECOMPRESS_BUFFER_SIZE - z.avail_out);
+  }
+  inflateEnd(&z);
+  if ((t == Z_STREAM_END) || !buf) return SUCCESS;
+  LOGf("inflate failed with %d\n", t);
+  return (t == Z_MEM_ERROR) ? ERR_OUT_OF_MEMORY : ERR_CORRUPT_INPUT;
+}
+#endif
+
+#if defined(USE_ZSTD)
+/* Frames that follow one another are decompressed in turn */
+static int decompress_zstd(decompressor *d) {
+  size_t t = 1, in_pos, out_pos;
+  int done = FALSE, stuck = FALSE;
+  char *buf = NULL;
+  ZSTD_inBuffer in = {d->in, d->in_len, 0};
+  ZSTD_outBuffer out;
+  ZSTD_DStream *z = ZSTD_createDStream();
+  if (!z) return ERR_OUT_OF_MEMORY;
+  ZSTD_initDStream(z);
+  while (!done && !stuck && !ZSTD_isError(t) && (buf = free_buffer(d))) {
+    out.dst = buf;
+    out.size = DECOMPRESS_BUFFER_SIZE;
+    out.pos = 0;
+    while (out.pos < out.size) {
+      done = (t == 0) && (in.pos == in.size);
+      if (done) break;
+      in_pos = in.pos;
+      out_pos = out.pos;
+      t = ZSTD_decompressStream(z, &out, &in);
+      if (ZSTD_isError(t)) break;
+      /* No progress means the input ends in the middle of a frame */
+      stuck = (in.pos == in_pos) && (out.pos == out_pos);
+      if (stuck) break;
+    }
+    publish_buffer(d, out.pos);
+  }
+  ZSTD_freeDStream(z);
+  if (done || !buf) return SUCCESS;
+  LOGf("zstd decompression failed: %s\n",
+       ZSTD_isError(t) ? ZSTD_getErrorName(t) : "truncated input");
+  return ERR_CORRUPT_INPUT;
+}
+#endif
+
+static void *decompressor_main(void *arg) {
+  decompressor *d = (decompressor *) arg;
+  int t = ERR_CORRUPT_INPUT;
+#if defined(USE_ZLIB)
+  if (d->format == INPUT_GZIP) t = inflate_gzip(d);
+#endif
+#if defined(USE_ZSTD)
+  if (d->format == INPUT_ZSTD) t = decompress_zstd(d);
+#endif
+  pthread_mutex_lock(&d->lock);
+  d->finished = TRUE;
+  d->error = t;
+  pthread_cond_broadcast(&d->cond);
+  pthread_mutex_unlock(&d->lock);
+  return NULL;
+}
+
+/* Start decompressing the size bytes at data on a new thread.  Returns
+ * SUCCESS, ERR_OUT_OF_MEMORY, or ERR_SYSCALL_FAILED.
+ */
+static int decompressor_start(decompressor *d, int format, const char *data, size_t size) {
+  int i, t;
+  memset(d, 0, sizeof(decompressor));
+  d->format = format;
+  d->in = (const unsigned char *) data;
+  d->in_len = size;
+  for (i = 0; i < DECOMPRESS_RING_SIZE; i++) {
+    d->buffers[i] = malloc(DECOMPRESS_BUFFER_SIZE);
+    if (!d->buffers[i]) {
+      while (i > 0) free(d->buffers[--i]);
+      return ERR_OUT_OF_MEMORY;
+    }
+  }
+  pthread_mutex_init(&d->lock, NULL);
+  pthread_cond_init(&d->cond, NULL);
+  t = pthread_create(&d->thread, NULL, decompressor_main, d);
+  if (t) {
+    LOGf("pthread_create failed with %d\n", t);
+    pthread_mutex_destroy(&d->lock);
+    pthread_cond_destroy(&d->cond);
+    for (i = 0; i < DECOMPRESS_RING_SIZE; i++) free(d->buffers[i]);
+    return ERR_SYSCALL_FAILED;
+  }
+  return SUCCESS;
+}
+
+/* Wait for the next full buffer, which the caller must give back with
+ * decompressor_release() before asking for another.  Returns FALSE at
+ * the end of the output.  (A buffer may be empty.)
+ */
+static int decompressor_next(decompressor *d, const char **data, size_t *len) {
+  int more;
+  pthread_mutex_lock(&d->lock);
+  while ((d->consumed == d->produced) && !d->finished)
+    pthread_cond_wait(&d->cond, &d->lock);
+  more = (d->consumed < d->produced);
+  if (more) {
+    *data = d->buffers[d->consumed % DECOMPRESS_RING_SIZE];
+    *len = d->lens[d->consumed % DECOMPRESS_RING_SIZE];
+  }
+  pthread_mutex_unlock(&d->lock);
+  return more;
+}
+
+static void decompressor_release(decompressor *d) {
+  pthread_mutex_lock(&d->lock);
+  d->consumed++;
+  pthread_cond_broadcast(&d->cond);
+  pthread_mutex_unlock(&d->lock);
+}
+
+/* Stop the decompression thread (if it is still running) and free the
+ * buffers.  Returns SUCCESS, or the error that ended decompression.
+ */
+static int decompressor_stop(decompressor *d) {
+  int i;
+  pthread_mutex_lock(&d->lock);
+  d->stop = TRUE;
+  pthread_cond_broadcast(&d->cond);
+  pthread_mutex_unlock(&d->lock);
+  pthread_join(d->thread, NULL);
+  pthread_mutex_destroy(&d->lock);
+  pthread_cond_destroy(&d->cond);
+  for (i = 0; i < DECOMPRESS_RING_SIZE; i++) free(d->buffers[i]);
+  return d->error;
+}
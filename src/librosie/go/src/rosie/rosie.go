@@ -0,0 +1,640 @@
+//  -*- Mode: Go; -*-                                                 
+// 
+//  rosie.go
+// 
+//  © Copyright IBM Corporation 2017, 2018.
+//  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)
+//  AUTHOR: Jamie A. Jennings
+
+// Package rosie contains functions for using Rosie Pattern Language
+package rosie
+
+// #cgo LDFLAGS: ${SRCDIR}/librosie.a -lm -ldl
+// #include <stdlib.h>
+// #include "librosie.h"
+// #cgo CFLAGS: -I./include
+//
+// /* The cgo rules do not allow Go memory that holds a Go pointer to
+//    be passed to C, so a rosie string that points at a Go byte slice
+//    is made here, on the C side of the call.  The input is not
+//    copied. */
+//
+// static unsigned char empty_input[1];
+//
+// static int match_bytes(Engine *e, int pat, int start, char *encoder,
+//                        unsigned char *ptr, size_t len, match *m) {
+//   str input = rosie_string_from(ptr ? ptr : empty_input, len);
+//   return rosie_match(e, pat, start, encoder, &input, m);
+// }
+//
+// /* Record i of a batch is data[ends[i-1] .. ends[i]-1], where
+//    ends[-1] is taken to be 0. */
+// static int match_batch_bytes(Engine *e, int pat, int start, char *encoder,
+//                              unsigned char *data, int *ends, int n, match *matches) {
+//   int i, t, s = 0;
+//   str *inputs = malloc(n * sizeof(str));
+//   if (!inputs) return ERR_OUT_OF_MEMORY;
+//   for (i = 0; i < n; i++) {
+//     inputs[i] = rosie_string_from(data ? data + s : empty_input, ends[i] - s);
+//     s = ends[i];
+//   }
+//   t = rosie_match_batch(e, pat, start, encoder, n, inputs, matches);
+//   free(inputs);
+//   return t;
+// }
+import "C"
+
+import "unsafe"
+import "errors"
+import "runtime"
+import "encoding/json"
+import "strings"
+
+type Engine struct {
+ 	ptr *C.struct_rosie_engine
+}
+
+type Pattern struct {
+	id C.int
+	engine *Engine
+}
+
+// A RawMatch holds the match data produced by an output encoder.
+// Data is a view of memory owned by the engine, valid only until the
+// next call of any kind on the same engine.  Copy it (e.g. with
+// append([]byte(nil), m.Data...)) to keep it longer.  Data is nil
+// when there was no match, or when the encoder (e.g. "bool") produces
+// no data, in which case Matched tells whether the input matched.
+type RawMatch struct {
+	Data []byte
+	Matched bool
+	Leftover int
+	Abend bool
+	Total_time int
+	Match_time int
+}
+
+type Match struct {
+	Data map[string]interface{}
+	Leftover int
+	Abend bool
+	Total_time int
+	Match_time int
+}
+
+type (
+	Trace map[string]interface{}
+	Configuration [] [] map[string] string
+	Messages [] interface{}
+	RosieString = C.struct_rosie_string
+	RosieStringPtr = *C.struct_rosie_string
+)
+
+func finalizeEngine(en *Engine) {
+	C.rosie_finalize(en.ptr)
+}
+		
+func finalizePattern(p *Pattern) {
+	if p.id != 0 {
+		C.rosie_free_rplx(p.engine.ptr, p.id)
+		p.id = C.int(0)
+	}
+}
+
+
+// -----------------------------------------------------------------------------
+// String conversions, message decoding
+
+// goString converts a rosie string to a go string
+func goString(cstr RosieString) string {
+	return C.GoStringN((*C.char)(unsafe.Pointer(cstr.ptr)), C.int(cstr.len))
+}
+
+// goBytes converts a rosie string to a go byte slice
+func goBytes(cstr RosieString) []byte {
+	return C.GoBytes(unsafe.Pointer(cstr.ptr), C.int(cstr.len))
+}
+
+// byteView returns a slice over n bytes at p without copying them
+func byteView(p unsafe.Pointer, n int) []byte {
+	if n == 0 {
+		return []byte{}
+	}
+	return (*[1 << 30]byte)(p)[:n:n]
+}
+
+// bytesPtr returns a pointer to the first byte of b, or nil
+func bytesPtr(b []byte) *C.uchar {
+	if len(b) == 0 {
+		return nil
+	}
+	return (*C.uchar)(unsafe.Pointer(&b[0]))
+}
+
+// rosieString converts a go string to a rosie string
+func rosieString(s string) RosieString {
+	return C.rosie_string_from((*C.uchar)(unsafe.Pointer(C.CString(s))), C.size_t(len(s)))
+}
+
+// rosieStringFromBytes converts a go byte slice to a rosie string
+func rosieStringFromBytes(b []byte) RosieString {
+	return C.rosie_string_from((*C.uchar)(C.CBytes(b)), C.size_t(len(b)))
+}
+
+
+func mungeMessages(Cmessages RosieString) (messages Messages, err error) {
+	if Cmessages.ptr != nil {
+		err := json.Unmarshal(goBytes(Cmessages), &messages)
+		if err != nil {
+			return nil, err
+		}
+		return messages, nil
+ 	} 
+	return nil, nil
+}
+
+
+// -----------------------------------------------------------------------------
+// Create a rosie pattern engine
+
+func New(name string) (en *Engine, err error) {
+	var messages RosieString
+	var en_ptr *C.struct_rosie_engine
+	en_ptr, err = C.rosie_new(&messages)
+	if en_ptr == nil {
+		var printable_message string
+		if messages.ptr == nil {
+			printable_message = "initialization failed with an unknown error"
+		} else {
+			printable_message = goString(messages)
+		}
+		return nil, errors.New(printable_message)
+	}
+	engine := Engine{en_ptr}
+	runtime.SetFinalizer(&engine, finalizeEngine)
+	return &engine, nil
+}
+
+
+// -----------------------------------------------------------------------------
+// Get an engine's configuration
+
+func (en *Engine) Config() (cfg Configuration, err error) {
+	var data C.struct_rosie_string
+	defer C.rosie_free_string(data)
+ 	if ok, err := C.rosie_config(en.ptr, &data); ok != 0 {
+		return nil, err
+	}
+	if err = json.Unmarshal(goBytes(data), &cfg); err != nil {
+		return nil, err
+	}
+	return cfg, err
+}
+
+
+// -----------------------------------------------------------------------------
+// Compile an expression, returning a compiled pattern
+
+func (en *Engine) Compile(exp string) (pat *Pattern, messages Messages, err error) {
+ 	var Cexp = rosieString(exp)
+	var Cmessages RosieString
+	pat = &Pattern{C.int(0), en}
+	runtime.SetFinalizer(pat, finalizePattern)
+	defer C.rosie_free_string(Cmessages)
+	
+ 	if ok, err := C.rosie_compile(en.ptr, &Cexp, &pat.id, &Cmessages); ok != 0 {
+		return pat, nil, err
+	}
+	if messages, err = mungeMessages(Cmessages); err != nil {
+		pat = nil
+	}
+	return pat, messages, err
+}
+
+// CompileProjected is like Compile, but the matches of the compiled
+// pattern hold only the captures named in keep, under a top-level
+// capture named "*".
+func (en *Engine) CompileProjected(exp string, keep []string) (pat *Pattern, messages Messages, err error) {
+	var Cexp = rosieString(exp)
+	var names = " "
+	for _, name := range keep {
+		names += name + " "
+	}
+	var Ckeep = rosieString(names)
+	var Cmessages RosieString
+	pat = &Pattern{C.int(0), en}
+	runtime.SetFinalizer(pat, finalizePattern)
+	defer C.rosie_free_string(Cmessages)
+
+	if ok, err := C.rosie_compile_projected(en.ptr, &Cexp, &Ckeep, &pat.id, &Cmessages); ok != 0 {
+		return pat, nil, err
+	}
+	if messages, err = mungeMessages(Cmessages); err != nil {
+		pat = nil
+	}
+	return pat, messages, err
+}
+
+
+// -----------------------------------------------------------------------------
+// Match an input string or byte slice against a compiled pattern
+
+func (pat *Pattern) Match(input []byte) (match *Match, err error) {
+	return pat.MatchFrom(input, 1)
+}
+	
+func (pat *Pattern) MatchString(input string) (match *Match, err error) {
+	return pat.MatchStringFrom(input, 1)
+}
+	
+func (pat *Pattern) MatchStringFrom(input string, start int) (match *Match, err error) {
+	return pat.MatchFrom([]byte(input), start)
+}
+
+func (pat *Pattern) MatchFrom(input []byte, start int) (match *Match, err error) {
+	var Cmatch C.struct_rosie_matchresult
+	var Cencoder = C.CString("json")
+	defer C.free(unsafe.Pointer(Cencoder))
+	var newMatch Match
+	match = &newMatch
+	
+	ok, err := C.match_bytes(pat.engine.ptr, pat.id, C.int(start), Cencoder,
+		bytesPtr(input), C.size_t(len(input)), &Cmatch)
+	if ok != 0 {
+		return nil, err
+	}
+
+ 	match.Leftover = int(Cmatch.leftover)
+ 	match.Abend = (Cmatch.abend != 0)
+ 	match.Total_time = int(Cmatch.ttotal)
+ 	match.Match_time = int(Cmatch.tmatch)
+
+	if Cmatch.data.ptr != nil {
+		if err = json.Unmarshal(goBytes(Cmatch.data), &match.Data); err != nil {
+			return nil, err
+		}
+	}
+
+	return match, nil
+}
+
+// -----------------------------------------------------------------------------
+// Match with choice of output encoder, returning match data as a byte
+// slice.  The input is passed to librosie without being copied, and
+// the match data is not copied either (see RawMatch).
+
+func rawMatch(Cmatch *C.struct_rosie_matchresult) (match RawMatch, err error) {
+	match.Leftover = int(Cmatch.leftover)
+	match.Abend = (Cmatch.abend != 0)
+	match.Total_time = int(Cmatch.ttotal)
+	match.Match_time = int(Cmatch.tmatch)
+	if Cmatch.data.ptr != nil {
+		match.Data = byteView(unsafe.Pointer(Cmatch.data.ptr), int(Cmatch.data.len))
+		match.Matched = true
+		return match, nil
+	}
+	switch Cmatch.data.len {
+	case C.NO_MATCH: return match, nil
+	case C.MATCH_WITHOUT_DATA:
+		match.Matched = true
+		return match, nil
+	case C.ERR_NO_ENCODER: return match, errors.New("invalid output encoder")
+	case C.ERR_NO_PATTERN: return match, errors.New("invalid compiled pattern (already freed?)")
+	default: return match, errors.New("unknown error during match")
+	}
+}
+
+func (pat *Pattern) MatchRaw(input []byte, start int, encoder string) (match RawMatch, err error) {
+	var Cmatch C.struct_rosie_matchresult
+	var Cencoder = C.CString(encoder)
+	defer C.free(unsafe.Pointer(Cencoder))
+	ok := C.match_bytes(pat.engine.ptr, pat.id, C.int(start), Cencoder,
+		bytesPtr(input), C.size_t(len(input)), &Cmatch)
+	if ok != 0 {
+		return match, errors.New("match failed (please report this as a bug)")
+	}
+	return rawMatch(&Cmatch)
+}
+
+// MatchBatch matches each record in data in one call into librosie.
+// Record i is data[ends[i-1]:ends[i]] (record 0 starts at 0), so a
+// batch of records that are already in one buffer is not copied.  The
+// result data is valid only until the next call of any kind on the
+// engine, because any call (e.g. a compile) can collect it.
+func (pat *Pattern) MatchBatch(data []byte, ends []int, start int, encoder string) (matches []RawMatch, err error) {
+	n := len(ends)
+	if n == 0 {
+		return nil, nil
+	}
+	prev := 0
+	for _, end := range ends {
+		if (end < prev) || (end > len(data)) {
+			return nil, errors.New("record boundaries out of order or out of range")
+		}
+		prev = end
+	}
+	Cends := make([]C.int, n)
+	for i, end := range ends {
+		Cends[i] = C.int(end)
+	}
+	Cmatches := make([]C.struct_rosie_matchresult, n)
+	var Cencoder = C.CString(encoder)
+	defer C.free(unsafe.Pointer(Cencoder))
+	ok := C.match_batch_bytes(pat.engine.ptr, pat.id, C.int(start), Cencoder,
+		bytesPtr(data), &Cends[0], C.int(n), &Cmatches[0])
+	if ok != 0 {
+		return nil, errors.New("match batch failed (please report this as a bug)")
+	}
+	matches = make([]RawMatch, n)
+	for i := range Cmatches {
+		if matches[i], err = rawMatch(&Cmatches[i]); err != nil {
+			return nil, err
+		}
+	}
+	return matches, nil
+}
+
+// MatchBatchSlices is MatchBatch for records in separate slices,
+// which are gathered into one buffer first.
+func (pat *Pattern) MatchBatchSlices(inputs [][]byte, start int, encoder string) ([]RawMatch, error) {
+	size := 0
+	for _, input := range inputs {
+		size += len(input)
+	}
+	data := make([]byte, 0, size)
+	ends := make([]int, len(inputs))
+	for i, input := range inputs {
+		data = append(data, input...)
+		ends[i] = len(data)
+	}
+	return pat.MatchBatch(data, ends, start, encoder)
+}
+
+// -----------------------------------------------------------------------------
+// Match each line of a file (or the whole file) in one call into
+// librosie.  Empty file names mean stdin, stdout and stderr.  Returns
+// the number of lines read, matched and not matched.
+
+func (pat *Pattern) MatchFile(encoder string, wholefile bool, infile, outfile, errfile string) (cin, cout, cerr int, err error) {
+	return pat.MatchFileMax(encoder, wholefile, 0, infile, outfile, errfile)
+}
+
+// Like MatchFile, but stop after maxcount lines have matched, when
+// maxcount > 0.  The "count" encoder writes no output at all.
+
+func (pat *Pattern) MatchFileMax(encoder string, wholefile bool, maxcount int, infile, outfile, errfile string) (cin, cout, cerr int, err error) {
+	var Cin, Cout, Cerr C.int
+	var Cerrmsg RosieString
+	var Cencoder = C.CString(encoder)
+	var Cinfile = C.CString(infile)
+	var Coutfile = C.CString(outfile)
+	var Cerrfile = C.CString(errfile)
+	defer C.free(unsafe.Pointer(Cencoder))
+	defer C.free(unsafe.Pointer(Cinfile))
+	defer C.free(unsafe.Pointer(Coutfile))
+	defer C.free(unsafe.Pointer(Cerrfile))
+	var Cwholefile = C.int(0)
+	if wholefile {
+		Cwholefile = 1
+	}
+	ok := C.rosie_matchfile_max(pat.engine.ptr, pat.id, Cencoder, Cwholefile, C.int(maxcount),
+		Cinfile, Coutfile, Cerrfile, &Cin, &Cout, &Cerr, &Cerrmsg)
+	defer C.rosie_free_string(Cerrmsg)
+	if ok != 0 {
+		return 0, 0, 0, errors.New("matchfile failed: " + goString(Cerrmsg))
+	}
+	if Cin == -1 {
+		switch Cout {
+		case C.ERR_NO_ENCODER: return 0, 0, 0, errors.New("invalid output encoder")
+		case C.ERR_NO_FILE: return 0, 0, 0, errors.New(goString(Cerrmsg))
+		case C.ERR_NO_PATTERN: return 0, 0, 0, errors.New("invalid compiled pattern (already freed?)")
+		case C.ERR_CORRUPT_INPUT: return 0, 0, 0, errors.New("compressed input could not be decompressed")
+		default: return 0, 0, 0, errors.New("unknown error caused matchfile to fail")
+		}
+	}
+	return int(Cin), int(Cout), int(Cerr), nil
+}
+
+// Report whether any line of infile (or the whole file) matches,
+// stopping at the first match and writing no output.
+
+func (pat *Pattern) AnyMatch(wholefile bool, infile string) (bool, error) {
+	_, cout, _, err := pat.MatchFileMax("count", wholefile, 1, infile, "", "")
+	return cout > 0, err
+}
+
+
+
+// -----------------------------------------------------------------------------
+// TODO: Trace without choice of output encoder, returning a map of
+// the full trace
+
+
+// -----------------------------------------------------------------------------
+// Trace the matching process, given an input string or byte slice and
+// a compiled pattern
+
+func (pat *Pattern) StrTrace(input []byte, style string) (trace *string, err error) {
+	return pat.StrTraceFrom(input, 1, style)
+}
+	
+func (pat *Pattern) StrTraceString(input string, style string) (trace *string, err error) {
+	return pat.StrTraceStringFrom(input, 1, style)
+}
+	
+func (pat *Pattern) StrTraceStringFrom(input string, start int, style string) (trace *string, err error) {
+	return pat.StrTraceFrom([]byte(input), start, style)
+}
+
+func (pat *Pattern) StrTraceFrom(input []byte, start int, style string) (trace *string, err error) {
+	var Ctrace RosieString
+	var Cinput = rosieStringFromBytes(input)
+	defer C.rosie_free_string(Cinput)
+	var Cstyle = C.CString(style)
+	var Cmatch_flag = C.int(0)
+	
+	ok, err := C.rosie_trace(pat.engine.ptr, pat.id, C.int(start), Cstyle, &Cinput, &Cmatch_flag, &Ctrace)
+	if ok != 0 {
+		return nil, err
+	}
+
+	if Ctrace.ptr == nil {
+		// Error occurred (but not a bug)
+		switch Ctrace.len {
+		case 2: return nil, errors.New("invalid trace style")
+		case 1: return nil, errors.New("invalid compiled pattern (already freed?)")
+		default: return nil, errors.New("unknown error during trace")
+		}
+	}
+
+	answer := goString(Ctrace)
+	return &answer, nil
+
+}
+
+// -----------------------------------------------------------------------------
+// Load RPL code into a Rosie engine
+
+func (en *Engine) LoadString(src string) (ok bool, pkgname string, messages Messages, err error) {
+	var Cok = C.int(0)
+ 	var Csrc = rosieString(src)
+	var Cmessages, Cpkgname RosieString
+	defer C.rosie_free_string(Cmessages)
+	
+ 	loadOK, errLoad := C.rosie_load(en.ptr, &Cok, &Csrc, &Cpkgname, &Cmessages)
+	messages, err = mungeMessages(Cmessages)
+	pkgname = goString(Cpkgname)
+	if loadOK != 0 {
+		return false, pkgname, messages, errLoad
+	}
+	return (Cok==1), pkgname, messages, nil
+}
+
+func (en *Engine) LoadFile(fn string) (ok bool, pkgname string, messages Messages, err error) {
+	var Cok = C.int(0)
+ 	var Cfn = rosieString(fn)
+	var Cmessages, Cpkgname RosieString
+	defer C.rosie_free_string(Cmessages)
+	
+ 	loadOK, errLoad := C.rosie_loadfile(en.ptr, &Cok, &Cfn, &Cpkgname, &Cmessages)
+	messages, err = mungeMessages(Cmessages)
+	pkgname = goString(Cpkgname)
+	if loadOK != 0 {
+		return false, pkgname, messages, errLoad
+	}
+	return (Cok==1), pkgname, messages, nil
+}
+
+func (en *Engine) ImportPkg(pkgname string) (bool, string, Messages, error) {
+	return en.ImportPkgAs(pkgname, "")
+}
+
+func (en *Engine) ImportPkgAs(pkgname string, asname string) (ok bool, actualPkgname string, messages Messages, err error) {
+	var Cok = C.int(0)
+ 	var Cpkgname = rosieString(pkgname)
+	var CactualPkgname = C.rosie_string_from(nil, 0)
+ 	var Casname RosieString
+	var Casname_ptr RosieStringPtr = nil
+	if asname != "" {
+		Casname = rosieString(asname)
+		Casname_ptr = &Casname
+	}
+	var Cmessages RosieString
+	defer C.rosie_free_string(Cmessages)
+	
+ 	loadOK, errLoad := C.rosie_import(en.ptr, &Cok, &Cpkgname, Casname_ptr, &CactualPkgname, &Cmessages)
+	messages, err = mungeMessages(Cmessages)
+	actualPkgname = goString(CactualPkgname)
+	if loadOK != 0 {
+		return false, actualPkgname, messages, errLoad
+	}
+	return (Cok==1), actualPkgname, messages, nil
+}
+
+// SetDictionary defines the dictionary used in rpl by dictionary:#name.
+// When entries is nil, the file called name is read.  Patterns already
+// compiled from the dictionary match its new entries.
+func (en *Engine) SetDictionary(name string, entries []string) (ok bool, message string, err error) {
+	var Cok = C.int(0)
+	var Cname = rosieString(name)
+	var Centries RosieString
+	var Centries_ptr RosieStringPtr = nil
+	if entries != nil {
+		Centries = rosieString(strings.Join(entries, "\n"))
+		Centries_ptr = &Centries
+	}
+	var Cmessages RosieString
+	defer C.rosie_free_string(Cmessages)
+
+	setOK, errSet := C.rosie_set_dictionary(en.ptr, &Cok, &Cname, Centries_ptr, &Cmessages)
+	if setOK != 0 {
+		return false, "", errSet
+	}
+	if Cmessages.ptr != nil {
+		message = goString(Cmessages)
+	}
+	return (Cok==1), message, nil
+}
+
+// -----------------------------------------------------------------------------
+// Get, set the engine's search path (a colon-separated list of
+// directories to search for libraries loaded via 'import'.
+
+func (en *Engine) GetLibpath() (libpath string, err error) {
+	var Clibpath = C.rosie_string_from(nil, 0)
+ 	if ok, err := C.rosie_libpath(en.ptr, &Clibpath); ok != 0 {
+		return "", err
+	}
+	libpath = goString(Clibpath)
+	return libpath, nil
+}
+
+func (en *Engine) SetLibpath(libpath string) (err error) {
+	var Clibpath = rosieString(libpath)
+ 	if ok, err := C.rosie_libpath(en.ptr, &Clibpath); ok != 0 {
+		return err
+	}
+	return nil
+}
+
+// -----------------------------------------------------------------------------
+// Get, set the engine's memory allocation limit, which is a number of
+// Kb above whatever is the current memory usage level.  When Rosie's
+// working memory (heap) exceeds the soft limit, it will force a GC in
+// a best effort to reduce memory consumption.
+
+func (en *Engine) GetAllocLimit() (softlimit int, current_usage int, err error) {
+	var Climit = C.int(-1)
+	var Cusage = C.int(0)
+ 	if ok, err := C.rosie_alloc_limit(en.ptr, &Climit, &Cusage); ok != 0 {
+		return 0, 0, err
+	}
+	return int(Climit), int(Cusage), nil
+}
+
+func (en *Engine) SetAllocLimit(softlimit int) (actual_limit int, current_usage int, err error) {
+	if (softlimit < 8192) && (softlimit != 0) {
+		return 0, 0, errors.New("limit must be 0 or higher than the Rosie minimum value")
+	}
+	var Climit = C.int(softlimit)
+	var Cusage = C.int(0)
+ 	if ok, err := C.rosie_alloc_limit(en.ptr, &Climit, &Cusage); ok != 0 {
+		return 0, 0, err
+	}
+	return int(Climit), int(Cusage), nil
+}
+
+// Garbage collector modes for GCMode, as in librosie.h
+const (
+	GCIncremental = C.ROSIE_GC_INCREMENTAL
+	GCGenerational = C.ROSIE_GC_GENERATIONAL // only with Lua 5.4
+	GCManual = C.ROSIE_GC_MANUAL
+)
+
+// Do a bounded amount of garbage collection work (budget is in KB of
+// allocation, and zero means one basic step), e.g. between batches of
+// matches.  Returns true when a collection cycle finished.
+
+func (en *Engine) GCStep(budget int) (finished bool, err error) {
+	var Cfinished C.int
+	if ok := C.rosie_gc_step(en.ptr, C.int(budget), &Cfinished); ok != 0 {
+		return false, errors.New("gc step failed: invalid budget")
+	}
+	return Cfinished != 0, nil
+}
+
+// Set the collector mode and its parameters.  Zero leaves a parameter
+// unchanged.
+
+func (en *Engine) GCMode(mode, param1, param2 int) error {
+	if ok := C.rosie_gc_mode(en.ptr, C.int(mode), C.int(param1), C.int(param2)); ok != 0 {
+		return errors.New("setting the gc mode failed: unsupported mode or invalid parameters")
+	}
+	return nil
+}
+
+
+
+
+
+
@@ -55,6 +55,10 @@
 #include <stdarg.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include "librosie.h"
 
@@ -69,6 +73,7 @@ static char bootscript[MAXPATHLEN];
 #include "logging.c"
 #include "registry.c"
 #include "rosiestring.c"
+#include "decompress.c"
 
 /* Symbol visibility in the final library */
 #define EXPORT __attribute__ ((visibility("default")))
@@ -101,9 +106,54 @@ static char bootscript[MAXPATHLEN];
  * ----------------------------------------------------------------------------------------
  */
 
-#define ACQUIRE_ENGINE_LOCK(e) ACQUIRE_LOCK((e)->lock)
+typedef struct rosie_gc_policy {
+  int mode;			/* ROSIE_GC_INCREMENTAL, etc. */
+  int param1;			/* see rosie_gc_mode() */
+  int param2;
+} GCPolicy;
+
+/* The parts of an engine that are not in the public Engine struct,
+   whose layout stays as it was.  Each Engine is the first member of
+   an engine_state, so STATE(e) reaches the rest.
+ */
+typedef struct engine_state {
+  Engine engine;
+  struct rosie_allocator *allocator; /* NULL when Lua's default allocator is used */
+  size_t heap;			/* bytes in use, when allocator is NULL */
+  size_t peak_heap;
+  EngineStats stats;		/* protected by the engine lock */
+  GCPolicy gc;			/* as last set by rosie_gc_mode() */
+} engine_state;
+
+#define STATE(e) ((engine_state *) (e))
+
+static inline uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+/* When the lock is held by another thread, the wait is counted in
+   the engine stats (see rosie_stats()), which are protected by the
+   lock itself.
+ */
+#define ACQUIRE_ENGINE_LOCK(e) do {					\
+  if (pthread_mutex_trylock(&((e)->lock))) {				\
+    uint64_t t0_ = now_us();						\
+    ACQUIRE_LOCK((e)->lock);						\
+    STATE(e)->stats.lock_waits++;					\
+    STATE(e)->stats.lock_wait_us += now_us() - t0_;			\
+  }									\
+} while (0)
+
 #define RELEASE_ENGINE_LOCK(e) RELEASE_LOCK((e)->lock)
 
+/* Each Lua state created by librosie holds a pointer to its engine in
+   the extra space before the state, so that functions given only the
+   Lua state can update the engine stats.
+ */
+#define ENGINE_OF(L) (*(Engine **) lua_getextraspace(L))
+
 /* ----------------------------------------------------------------------------------------
  * Start-up / boot functions
  * ----------------------------------------------------------------------------------------
@@ -319,8 +369,162 @@ static int violations_to_json_string(lua_State *L, str *json_string) {
 int luaopen_lpeg (lua_State *L);
 int luaopen_cjson_safe(lua_State *l);
 
-static lua_State *newstate() {
-  lua_State *newL = luaL_newstate();
+/* ----------------------------------------------------------------------------------------
+ * Allocators
+ * ----------------------------------------------------------------------------------------
+ */
+
+/* An engine created by rosie_new_with_allocator() allocates through
+ * rosie_alloc(), which enforces a hard limit on the bytes in use (if
+ * one is given) and then calls either the client's lua_Alloc or the
+ * built-in pool allocator.  When an allocation is refused, Lua runs
+ * an emergency collection and tries again before raising a memory
+ * error, so no polling of the heap size is needed.
+ *
+ * The pool allocator serves blocks of up to POOL_QUANTUM *
+ * POOL_CLASSES bytes (most Lua objects, including match tree nodes)
+ * from per-size free lists carved out of large slabs, and uses
+ * malloc for everything else.  Lua always passes the size of the old
+ * block, so the size class of a block being freed is known.  The
+ * slabs are freed when the engine is finalized.
+ */
+#define POOL_QUANTUM 16
+#define POOL_CLASSES 16
+#define POOL_SLAB_SIZE (64 * 1024)
+
+#define POOL_MAX (POOL_QUANTUM * POOL_CLASSES)
+#define POOL_CLASS(size) (((size) - 1) / POOL_QUANTUM)
+
+typedef union pool_slab {
+  union pool_slab *next;
+  char align[POOL_QUANTUM];	/* blocks after the header stay aligned */
+} pool_slab;
+
+struct rosie_allocator {
+  lua_Alloc f;			/* NULL for the pool allocator */
+  void *ud;
+  size_t limit;			/* in bytes, or zero for no limit */
+  size_t in_use;
+  size_t peak;			/* largest in_use so far */
+  void *free_list[POOL_CLASSES];
+  pool_slab *slabs;
+  char *slab_next;		/* unused part of the newest slab */
+  char *slab_end;
+};
+
+static void *pool_get(struct rosie_allocator *a, size_t size) {
+  int c = POOL_CLASS(size);
+  size_t block_size = (c + 1) * POOL_QUANTUM;
+  void *block = a->free_list[c];
+  pool_slab *slab;
+  if (block) {
+    a->free_list[c] = *(void **) block;
+    return block;
+  }
+  if ((size_t) (a->slab_end - a->slab_next) < block_size) {
+    slab = malloc(POOL_SLAB_SIZE);
+    if (!slab) return NULL;
+    slab->next = a->slabs;
+    a->slabs = slab;
+    a->slab_next = (char *) (slab + 1);
+    a->slab_end = ((char *) slab) + POOL_SLAB_SIZE;
+  }
+  block = a->slab_next;
+  a->slab_next += block_size;
+  return block;
+}
+
+static void pool_release(struct rosie_allocator *a, void *block, size_t size) {
+  int c;
+  if (!block) return;
+  if (size > POOL_MAX) {
+    free(block);
+    return;
+  }
+  c = POOL_CLASS(size);
+  *(void **) block = a->free_list[c];
+  a->free_list[c] = block;
+}
+
+static void *pool_realloc(struct rosie_allocator *a, void *ptr, size_t osize, size_t nsize) {
+  void *block;
+  if (nsize == 0) {
+    pool_release(a, ptr, osize);
+    return NULL;
+  }
+  if (ptr && (osize <= POOL_MAX) && (nsize <= POOL_MAX) &&
+      (POOL_CLASS(osize) == POOL_CLASS(nsize)))
+    return ptr;
+  if ((!ptr || (osize > POOL_MAX)) && (nsize > POOL_MAX))
+    return realloc(ptr, nsize);
+  block = (nsize <= POOL_MAX) ? pool_get(a, nsize) : malloc(nsize);
+  if (!block) return NULL;
+  if (ptr) {
+    memcpy(block, ptr, (osize < nsize) ? osize : nsize);
+    pool_release(a, ptr, osize);
+  }
+  return block;
+}
+
+static void *rosie_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+  struct rosie_allocator *a = (struct rosie_allocator *) ud;
+  size_t old = ptr ? osize : 0;	/* when ptr is NULL, osize encodes a type */
+  void *block;
+  if (a->limit && (nsize > old) && ((a->in_use - old + nsize) > a->limit))
+    return NULL;
+  block = a->f ? a->f(a->ud, ptr, osize, nsize) : pool_realloc(a, ptr, old, nsize);
+  if (block || (nsize == 0)) a->in_use = a->in_use - old + nsize;
+  if (a->in_use > a->peak) a->peak = a->in_use;
+  return block;
+}
+
+/* Lua's default allocator, counting the bytes in use for the peak
+   heap size in the engine stats.
+ */
+static void *counting_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+  engine_state *s = (engine_state *) ud;
+  size_t old = ptr ? osize : 0;
+  void *block = NULL;
+  if (nsize == 0) {
+    free(ptr);
+  } else {
+    block = realloc(ptr, nsize);
+    if (!block) return NULL;
+  }
+  s->heap = s->heap - old + nsize;
+  if (s->heap > s->peak_heap) s->peak_heap = s->heap;
+  return block;
+}
+
+static struct rosie_allocator *new_allocator(lua_Alloc f, void *ud, size_t limit) {
+  struct rosie_allocator *a = calloc(1, sizeof(struct rosie_allocator));
+  if (!a) return NULL;
+  a->f = f;
+  a->ud = ud;
+  a->limit = limit;
+  return a;
+}
+
+static void free_allocator(struct rosie_allocator *a) {
+  pool_slab *next;
+  while (a->slabs) {
+    next = a->slabs->next;
+    free(a->slabs);
+    a->slabs = next;
+  }
+  free(a);
+}
+
+/* Same as the panic function installed by luaL_newstate() */
+static int panic(lua_State *L) {
+  fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+  return 0;
+}
+
+static lua_State *newstate(engine_state *s, struct rosie_allocator *a) {
+  lua_State *newL = a ? lua_newstate(rosie_alloc, a) : lua_newstate(counting_alloc, s);
+  if (newL == NULL) return NULL;
+  lua_atpanic(newL, panic);
   luaL_checkversion(newL); /* Ensures several critical things needed to use Lua */
   luaL_openlibs(newL);     /* Open lua's standard libraries */
   luaL_requiref(newL, "lpeg", luaopen_lpeg, 0);
@@ -329,13 +533,286 @@ static lua_State *newstate() {
 }
   
 
+/* Push a history entry {op, arg1, arg2} */
+static void push_history_entry(lua_State *L, const char *op, str *arg1, str *arg2) {
+  lua_createtable(L, 3, 0);
+  lua_pushstring(L, op);
+  lua_rawseti(L, -2, 1);
+  if (arg1 && arg1->ptr) {
+    lua_pushlstring(L, (const char *)arg1->ptr, arg1->len);
+    lua_rawseti(L, -2, 2);
+  }
+  if (arg2 && arg2->ptr) {
+    lua_pushlstring(L, (const char *)arg2->ptr, arg2->len);
+    lua_rawseti(L, -2, 3);
+  }
+}
+
+/* The history holds at most MAX_HISTORY entries, so that an engine
+ * that loads and imports for as long as it runs (e.g. a repl) does
+ * not grow it without bound.
+ */
+#define MAX_HISTORY 4096
+
+/* TRUE when the last of the n entries of the history at the top of
+ * the stack is the same import or libpath call as {op, arg1, arg2},
+ * which does nothing when made again.
+ */
+static int repeats_last_entry(lua_State *L, lua_Integer n, const char *op, str *arg1, str *arg2) {
+  int i, same = TRUE;
+  if ((n == 0) || (strcmp(op, "import") && strcmp(op, "libpath"))) return FALSE;
+  lua_rawgeti(L, -1, n);
+  push_history_entry(L, op, arg1, arg2);
+  for (i = 1; same && (i <= 3); i++) {
+    lua_rawgeti(L, -2, i);
+    lua_rawgeti(L, -2, i);
+    same = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+  }
+  lua_pop(L, 2);
+  return same;
+}
+
+/* Record a successful call that changed the engine environment, so
+ * that rosie_clone() can replay it.  Stack is unchanged after call.
+ */
+static void record_history(lua_State *L, const char *op, str *arg1, str *arg2) {
+  lua_Integer n;
+  get_registry(history_key);
+  n = lua_rawlen(L, -1);
+  if (n >= MAX_HISTORY) {
+    /* Stop recording: rosie_clone() will refuse to clone the engine */
+    lua_pushboolean(L, TRUE);
+    lua_setfield(L, -2, "overflow");
+  } else if (!repeats_last_entry(L, n, op, arg1, arg2)) {
+    push_history_entry(L, op, arg1, arg2);
+    lua_rawseti(L, -2, n + 1);
+  }
+  lua_pop(L, 1);
+}
+
+/* Record the current value of an engine setting, replacing the value
+ * recorded before, so that setting it often does not grow the
+ * history.  A setting that has one value per name, such as a
+ * dictionary, is given the name; otherwise name is NULL.
+ * rosie_clone() gives the clone the current value of each setting.
+ * Stack is unchanged after call.
+ */
+static void record_setting(lua_State *L, const char *op, str *name, str *arg1, str *arg2) {
+  get_registry(settings_key);
+  lua_pushstring(L, op);
+  if (name) {
+    lua_pushstring(L, ":");
+    lua_pushlstring(L, (const char *)name->ptr, name->len);
+    lua_concat(L, 3);
+  }
+  push_history_entry(L, op, arg1, arg2);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+}
+
+/* ----------------------------------------------------------------------------------------
+ * Buffered output
+ * ----------------------------------------------------------------------------------------
+ */
+
+typedef struct output_buffer {
+  char *ptr;
+  size_t len;
+  size_t size;
+} output_buffer;
+
+static int output_append(output_buffer *b, const char *data, size_t len) {
+  if (b->len + len > b->size) {
+    size_t newsize = b->size ? b->size : 4096;
+    while (newsize < b->len + len) newsize *= 2;
+    char *newptr = realloc(b->ptr, newsize);
+    if (!newptr) return FALSE;
+    b->ptr = newptr;
+    b->size = newsize;
+  }
+  memcpy(b->ptr + b->len, data, len);
+  b->len += len;
+  return TRUE;
+}
+
+static void output_free(output_buffer *b) {
+  if (b->ptr) free(b->ptr);
+  b->ptr = NULL;
+  b->len = b->size = 0;
+}
+
+/* A buffered writer wraps a Lua file handle.  Its write method
+ * appends strings and match results (rBuffer userdata) to a single
+ * growable buffer, which is written to the file in blocks of at least
+ * OUTPUT_FLUSH_SIZE bytes.  Without it, engine_process_file() makes
+ * two Lua calls and two stdio writes for every line of output.
+ *
+ * The file handle is kept as the uservalue of the writer, so that it
+ * is not collected first.  The writer is made available to Lua as
+ * engine_module.buffered_writer(filehandle).
+ */
+#define OUTPUT_FLUSH_SIZE (1024 * 1024)
+#define BUFFERED_WRITER "rosie_buffered_writer"
+
+typedef struct buffered_writer {
+  luaL_Stream *stream;
+  output_buffer buf;
+} buffered_writer;
+
+static int writer_flush(buffered_writer *w) {
+  size_t len = w->buf.len;
+  w->buf.len = 0;
+  if (!len || !w->stream->closef) return TRUE; /* nothing to write, or file closed */
+  return (fwrite(w->buf.ptr, 1, len, w->stream->f) == len);
+}
+
+static int buffered_writer_write(lua_State *L) {
+  int i, ok = TRUE;
+  size_t len;
+  const char *data;
+  rBuffer *rbuf;
+  buffered_writer *w = luaL_checkudata(L, 1, BUFFERED_WRITER);
+  int n = lua_gettop(L);
+  for (i = 2; ok && (i <= n); i++) {
+    if (lua_type(L, i) == LUA_TUSERDATA) {
+      rbuf = lua_touserdata(L, i);
+      ok = output_append(&(w->buf), rbuf->data, rbuf->n);
+    } else {
+      data = lua_tolstring(L, i, &len);
+      if (!data) return luaL_argerror(L, i, "string or match data expected");
+      ok = output_append(&(w->buf), data, len);
+    }
+  }
+  if (!ok) return luaL_error(L, "out of memory in buffered writer");
+  if ((w->buf.len >= OUTPUT_FLUSH_SIZE) && !writer_flush(w))
+    return luaL_error(L, "write failed: %s", strerror(errno));
+  lua_settop(L, 1);
+  return 1;
+}
+
+static int buffered_writer_flush(lua_State *L) {
+  buffered_writer *w = luaL_checkudata(L, 1, BUFFERED_WRITER);
+  if (!writer_flush(w)) return luaL_error(L, "write failed: %s", strerror(errno));
+  lua_settop(L, 1);
+  return 1;
+}
+
+/* Flush, then close the file handle, returning what its close method returns */
+static int buffered_writer_close(lua_State *L) {
+  buffered_writer *w = luaL_checkudata(L, 1, BUFFERED_WRITER);
+  int ok = writer_flush(w);
+  output_free(&(w->buf));
+  if (!ok) return luaL_error(L, "write failed: %s", strerror(errno));
+  lua_settop(L, 1);
+  lua_getuservalue(L, 1);
+  lua_getfield(L, 2, "close");
+  lua_insert(L, 2);
+  lua_call(L, 1, LUA_MULTRET);
+  return lua_gettop(L) - 1;
+}
+
+static int buffered_writer_gc(lua_State *L) {
+  buffered_writer *w = luaL_checkudata(L, 1, BUFFERED_WRITER);
+  writer_flush(w);
+  output_free(&(w->buf));
+  return 0;
+}
+
+static const luaL_Reg buffered_writer_methods[] = {
+  {"write", buffered_writer_write},
+  {"flush", buffered_writer_flush},
+  {"close", buffered_writer_close},
+  {"__gc", buffered_writer_gc},
+  {NULL, NULL}
+};
+
+static int new_buffered_writer(lua_State *L) {
+  luaL_Stream *stream = luaL_checkudata(L, 1, LUA_FILEHANDLE);
+  buffered_writer *w = lua_newuserdata(L, sizeof(buffered_writer));
+  memset(w, 0, sizeof(buffered_writer));
+  w->stream = stream;
+  if (luaL_newmetatable(L, BUFFERED_WRITER)) {
+    luaL_setfuncs(L, buffered_writer_methods, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+  }
+  lua_setmetatable(L, -2);
+  lua_pushvalue(L, 1);
+  lua_setuservalue(L, -2);
+  return 1;
+}
+
+/* Milliseconds on a monotonic clock, for match deadlines (replaces
+   the processor time clock in common.lua)
+ */
+static int monotonic_ms(lua_State *L) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  lua_pushnumber(L, (lua_Number) ts.tv_sec * 1000 + (lua_Number) ts.tv_nsec / 1000000);
+  return 1;
+}
+
+/* dictionary.walk(subject, i, trie, shortest) follows the packed
+   trie of a dictionary (see dictionary.lua) over the subject, from
+   byte i, and returns the position after the longest (or shortest)
+   entry that starts there, or false.  The subject is whatever lpeg
+   gives a match-time capture: a Lua string, an rbuf when matching
+   with a Lua encoder, or a str* when matching with a C encoder.  The
+   bytes are read in place.
+ */
+static inline uint32_t trie_u32(const unsigned char *p) {
+  return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static int dictionary_walk(lua_State *L) {
+  size_t len, trie_len;
+  const char *s;
+  const unsigned char *trie, *labels, *edge;
+  str *input;
+  rBuffer *rbuf;
+  size_t node = 0, n;
+  lua_Integer j, last = 0;
+  lua_Integer i = luaL_checkinteger(L, 2);
+  int shortest = lua_toboolean(L, 4);
+  switch (lua_type(L, 1)) {
+  case LUA_TLIGHTUSERDATA:
+    input = lua_touserdata(L, 1);
+    s = (const char *) input->ptr;
+    len = input->len;
+    break;
+  case LUA_TUSERDATA:
+    rbuf = lua_touserdata(L, 1);
+    s = rbuf->data;
+    len = rbuf->n;
+    break;
+  default:
+    s = luaL_checklstring(L, 1, &len);
+  }
+  trie = (const unsigned char *) luaL_checklstring(L, 3, &trie_len);
+  if (trie_len < 3) return luaL_argerror(L, 3, "not a packed dictionary trie");
+  for (j = (i < 1) ? 1 : i; j <= (lua_Integer) len; j++) {
+    n = (size_t) trie[node + 1] | ((size_t) trie[node + 2] << 8);
+    labels = trie + node + 3;
+    edge = memchr(labels, (unsigned char) s[j - 1], n);
+    if (!edge) break;
+    node = trie_u32(labels + n + 4 * (edge - labels));
+    if (trie[node]) {
+      last = j + 1;
+      if (shortest) break;
+    }
+  }
+  if (last) lua_pushinteger(L, last);
+  else lua_pushboolean(L, 0);
+  return 1;
+}
+
 /* ----------------------------------------------------------------------------------------
  * Exported functions
  * ----------------------------------------------------------------------------------------
  */
 
-EXPORT
-Engine *rosie_new(str *messages) {
+static Engine *new_engine(str *messages, struct rosie_allocator *a) {
 
   pthread_once(&initialized, initialize);
   if (all_is_lost) {
@@ -344,9 +821,11 @@ Engine *rosie_new(str *messages) {
   }
 
   int t;
-  Engine *e = malloc(sizeof(Engine));
-  lua_State *L = newstate();
+  engine_state *s = calloc(1, sizeof(engine_state));
+  lua_State *L = s ? newstate(s, a) : NULL;
+  Engine *e = (Engine *) s;
   if (L == NULL) {
+    free(s);
     *messages = rosie_new_string_from_const("not enough memory to initialize");
     return NULL;
   }
@@ -383,6 +862,50 @@ Engine *rosie_new(str *messages) {
   lua_createtable(L, INITIAL_RPLX_SLOTS, 0);
   set_registry(rplx_table_key);
 
+  /* The peg of each rplx object is stored at the same index in
+     another table, so that matching with a C encoder can retrieve the
+     peg directly. */
+  lua_createtable(L, INITIAL_RPLX_SLOTS, 0);
+  set_registry(rplx_peg_table_key);
+
+  lua_getglobal(L, "rosie");
+  t = lua_getfield(L, -1, "env");
+  CHECK_TYPE("rosie.env", t, LUA_TTABLE);
+  t = lua_getfield(L, -1, "engine_module");
+  CHECK_TYPE("rosie.env.engine_module", t, LUA_TTABLE);
+  t = lua_getfield(L, -1, "Cmatch");
+  CHECK_TYPE("rosie.env.engine_module.Cmatch", t, LUA_TFUNCTION);
+  set_registry(cmatch_key);
+  lua_pop(L, 1);
+  t = lua_getfield(L, -1, "pattern_set_program");
+  CHECK_TYPE("rosie.env.engine_module.pattern_set_program", t, LUA_TFUNCTION);
+  set_registry(pattern_set_program_key);
+  lua_pop(L, 1);
+  lua_pushcfunction(L, new_buffered_writer);
+  lua_setfield(L, -2, "buffered_writer");
+  lua_pop(L, 1);
+  t = lua_getfield(L, -1, "common");
+  CHECK_TYPE("rosie.env.common", t, LUA_TTABLE);
+  lua_pushcfunction(L, monotonic_ms);
+  lua_setfield(L, -2, "clock_ms");
+  lua_pop(L, 1);
+  t = lua_getfield(L, -1, "dictionary");
+  CHECK_TYPE("rosie.env.dictionary", t, LUA_TTABLE);
+  lua_pushcfunction(L, dictionary_walk);
+  lua_setfield(L, -2, "walk");
+
+  lua_newtable(L);
+  set_registry(pattern_set_table_key);
+
+  /* For rosie_clone(), the source of each rplx object and the history
+     of changes to the engine environment */
+  lua_createtable(L, INITIAL_RPLX_SLOTS, 0);
+  set_registry(rplx_source_table_key);
+  lua_newtable(L);
+  set_registry(history_key);
+  lua_newtable(L);
+  set_registry(settings_key);
+
   lua_getglobal(L, "rosie");
   t = lua_getfield(L, -1, "env");
   CHECK_TYPE("rosie.env", t, LUA_TTABLE);
@@ -406,11 +929,361 @@ Engine *rosie_new(str *messages) {
 
   pthread_mutex_init(&(e->lock), NULL);
   e->L = L;
+  s->allocator = a;
+  ENGINE_OF(L) = e;
 
   lua_settop(L, 0);
   LOGf("Engine %p created\n", e);
   return e;
 }
+
+EXPORT
+Engine *rosie_new(str *messages) {
+  return new_engine(messages, NULL);
+}
+
+/* Create an engine whose Lua state allocates memory through allocf
+ * (with ud), or through the built-in pool allocator when allocf is
+ * NULL.  When limit is not zero, the Lua state may not use more than
+ * limit bytes in total, and a call that needs more fails.
+ */
+EXPORT
+Engine *rosie_new_with_allocator(str *messages, lua_Alloc allocf, void *ud, size_t limit) {
+  Engine *e;
+  struct rosie_allocator *a = new_allocator(allocf, ud, limit);
+  if (!a) {
+    *messages = rosie_new_string_from_const("not enough memory to initialize");
+    return NULL;
+  }
+  e = new_engine(messages, a);
+  if (!e) free_allocator(a);
+  return e;
+}
+     
+/* Set s to the string at stack index i (which must be a string) */
+static void to_rosie_string(lua_State *L, int i, str *s) {
+  size_t len;
+  s->ptr = (byte_ptr) lua_tolstring(L, i, &len);
+  s->len = len;
+}
+
+/* Reserve the next free rplx index of e without storing a pattern there */
+static int reserve_rplx_index(Engine *e) {
+  int pat;
+  lua_State *L = e->L;
+  ACQUIRE_ENGINE_LOCK(e);
+  get_registry(rplx_table_key);
+  lua_pushboolean(L, FALSE);
+  pat = luaL_ref(L, -2);
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return pat;
+}
+
+/* Move the rplx object at index from to the reserved index to */
+static void move_rplx(Engine *e, int from, int to) {
+  int i;
+  lua_State *L = e->L;
+  ACQUIRE_ENGINE_LOCK(e);
+  get_registry(rplx_table_key);
+  get_registry(rplx_peg_table_key);
+  get_registry(rplx_source_table_key);
+  for (i = 1; i <= 3; i++) {
+    lua_rawgeti(L, i, from);
+    lua_rawseti(L, i, to);
+  }
+  lua_pushnil(L);
+  lua_rawseti(L, 2, from);
+  lua_pushnil(L);
+  lua_rawseti(L, 3, from);
+  luaL_unref(L, 1, from);
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+}
+
+/* One step of rebuilding an engine in rosie_clone(): a setting or
+   an entry of the history (see record_history), or the compilation
+   of the rplx object at index pat.  The strings are copies, each
+   followed by a NUL, and ptr is NULL when an argument is absent. */
+typedef struct clone_step {
+  int key;			/* order of the steps */
+  int pat;			/* rplx index to compile, or 0 */
+  char *op;
+  str arg1, arg2;
+} clone_step;
+
+static int compare_clone_step(const void *a, const void *b) {
+  const clone_step *x = a, *y = b;
+  if (x->key != y->key) return (x->key < y->key) ? -1 : 1;
+  return (x->pat < y->pat) ? -1 : (x->pat > y->pat);
+}
+
+/* Copy the string (if any) at index idx of L into *s */
+static int copy_clone_arg(lua_State *L, int idx, str *s) {
+  size_t len;
+  const char *src;
+  s->ptr = NULL;
+  s->len = 0;
+  if (!lua_isstring(L, idx)) return TRUE;
+  src = lua_tolstring(L, idx, &len);
+  s->ptr = malloc(len + 1);
+  if (!s->ptr) return FALSE;
+  memcpy((char *)s->ptr, src, len);
+  s->ptr[len] = '\0';
+  s->len = len;
+  return TRUE;
+}
+
+static void free_clone_steps(clone_step *steps, int n) {
+  int i;
+  if (!steps) return;
+  for (i = 0; i < n; i++) {
+    if (steps[i].op) free(steps[i].op);
+    rosie_free_string(steps[i].arg1);
+    rosie_free_string(steps[i].arg2);
+  }
+  free(steps);
+}
+
+/* Copy into *step the {op, arg1, arg2} table at the top of the stack,
+   which is popped */
+static int copy_clone_step(lua_State *L, clone_step *step) {
+  int ok;
+  str op;
+  lua_rawgeti(L, -1, 1);
+  lua_rawgeti(L, -2, 2);
+  lua_rawgeti(L, -3, 3);
+  ok = copy_clone_arg(L, -3, &op) && copy_clone_arg(L, -2, &(step->arg1)) &&
+    copy_clone_arg(L, -1, &(step->arg2));
+  step->op = (char *) op.ptr;
+  lua_pop(L, 4);
+  return ok && step->op;
+}
+
+/* The steps that rebuild the environment and the rplx objects of the
+   engine whose Lua state is L, in order: each setting, and then the
+   history, with each rplx object compiled after the history entries
+   that preceded it.  Called with the engine lock held.  Returns NULL
+   and sets messages on failure. */
+static clone_step *clone_steps(lua_State *L, int *nsteps, int *max_pat, str *messages) {
+  int i, n, nhistory, ok = TRUE;
+  clone_step *steps;
+  get_registry(rplx_source_table_key);	/* stack index 1 */
+  get_registry(history_key);		/* stack index 2 */
+  get_registry(settings_key);		/* stack index 3 */
+  if (lua_getfield(L, 2, "overflow") != LUA_TNIL) {
+    lua_settop(L, 0);
+    *messages = rosie_new_string_from_const("engine history too long to clone; make a new engine instead");
+    return NULL;
+  }
+  lua_pop(L, 1);
+  nhistory = lua_rawlen(L, 2);
+  n = nhistory;
+  for (i = 1; i <= 3; i += 2) {
+    lua_pushnil(L);
+    while (lua_next(L, i)) { n++; lua_pop(L, 1); }
+  }
+  steps = calloc(n + 1, sizeof(clone_step));
+  if (!steps) {
+    lua_settop(L, 0);
+    *messages = rosie_new_string_from_const("not enough memory to clone engine");
+    return NULL;
+  }
+  n = 0;
+  *max_pat = 0;
+  /* The current value of each setting applies to all that is replayed */
+  lua_pushnil(L);
+  while (ok && lua_next(L, 3)) {
+    steps[n].key = -1;
+    ok = copy_clone_step(L, &steps[n++]);
+  }
+  for (i = 1; ok && (i <= nhistory); i++) {
+    lua_rawgeti(L, 2, i);
+    steps[n].key = 2 * i;
+    ok = copy_clone_step(L, &steps[n++]);
+  }
+  /* Each rplx source is {expression, keep or nil, at=length of history} */
+  lua_pushnil(L);
+  while (ok && lua_next(L, 1)) {
+    steps[n].pat = lua_tointeger(L, -2);
+    if (steps[n].pat > *max_pat) *max_pat = steps[n].pat;
+    lua_getfield(L, -1, "at");
+    steps[n].key = 2 * lua_tointeger(L, -1) + 1;
+    lua_pop(L, 1);
+    lua_rawgeti(L, -1, 1);
+    lua_rawgeti(L, -2, 2);
+    ok = copy_clone_arg(L, -2, &(steps[n].arg1)) && copy_clone_arg(L, -1, &(steps[n].arg2));
+    n++;
+    lua_pop(L, 3);
+  }
+  lua_settop(L, 0);
+  if (!ok) {
+    free_clone_steps(steps, n);
+    *messages = rosie_new_string_from_const("not enough memory to clone engine");
+    return NULL;
+  }
+  qsort(steps, n, sizeof(clone_step), compare_clone_step);
+  *nsteps = n;
+  return steps;
+}
+
+/* Compile the expression of step into clone, at the reserved index
+   step->pat */
+static int compile_rplx_into(Engine *clone, clone_step *step, str *messages) {
+  int t, newpat = 0;
+  str msgs = {0, NULL};
+  if (step->arg2.ptr) {
+    /* A projection, stored as {expression, keep} */
+    t = rosie_compile_projected(clone, &(step->arg1), &(step->arg2), &newpat, &msgs);
+  } else {
+    t = rosie_compile(clone, &(step->arg1), &newpat, &msgs);
+  }
+  if ((t != SUCCESS) || !newpat) {
+    LOGf("rosie_clone() failed to compile rplx %d\n", step->pat);
+    if (msgs.ptr) *messages = msgs;
+    else *messages = rosie_new_string_from_const("rosie_clone() failed to compile a pattern");
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  rosie_free_string(msgs);
+  move_rplx(clone, newpat, step->pat);
+  return SUCCESS;
+}
+
+static int replay_history(Engine *clone, const char *op, str *arg1, str *arg2, str *messages) {
+  int t, ok = FALSE, file_exists;
+  str pkgname = {0, NULL};
+  str msgs = {0, NULL};
+  str no_filename = {0, NULL};
+  LOGf("rosie_clone() replaying %s\n", op);
+  if (!strcmp(op, "load")) {
+    t = rosie_load(clone, &ok, arg1, &pkgname, &msgs);
+  } else if (!strcmp(op, "loadfile")) {
+    t = rosie_loadfile(clone, &ok, arg1, &pkgname, &msgs);
+  } else if (!strcmp(op, "import")) {
+    t = rosie_import(clone, &ok, arg1, arg2, &pkgname, &msgs);
+  } else if (!strcmp(op, "libpath")) {
+    t = rosie_libpath(clone, arg1);
+    ok = TRUE;
+  } else if (!strcmp(op, "memoize")) {
+    t = rosie_set_memoize(clone, arg1 && (arg1->len == 1) && (arg1->ptr[0] == '1'));
+    ok = TRUE;
+  } else if (!strcmp(op, "lazy")) {
+    t = rosie_set_lazy_import(clone, arg1 && (arg1->len == 1) && (arg1->ptr[0] == '1'));
+    ok = TRUE;
+  } else if (!strcmp(op, "limits")) {
+    t = rosie_match_limits(clone,
+			   (arg1 && arg1->ptr) ? atoi((const char *)arg1->ptr) : 0,
+			   (arg2 && arg2->ptr) ? atoi((const char *)arg2->ptr) : 0);
+    ok = TRUE;
+  } else if (!strcmp(op, "cachedir")) {
+    t = rosie_set_cachedir(clone, arg1);
+    ok = TRUE;
+  } else if (!strcmp(op, "dictionary")) {
+    t = rosie_set_dictionary(clone, &ok, arg1, arg2, &msgs);
+  } else if (!strcmp(op, "rcfile")) {
+    t = rosie_execute_rcfile(clone, arg1 ? arg1 : &no_filename, &file_exists, &ok, &msgs);
+  } else {
+    LOGf("unknown operation in engine history: %s\n", op);
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  rosie_free_string(pkgname);
+  if ((t == SUCCESS) && ok) {
+    rosie_free_string(msgs);
+    return SUCCESS;
+  }
+  if (msgs.ptr) *messages = msgs;
+  else *messages = rosie_new_string_from_const("rosie_clone() could not replay the engine history");
+  return ERR_ENGINE_CALL_FAILED;
+}
+
+/* Return a new engine with the same environment as e, and in which
+ * each rplx index that is valid in e refers to the same expression,
+ * compiled in the new engine.
+ *
+ * A clone is not a copy of e.  A Lua state cannot be copied, so the
+ * clone is a new engine, booted as rosie_new() boots one, in which
+ * the calls that built the environment of e (load, loadfile, import,
+ * setting the libpath, and executing an rcfile) are made again, after
+ * it is given the current value of each setting and the current
+ * entries of each dictionary (see record_setting).  Each rplx object
+ * is compiled at the point in that history where it was compiled in
+ * e, so a pattern compiled before a package was loaded again refers
+ * to the same definitions as in e.  The rpl is parsed and compiled
+ * again, and files are read again, so a file that has changed since
+ * e loaded it will be loaded as it is now.
+ *
+ * Making a clone therefore costs as much as making a new engine and
+ * repeating those calls, and does not reduce startup time.  What it
+ * saves is the bookkeeping: the clone has the same patterns at the
+ * same indices.  The lock of e is held only while the history is
+ * copied, not while the clone is built.  The history is bounded (see
+ * MAX_HISTORY), and an engine with a longer one cannot be cloned.
+ *
+ * N.B. Client must free messages
+ */
+EXPORT
+Engine *rosie_clone(Engine *e, str *messages) {
+  int t, i, nsteps = 0, limit, max_pat = 0;
+  char *live = NULL;
+  clone_step *steps;
+  GCPolicy gc;
+  Engine *clone = NULL;
+  struct rosie_allocator *a = STATE(e)->allocator;
+  lua_State *L = e->L;
+
+  ACQUIRE_ENGINE_LOCK(e);
+  steps = clone_steps(L, &nsteps, &max_pat, messages);
+  get_registry(alloc_set_limit_key);
+  limit = lua_tointeger(L, -1);
+  gc = STATE(e)->gc;
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  if (!steps) return NULL;
+
+  clone = a ? rosie_new_with_allocator(messages, a->f, a->ud, a->limit) : rosie_new(messages);
+  if (!clone) goto done;
+  live = calloc(max_pat + 1, 1);
+  if (!live) {
+    *messages = rosie_new_string_from_const("not enough memory to clone engine");
+    goto clone_failed;
+  }
+  /* Reserve the indices up to the largest one in use in e, so that
+     each rplx object can be compiled into its own index */
+  for (i = 1; i <= max_pat; i++) {
+    if (reserve_rplx_index(clone) != i) {
+      LOGf("rosie_clone() failed to reserve rplx index %d\n", i);
+      *messages = rosie_new_string_from_const("rosie_clone() failed to reserve a pattern index");
+      goto clone_failed;
+    }
+  }
+  for (i = 0; i < nsteps; i++) {
+    if (steps[i].pat) {
+      t = compile_rplx_into(clone, &steps[i], messages);
+      live[steps[i].pat] = TRUE;
+    } else {
+      t = replay_history(clone, steps[i].op,
+			 steps[i].arg1.ptr ? &(steps[i].arg1) : NULL,
+			 steps[i].arg2.ptr ? &(steps[i].arg2) : NULL,
+			 messages);
+    }
+    if (t != SUCCESS) goto clone_failed;
+  }
+  for (i = 1; i <= max_pat; i++)
+    if (!live[i]) rosie_free_rplx(clone, i);
+
+  if (limit) rosie_alloc_limit(clone, &limit, NULL);
+  if (gc.mode || gc.param1 || gc.param2) rosie_gc_mode(clone, gc.mode, gc.param1, gc.param2);
+  LOGf("Engine %p cloned from engine %p\n", clone, e);
+  goto done;
+
+ clone_failed:
+  rosie_finalize(clone);
+  clone = NULL;
+ done:
+  free(live);
+  free_clone_steps(steps, nsteps);
+  return clone;
+}
      
 /* newlimit of -1 means query for current limit */
 EXPORT
@@ -452,6 +1325,84 @@ int rosie_alloc_limit (Engine *e, int *newlimit, int *usage) {
   return SUCCESS;
 }
 
+/* Do a bounded amount of garbage collection work, e.g. while the
+ * client is idle or between batches of matches, so that less of it
+ * happens during a match.  A budget of zero does one basic step;
+ * otherwise the budget is the amount of work to do, measured (as
+ * Lua's LUA_GCSTEP does) in KB of allocation.  *finished (if not
+ * NULL) is set to TRUE when the step completed a collection cycle.
+ * Stepping works in every mode, including ROSIE_GC_MANUAL.
+ */
+EXPORT
+int rosie_gc_step(Engine *e, int budget, int *finished) {
+  int done;
+  uint64_t t0;
+  lua_State *L = e->L;
+  if (budget < 0) return ERR_ENGINE_CALL_FAILED;
+  ACQUIRE_ENGINE_LOCK(e);
+  t0 = now_us();
+  done = lua_gc(L, LUA_GCSTEP, budget);
+  STATE(e)->stats.gc_steps++;
+  STATE(e)->stats.gc_step_us += now_us() - t0;
+  RELEASE_ENGINE_LOCK(e);
+  if (finished) *finished = done;
+  return SUCCESS;
+}
+
+/* Set the collector mode of the engine, and its parameters:
+ *
+ *   ROSIE_GC_INCREMENTAL: param1 is the pause, and param2 the step
+ *     multiplier, both in percent (Lua's defaults are 200 and 200).
+ *   ROSIE_GC_GENERATIONAL: param1 is the minor multiplier, and
+ *     param2 the major multiplier.  Fails unless built with Lua 5.4.
+ *   ROSIE_GC_MANUAL: the collector runs only in rosie_gc_step(), and
+ *     when the heap passes the alloc limit (see rosie_alloc_limit()).
+ *
+ * A parameter of zero leaves that setting unchanged.  A clone of the
+ * engine gets the same mode and parameters.
+ */
+EXPORT
+int rosie_gc_mode(Engine *e, int mode, int param1, int param2) {
+  lua_State *L = e->L;
+  GCPolicy *gc = &(STATE(e)->gc);
+  if ((param1 < 0) || (param2 < 0)) return ERR_ENGINE_CALL_FAILED;
+  ACQUIRE_ENGINE_LOCK(e);
+  switch (mode) {
+  case ROSIE_GC_INCREMENTAL:
+#if defined(LUA_GCINC)
+    lua_gc(L, LUA_GCINC, param1, param2, 0);
+#else
+    if (param1) lua_gc(L, LUA_GCSETPAUSE, param1);
+    if (param2) lua_gc(L, LUA_GCSETSTEPMUL, param2);
+#endif
+    lua_gc(L, LUA_GCRESTART, 0);
+    break;
+  case ROSIE_GC_GENERATIONAL:
+#if defined(LUA_GCGEN)
+    lua_gc(L, LUA_GCGEN, param1, param2);
+    lua_gc(L, LUA_GCRESTART, 0);
+    break;
+#else
+    LOG("rosie_gc_mode(): generational mode requires Lua 5.4\n");
+    RELEASE_ENGINE_LOCK(e);
+    return ERR_ENGINE_CALL_FAILED;
+#endif
+  case ROSIE_GC_MANUAL:
+    lua_gc(L, LUA_GCSTOP, 0);
+    break;
+  default:
+    LOGf("rosie_gc_mode() called with invalid mode %d\n", mode);
+    RELEASE_ENGINE_LOCK(e);
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  if (mode != gc->mode) gc->param1 = gc->param2 = 0;
+  gc->mode = mode;
+  if (param1) gc->param1 = param1;
+  if (param2) gc->param2 = param2;
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+}
+
 /* N.B. Client must free retval */
 EXPORT
 int rosie_config(Engine *e, str *retval) {
@@ -524,6 +1475,7 @@ int rosie_libpath(Engine *e, str *newpath) {
     lua_pop(L, 3);
   } while (0);
 #endif
+  if (newpath->ptr) record_history(L, "libpath", newpath, NULL);
   if (!newpath->ptr) {
     size_t tmplen;
     const char *tmpptr = lua_tolstring(L, -2, &tmplen);
@@ -536,29 +1488,257 @@ int rosie_libpath(Engine *e, str *newpath) {
   return SUCCESS;
 }
 
-/* GC in languages like Python 3 may collect the engine before the
-   rplx objects, so if we cannot obtain the engine lock due to an
-   error (as opposed to the lock being held), then we assume the
-   engine has been collected and there is nothing that free_rplx needs
-   to do.
+/* When flag is non-zero, grammars compiled (or loaded, or imported)
+   afterwards remember the positions at which their rules failed, so
+   that a grammar that backtracks does not match the same rule at the
+   same position more than once.  Where a rule succeeded is remembered
+   only for rules that make no captures, so a rule that captures is
+   matched again each time it is tried where it succeeded before.
+   Patterns compiled earlier are not affected.
  */
 EXPORT
-int rosie_free_rplx (Engine *e, int pat) {
+int rosie_set_memoize(Engine *e, int flag) {
+  int t;
+  str arg = rosie_string_from((byte_ptr) (flag ? "1" : "0"), 1);
   lua_State *L = e->L;
-  LOGf("freeing rplx object with index %d\n", pat);
-  int r = pthread_mutex_lock(&((e)->lock));
-  if (!r) {
-    get_registry(rplx_table_key);
-    luaL_unref(L, -1, pat);
-    lua_settop(L, 0);
-    RELEASE_ENGINE_LOCK(e);
-  }
+  ACQUIRE_ENGINE_LOCK(e);
+  get_registry(engine_key);
+  t = lua_getfield(L, -1, "set_memoize");
+  CHECK_TYPE("engine.set_memoize()", t, LUA_TFUNCTION);
+  lua_pushvalue(L, -2);
+  lua_pushboolean(L, flag);
+  t = lua_pcall(L, 2, 0, 0);
+  if (t != LUA_OK) {
+    LOG("engine.set_memoize() failed\n");
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  record_setting(L, "memoize", NULL, &arg, NULL);
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
   return SUCCESS;
 }
 
-/* N.B. Client must free messages */
+/* When flag is non-zero, the bindings of packages imported (directly
+   or as dependencies) afterwards are parsed and expanded, but each is
+   compiled only when a pattern that refers to it is compiled.  This
+   saves time and memory when few of the bindings of a large library
+   are used.  Errors in a binding that has not been referenced are not
+   reported.
+ */
 EXPORT
-int rosie_compile(Engine *e, str *expression, int *pat, str *messages) {
+int rosie_set_lazy_import(Engine *e, int flag) {
+  int t;
+  str arg = rosie_string_from((byte_ptr) (flag ? "1" : "0"), 1);
+  lua_State *L = e->L;
+  ACQUIRE_ENGINE_LOCK(e);
+  get_registry(engine_key);
+  t = lua_getfield(L, -1, "set_lazy_import");
+  CHECK_TYPE("engine.set_lazy_import()", t, LUA_TFUNCTION);
+  lua_pushvalue(L, -2);
+  lua_pushboolean(L, flag);
+  t = lua_pcall(L, 2, 0, 0);
+  if (t != LUA_OK) {
+    LOG("engine.set_lazy_import() failed\n");
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  record_setting(L, "lazy", NULL, &arg, NULL);
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+}
+
+/* Cache the parse trees of rpl in the directory dir, or stop caching
+   when dir is NULL or empty (see parsecache.lua).  Only parsing is
+   saved: the rpl is still expanded and compiled each time it is
+   loaded, and reading a cached tree runs a Lua chunk.  The directory
+   is not created.
+ */
+EXPORT
+int rosie_set_cachedir(Engine *e, str *dir) {
+  int t;
+  lua_State *L = e->L;
+  ACQUIRE_ENGINE_LOCK(e);
+  get_registry(rosie_key);
+  t = lua_getfield(L, -1, "set_cachedir");
+  CHECK_TYPE("rosie.set_cachedir()", t, LUA_TFUNCTION);
+  if (dir && dir->ptr && dir->len)
+    lua_pushlstring(L, (const char *)dir->ptr, dir->len);
+  else
+    lua_pushboolean(L, FALSE);
+  t = lua_pcall(L, 1, 0, 0);
+  if (t != LUA_OK) {
+    LOG("rosie.set_cachedir() failed\n");
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  record_setting(L, "cachedir", NULL, (dir && dir->len) ? dir : NULL, NULL);
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+}
+
+/* Limit each match to steps steps (grammar rule entries and search
+   loop iterations) and ms milliseconds of wall clock time, where zero
+   means no limit.  A match that reaches a limit returns with abend
+   set.  Whether a pattern is limited is fixed when it is compiled:
+   only patterns compiled or loaded while the engine has a limit are
+   limited.  The values are read at the start of each match.
+ */
+EXPORT
+int rosie_match_limits(Engine *e, int steps, int ms) {
+  int t;
+  char buf1[16], buf2[16];
+  str arg1, arg2;
+  lua_State *L = e->L;
+  ACQUIRE_ENGINE_LOCK(e);
+  get_registry(engine_key);
+  t = lua_getfield(L, -1, "set_match_limits");
+  CHECK_TYPE("engine.set_match_limits()", t, LUA_TFUNCTION);
+  lua_pushvalue(L, -2);
+  lua_pushinteger(L, steps);
+  lua_pushinteger(L, ms);
+  t = lua_pcall(L, 3, 0, 0);
+  if (t != LUA_OK) {
+    LOG("engine.set_match_limits() failed\n");
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  arg1 = rosie_string_from((byte_ptr) buf1, snprintf(buf1, sizeof(buf1), "%d", steps));
+  arg2 = rosie_string_from((byte_ptr) buf2, snprintf(buf2, sizeof(buf2), "%d", ms));
+  record_setting(L, "limits", NULL, &arg1, &arg2);
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+}
+
+/* Turn profiling on (flag 1), on with timing (flag 2), or off (flag
+   0), resetting the counters.  While profiling is on, the patterns
+   compiled (or loaded, or imported) count, for each reference to a
+   named pattern, its matches and failures.  With timing, they also
+   count the bytes it consumed and the time spent in it, at a further
+   cost in speed (see compile.lua).
+ */
+EXPORT
+int rosie_profile(Engine *e, int flag) {
+  int t;
+  lua_State *L = e->L;
+  ACQUIRE_ENGINE_LOCK(e);
+  get_registry(engine_key);
+  t = lua_getfield(L, -1, "set_profile");
+  CHECK_TYPE("engine.set_profile()", t, LUA_TFUNCTION);
+  lua_pushvalue(L, -2);
+  lua_pushboolean(L, flag != 0);
+  lua_pushboolean(L, flag == 2);
+  t = lua_pcall(L, 3, 0, 0);
+  if (t != LUA_OK) {
+    LOG("engine.set_profile() failed\n");
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+}
+
+/* Set *report to a JSON list of the profiling counters of each named
+   pattern that has been attempted, most expensive first.  Each item
+   has the fields name, attempts, matches, failures, bytes, and time
+   (in milliseconds; bytes and time are zero unless timing is on).
+   Client must free report.
+ */
+EXPORT
+int rosie_profile_report(Engine *e, str *report) {
+  int t;
+  str r;
+  lua_State *L = e->L;
+  ACQUIRE_ENGINE_LOCK(e);
+  get_registry(engine_key);
+  t = lua_getfield(L, -1, "profile_report");
+  CHECK_TYPE("engine.profile_report()", t, LUA_TFUNCTION);
+  lua_pushvalue(L, -2);
+  t = lua_pcall(L, 1, 1, 0);
+  if (t != LUA_OK) {
+    LOG("engine.profile_report() failed\n");
+    *report = rosie_new_string_from_const("engine.profile_report() failed");
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  t = to_json_string(L, -1, &r);
+  if (t != LUA_OK) {
+    LOGf("in profile_report(), could not convert the report to json (code=%d)\n", t);
+    *report = rosie_new_string_from_const("in profile_report(), could not convert the report to json");
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  report->len = r.len;
+  report->ptr = r.ptr;
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+}
+
+/* Copy the engine's cumulative counters into *stats.  The counters
+   cover every input matched by the engine since it was created
+   (except by rosie_trace), the collections forced by the allocation
+   limit, and the calls that had to wait for the engine lock.  The
+   heap size is the current size of the Lua heap, and the peak is the
+   largest size it has had, as counted by the engine's allocator.
+ */
+EXPORT
+int rosie_stats(Engine *e, EngineStats *stats) {
+  lua_State *L = e->L;
+  engine_state *s = STATE(e);
+  ACQUIRE_ENGINE_LOCK(e);
+  *stats = s->stats;
+  stats->heap_kb = lua_gc(L, LUA_GCCOUNT, 0);
+  stats->peak_heap_kb = (s->allocator ? s->allocator->peak : s->peak_heap) / 1024;
+  if (stats->heap_kb > stats->peak_heap_kb) stats->peak_heap_kb = stats->heap_kb;
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+}
+
+/* GC in languages like Python 3 may collect the engine before the
+   rplx objects, so if we cannot obtain the engine lock due to an
+   error (as opposed to the lock being held), then we assume the
+   engine has been collected and there is nothing that free_rplx needs
+   to do.
+ */
+EXPORT
+int rosie_free_rplx (Engine *e, int pat) {
+  lua_State *L = e->L;
+  LOGf("freeing rplx object with index %d\n", pat);
+  int r = pthread_mutex_lock(&((e)->lock));
+  if (!r) {
+    get_registry(rplx_table_key);
+    luaL_unref(L, -1, pat);
+    get_registry(rplx_peg_table_key);
+    lua_pushnil(L);
+    lua_rawseti(L, -2, pat);
+    get_registry(rplx_source_table_key);
+    lua_pushnil(L);
+    lua_rawseti(L, -2, pat);
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+  }
+  return SUCCESS;
+}
+
+/* Compile expression by calling the engine method named fname
+ * ("compile" or "compile_cached"), and store the rplx at a new index.
+ * When keep is not NULL, it is passed to the method as the list of
+ * captures to keep.
+ */
+static int compile_with(Engine *e, const char *fname, str *expression, str *keep,
+			int *pat, str *messages) {
   int t;
   str temp_rs;
   lua_State *L = e->L;
@@ -584,15 +1764,16 @@ int rosie_compile(Engine *e, str *expression, int *pat, str *messages) {
 
   get_registry(rplx_table_key);
   get_registry(engine_key);
-  t = lua_getfield(L, -1, "compile");
-  CHECK_TYPE("compile", t, LUA_TFUNCTION);
+  t = lua_getfield(L, -1, fname);
+  CHECK_TYPE(fname, t, LUA_TFUNCTION);
 
   lua_replace(L, -2); /* overwrite engine table with compile function */
   get_registry(engine_key);
 
   lua_pushlstring(L, (const char *)expression->ptr, expression->len);
+  if (keep) lua_pushlstring(L, (const char *)keep->ptr, keep->len);
 
-  t = lua_pcall(L, 2, 2, 0);
+  t = lua_pcall(L, keep ? 3 : 2, 2, 0);
 
   if (t != LUA_OK) {
     LOG("compile() failed\n");
@@ -630,6 +1811,29 @@ int rosie_compile(Engine *e, str *expression, int *pat, str *messages) {
   }
   LOGf("storing rplx object at index %d\n", *pat);
 
+  get_registry(rplx_peg_table_key);
+  t = lua_getfield(L, 2, "pattern");
+  CHECK_TYPE("rplx pattern slot", t, LUA_TTABLE);
+  t = lua_getfield(L, -1, "peg");
+  CHECK_TYPE("rplx pattern peg slot", t, LUA_TUSERDATA);
+  lua_rawseti(L, -3, *pat);
+  lua_pop(L, 2);
+  /* For rosie_clone(): {expression, keep or nil, at=length of history} */
+  get_registry(rplx_source_table_key);
+  lua_createtable(L, 2, 1);
+  lua_pushlstring(L, (const char *)expression->ptr, expression->len);
+  lua_rawseti(L, -2, 1);
+  if (keep) {
+    lua_pushlstring(L, (const char *)keep->ptr, keep->len);
+    lua_rawseti(L, -2, 2);
+  }
+  get_registry(history_key);
+  lua_pushinteger(L, lua_rawlen(L, -1));
+  lua_setfield(L, -3, "at");
+  lua_pop(L, 1);
+  lua_rawseti(L, -2, *pat);
+  lua_pop(L, 1);
+
   t = violations_to_json_string(L, &temp_rs);
   if (t != LUA_OK) {
     LOG("in compile(), could not convert warning information to json\n");
@@ -646,16 +1850,55 @@ int rosie_compile(Engine *e, str *expression, int *pat, str *messages) {
   return SUCCESS;
 }
 
+/* N.B. Client must free messages */
+EXPORT
+int rosie_compile(Engine *e, str *expression, int *pat, str *messages) {
+  return compile_with(e, "compile", expression, NULL, pat, messages);
+}
+
+/* Like rosie_compile, but an expression that was compiled before (and
+ * not since a load, import, or change of the compiler options) is
+ * fetched from the engine's cache of compiled expressions instead of
+ * compiled again.  Each call still returns a new pat, which the
+ * client frees with rosie_free_rplx as usual.  N.B. Client must free
+ * messages.
+ */
+EXPORT
+int rosie_compile_cached(Engine *e, str *expression, int *pat, str *messages) {
+  return compile_with(e, "compile_cached", expression, NULL, pat, messages);
+}
+
+/* Like rosie_compile, but the matches of the compiled pattern hold
+ * only the captures named in keep (names separated by whitespace or
+ * commas), inside a single top-level capture named "*".  The other
+ * captures are never made, so they cost nothing to match or to
+ * encode.  N.B. Client must free messages.
+ */
+EXPORT
+int rosie_compile_projected(Engine *e, str *expression, str *keep, int *pat, str *messages) {
+  if (!keep) {
+    LOG("null pointer passed to compile_projected for keep argument\n");
+    if (pat) *pat = 0;
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  return compile_with(e, "compile", expression, keep, pat, messages);
+}
+
 static inline void collect_if_needed(lua_State *L) {
   int limit, memusg;
+  uint64_t t0;
+  EngineStats *stats = &(STATE(ENGINE_OF(L))->stats);
+  memusg = lua_gc(L, LUA_GCCOUNT, 0);
   get_registry(alloc_actual_limit_key);
   limit = lua_tointeger(L, -1);	/* nil will convert to zero */
   lua_pop(L, 1);
   if (limit) {
-    memusg = lua_gc(L, LUA_GCCOUNT, 0);
     if (memusg > limit) {
       LOGf("invoking collection of %0.1f MB heap\n", memusg/1024.0);
+      t0 = now_us();
       lua_gc(L, LUA_GCCOLLECT, 0);
+      stats->gc_forced++;
+      stats->gc_us += now_us() - t0;
 #if (LOGGING)
       memusg = lua_gc(L, LUA_GCCOUNT, 0);
       LOGf("post-collection heap has %0.1f MB\n", memusg/1024.0);
@@ -669,84 +1912,72 @@ static inline void collect_if_needed(lua_State *L) {
     (*(match)).data.len = (errno);    \
   } while (0);
 
-EXPORT
-int rosie_match(Engine *e, int pat, int start, char *encoder_name, str *input, match *match) {
-  int t, encoder, result_type, match_code;
-  size_t temp_len;
-  unsigned char *temp_str;
-  rBuffer *buf;
-  lua_State *L = e->L;
-  LOG("rosie_match called\n");
-  ACQUIRE_ENGINE_LOCK(e);
-  collect_if_needed(L);
-  if (!pat)
-    LOGf("rosie_match() called with invalid compiled pattern reference: %d\n", pat);
-  else {
+/* Push the match function and its first argument for the compiled
+ * pattern pat, leaving the function on top.  Returns FALSE if pat
+ * does not refer to a compiled pattern.
+ *
+ * The encoder values that do not require Lua processing have
+ * non-zero codes, and take a different code path from the ones that
+ * do.  When no Lua processing is needed, we can (1) use a
+ * lightuserdata to hold a ptr to the rosie_string holding the
+ * input, and (2) call into a refactored rmatch that expects this.
+ * Only the peg is needed, and rosie_compile() stored it in its own
+ * table for this purpose.
+ *
+ * Otherwise, we call the lua function Cmatch(), which is the same
+ * for every rplx object, and so it is cached in the registry.
+ */
+static int push_matcher(lua_State *L, int pat, int encoder) {
+  int t;
+  if (!encoder) {
+    /* Path through Lua */
     get_registry(rplx_table_key);
     t = lua_rawgeti(L, -1, pat);
-    if (t == LUA_TTABLE) goto have_pattern;
+    lua_remove(L, -2);
+    if (t != LUA_TTABLE) return FALSE;
+    get_registry(cmatch_key);
   }
-  set_match_error(match, ERR_NO_PATTERN);
-  lua_settop(L, 0);
-  RELEASE_ENGINE_LOCK(e);
-  return SUCCESS;
-
-have_pattern:
-
-  /* The encoder values that do not require Lua processing have
-   * non-zero codes, and take a different code path from the ones that
-   * do.  When no Lua processing is needed, we can (1) use a
-   * lightuserdata to hold a ptr to the rosie_string holding the
-   * input, and (2) call into a refactored rmatch that expects this.
-   *
-   * Otherwise, we call the lua function rplx.Cmatch().
-   */
+  else {
+    /* Path through C */
+    get_registry(rplx_peg_table_key);
+    t = lua_rawgeti(L, -1, pat);
+    lua_remove(L, -2);
+    if (t != LUA_TUSERDATA) return FALSE;
+    lua_pushcfunction(L, r_match_C);
+  }
+  return TRUE;
+}
 
-  encoder = encoder_name_to_code(encoder_name);
-  LOGf("in rosie_match, encoder value is %d\n", encoder);
+/* Push input in the form the match function for encoder takes */
+static void push_subject(lua_State *L, int encoder, str *input) {
   if (!encoder) {
-    /* Path through Lua */
-    t = lua_getfield(L, -1, "Cmatch");
-    CHECK_TYPE("rplx.Cmatch()", t, LUA_TFUNCTION);
-    /* FUTURE: Cache Cmatch, because it is constant across all rplx
-     * objects created by this engine.  Should move it out of rplx
-     * object and into engine module, then create a registry key for
-     * it, which we can retrieve here.
-     */
-    lua_replace(L, 1);
-    lua_settop(L, 2);
     /* Don't make a copy of the input.  Wrap it in an rbuf, which will
        be gc'd later (but will not free the original source data). */
     r_newbuffer_wrap(L, (char *)input->ptr, input->len); 
-    lua_pushinteger(L, start);
-    lua_pushstring(L, encoder_name);
-    assert(lua_gettop(L) == 5);
   }
   else {
-    /* Path through C */
-
-    /* FUTURE: Store two arrays, one for the rplx object (like now)
-     * and one for the peg.  Retrieve only the peg here.
-     */
-    t = lua_getfield(L, -1, "pattern");
-    CHECK_TYPE("rplx pattern slot", t, LUA_TTABLE);
-    t = lua_getfield(L, -1, "peg");
-    CHECK_TYPE("rplx pattern peg slot", t, LUA_TUSERDATA);
-    lua_pushcfunction(L, r_match_C);
-    lua_copy(L, -1, 1);
-    lua_copy(L, -2, 2);
-    lua_settop(L, 2);
     lua_pushlightuserdata(L, input); 
-    lua_pushinteger(L, start);
-    lua_pushinteger(L, encoder);
   }
-  
+}
+
+/* Like call_matcher(), with the input already pushed by
+ * push_subject() at stack index subject, so that several patterns
+ * can be matched against one input that is wrapped only once.
+ */
+static int call_matcher_on(lua_State *L, int fn, int subject, int start, int encoder,
+			   char *encoder_name, str *input, match *match) {
+  int t;
+  lua_pushvalue(L, fn);
+  lua_pushvalue(L, fn-1);
+  lua_pushvalue(L, subject);
+  lua_pushinteger(L, start);
+  if (!encoder) lua_pushstring(L, encoder_name);
+  else lua_pushinteger(L, encoder);
+
   t = lua_pcall(L, 4, 5, 0); 
   if (t != LUA_OK) {  
     LOG("match() failed\n");  
     LOGstack(L); 
-    lua_settop(L, 0); 
-    RELEASE_ENGINE_LOCK(e);
     return ERR_ENGINE_CALL_FAILED;  
   }  
 
@@ -755,8 +1986,43 @@ have_pattern:
   (*match).abend = lua_toboolean(L, -3);
   (*match).leftover = lua_tointeger(L, -4);
   lua_pop(L, 4);
+  do {
+    EngineStats *stats = &(STATE(ENGINE_OF(L))->stats);
+    stats->matches++;
+    if ((lua_type(L, -1) != LUA_TNUMBER) || (lua_tointeger(L, -1) == MATCH_WITHOUT_DATA))
+      stats->matched++;
+    stats->bytes += input->len;
+    stats->ttotal_us += (*match).ttotal;
+    stats->tmatch_us += (*match).tmatch;
+  } while (0);
+  return SUCCESS;
+}
 
-  result_type = lua_type(L, -1);
+/* Call the match function at stack index fn, whose first argument is
+ * at fn-1 (see push_matcher), on one input.  On success, the match
+ * data is left on top of the stack and the numeric fields of match
+ * are filled in.
+ */
+static int call_matcher(lua_State *L, int fn, int start, int encoder, char *encoder_name,
+			str *input, match *match) {
+  int t;
+  push_subject(L, encoder, input);
+  t = call_matcher_on(L, fn, lua_gettop(L), start, encoder, encoder_name, input, match);
+  if (t == SUCCESS) lua_remove(L, -2); /* the subject */
+  return t;
+}
+
+/* Set match->data from the match result on top of the stack.  When a
+ * Lua encoder returns a string, a copy is made if copy_string is
+ * set.  Otherwise match->data points into the Lua string itself, and
+ * the caller must keep that string alive.
+ */
+static int set_match_data(lua_State *L, int encoder, int copy_string, match *match) {
+  int t, match_code;
+  size_t temp_len;
+  unsigned char *temp_str;
+  rBuffer *buf;
+  int result_type = lua_type(L, -1);
   switch (result_type) {
   case LUA_TUSERDATA: {
     buf = lua_touserdata(L, -1);
@@ -765,47 +2031,364 @@ have_pattern:
     (*match).data.len = buf->n;
     break;
   }
-  case LUA_TNUMBER: {
-    match_code = lua_tointeger(L, -1);
-    LOGf("in rosie_match, match returned the integer code %d\n", match_code);
-    set_match_error(match, match_code);
-    break;
+  case LUA_TNUMBER: {
+    match_code = lua_tointeger(L, -1);
+    LOGf("in rosie_match, match returned the integer code %d\n", match_code);
+    set_match_error(match, match_code);
+    break;
+  }
+  case LUA_TSTRING: {
+    if (encoder) {
+      LOG("Invalid return type from rmatch (string)\n");
+      return ERR_ENGINE_CALL_FAILED;
+    }
+    temp_str = (unsigned char *)lua_tolstring(L, -1, &temp_len);
+    if (!copy_string) {
+      (*match).data.ptr = temp_str;
+      (*match).data.len = temp_len;
+      break;
+    }
+    /* The client does not need to manage the storage for match
+     * results when they are in an rBuffer (userdata), so we do not
+     * want the client to manage the storage when it has the form of a
+     * Lua string (returned by common.rmatch).  So we alloc the
+     * string, and stash a pointer to it in the registry, to be freed
+     * the next time around.
+    */
+    get_registry(prev_string_result_key);
+    str *rs = lua_touserdata(L, -1);
+    if (rs) rosie_free_string_ptr(rs);
+    lua_pop(L, 1);
+    rs = rosie_new_string_ptr(temp_str, temp_len);
+    lua_pushlightuserdata(L, (void *) rs);
+    set_registry(prev_string_result_key);
+    lua_pop(L, 1);
+    (*match).data.ptr = rs->ptr;
+    (*match).data.len = rs->len;
+    break;
+  }
+  default: {
+    t = lua_type(L, -1);
+    LOGf("Invalid return type from rmatch (%d)\n", t);
+    return ERR_ENGINE_CALL_FAILED;
+  } }
+  return SUCCESS;
+}
+
+EXPORT
+int rosie_match(Engine *e, int pat, int start, char *encoder_name, str *input, match *match) {
+  int t, encoder;
+  lua_State *L = e->L;
+  LOG("rosie_match called\n");
+  ACQUIRE_ENGINE_LOCK(e);
+  collect_if_needed(L);
+  encoder = encoder_name_to_code(encoder_name);
+  LOGf("in rosie_match, encoder value is %d\n", encoder);
+  if (!pat || !push_matcher(L, pat, encoder)) {
+    LOGf("rosie_match() called with invalid compiled pattern reference: %d\n", pat);
+    set_match_error(match, ERR_NO_PATTERN);
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return SUCCESS;
+  }
+
+  t = call_matcher(L, lua_gettop(L), start, encoder, encoder_name, input, match);
+  if (t == SUCCESS) t = set_match_data(L, encoder, TRUE, match);
+
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return t;
+}
+
+/* Like rosie_match(), except that the match data is copied into the
+ * caller's buffer, so no memory is allocated for it and it remains
+ * valid after the next call.  When the match data does not fit in
+ * bufsize bytes, match->data has NULL ptr and len
+ * ERR_BUFFER_TOO_SMALL.  In all cases, *needed is set to the size of
+ * the match data (zero when there is none).
+ */
+EXPORT
+int rosie_match_into(Engine *e, int pat, int start, char *encoder_name, str *input,
+		     byte_ptr buffer, size_t bufsize, size_t *needed, match *match) {
+  int t, encoder;
+  lua_State *L = e->L;
+  (*needed) = 0;
+  ACQUIRE_ENGINE_LOCK(e);
+  collect_if_needed(L);
+  encoder = encoder_name_to_code(encoder_name);
+  if (!pat || !push_matcher(L, pat, encoder)) {
+    LOGf("rosie_match_into() called with invalid compiled pattern reference: %d\n", pat);
+    set_match_error(match, ERR_NO_PATTERN);
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return SUCCESS;
+  }
+
+  t = call_matcher(L, lua_gettop(L), start, encoder, encoder_name, input, match);
+  if (t == SUCCESS) t = set_match_data(L, encoder, FALSE, match);
+  if ((t == SUCCESS) && (*match).data.ptr) {
+    (*needed) = (*match).data.len;
+    if ((*needed) <= bufsize) {
+      memcpy(buffer, (*match).data.ptr, (*needed));
+      (*match).data.ptr = buffer;
+    } else {
+      set_match_error(match, ERR_BUFFER_TOO_SMALL);
+    }
+  }
+
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return t;
+}
+
+/* Match n inputs against one pattern, filling in the parallel array
+ * of n match results.  The engine lock, the memory check, and the
+ * lookup of the pattern are done once per batch instead of once per
+ * input, which dominates the cost of matching short inputs.
+ *
+ * The match data is owned by the engine, and remains valid until the
+ * next call to rosie_match_batch() on this engine.  If an error code
+ * is returned, the contents of matches are undefined.
+ */
+EXPORT
+int rosie_match_batch(Engine *e, int pat, int start, char *encoder_name,
+		      int n, str *inputs, match *matches) {
+  int t, i, fn, results, encoder;
+  lua_State *L = e->L;
+  LOGf("rosie_match_batch called with %d inputs\n", n);
+  ACQUIRE_ENGINE_LOCK(e);
+  /* Release the results of the previous batch before checking memory */
+  lua_pushnil(L);
+  set_registry(batch_results_key);
+  lua_pop(L, 1);
+  collect_if_needed(L);
+  encoder = encoder_name_to_code(encoder_name);
+  LOGf("in rosie_match_batch, encoder value is %d\n", encoder);
+  lua_createtable(L, n, 0);
+  set_registry(batch_results_key);
+  results = lua_gettop(L);
+  if (!pat || !push_matcher(L, pat, encoder)) {
+    LOGf("rosie_match_batch() called with invalid compiled pattern reference: %d\n", pat);
+    for (i = 0; i < n; i++) set_match_error(&matches[i], ERR_NO_PATTERN);
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return SUCCESS;
+  }
+  fn = lua_gettop(L);
+  
+  for (i = 0; i < n; i++) {
+    t = call_matcher(L, fn, start, encoder, encoder_name, &inputs[i], &matches[i]);
+    if (t == SUCCESS) t = set_match_data(L, encoder, FALSE, &matches[i]);
+    if (t != SUCCESS) {
+      lua_settop(L, 0);
+      RELEASE_ENGINE_LOCK(e);
+      return t;
+    }
+    /* Keep the match data alive until the next batch */
+    if (matches[i].data.ptr) lua_rawseti(L, results, i+1);
+    lua_settop(L, fn);
+  }
+
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+}
+
+/* ----------------------------------------------------------------------------------------
+ * Pattern sets
+ * ----------------------------------------------------------------------------------------
+ */
+
+/* A pattern set is a list of rplx objects that are all matched
+ * against each input.  When the set is compiled, the patterns are
+ * combined into one program (see pattern_set_program in
+ * engine_module.lua) that tries each of them, in set order, at the
+ * same position, and records the ones that match.  Matching the set
+ * therefore runs the matching vm once, not once per pattern.  A
+ * pattern is tried only when the next byte of input is one that it
+ * can begin with, but a pattern that searches (e.g. made with find
+ * or findall) can begin with any byte, so it is tried on every input.
+ * The cost of a match is still the sum of the costs of the patterns
+ * tried: the set is not compiled into an automaton.
+ *
+ * The set holds the rplx objects themselves, so it keeps matching a
+ * pattern that is freed after the set is compiled, and an index that
+ * is reused by a later pattern does not change the set.  Matches are
+ * reported by the indices given to rosie_compile_set().  Pattern sets
+ * are not copied by rosie_clone().
+ *
+ * Sets *set to 0 if any of the n entries of pats is not a compiled
+ * pattern.  Client must free the set with rosie_free_set().
+ */
+EXPORT
+int rosie_compile_set(Engine *e, int *pats, int n, int *set) {
+  int t, i;
+  lua_State *L = e->L;
+  (*set) = 0;
+  ACQUIRE_ENGINE_LOCK(e);
+  get_registry(pattern_set_table_key);	  /* 1 */
+  lua_createtable(L, 0, 4);		  /* 2: the set */
+  get_registry(pattern_set_program_key);  /* 3 */
+  lua_createtable(L, n, 0);		  /* 4: the rplx objects */
+  lua_createtable(L, n, 0);		  /* 5: their indices */
+  get_registry(rplx_table_key);		  /* 6 */
+  for (i = 0; i < n; i++) {
+    t = (pats[i] > 0) ? lua_rawgeti(L, 6, pats[i]) : LUA_TNIL;
+    if (t != LUA_TTABLE) {
+      LOGf("rosie_compile_set() called with invalid compiled pattern reference: %d\n", pats[i]);
+      lua_settop(L, 0);
+      RELEASE_ENGINE_LOCK(e);
+      return SUCCESS;
+    }
+    lua_rawseti(L, 4, i+1);
+    lua_pushinteger(L, pats[i]);
+    lua_rawseti(L, 5, i+1);
+  }
+  lua_settop(L, 5);
+  lua_setfield(L, 2, "pats");
+  lua_pushvalue(L, 4);
+  lua_setfield(L, 2, "rplx");
+  t = lua_pcall(L, 1, 2, 0);	/* pattern_set_program(rplx objects) */
+  if (t != LUA_OK) {
+    LOG("pattern_set_program() failed\n");
+    LOGstack(L);
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  lua_setfield(L, 2, "state");
+  lua_setfield(L, 2, "program");
+  (*set) = luaL_ref(L, 1);
+  LOGf("storing pattern set at index %d\n", *set);
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+}
+
+EXPORT
+int rosie_free_set(Engine *e, int set) {
+  lua_State *L = e->L;
+  LOGf("freeing pattern set with index %d\n", set);
+  ACQUIRE_ENGINE_LOCK(e);
+  get_registry(pattern_set_table_key);
+  luaL_unref(L, -1, set);
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+}
+
+/* Match each pattern in the set at position start of input.  The
+ * rplx indices of the patterns that matched are stored, in set
+ * order, in matched, which must have room for every pattern in the
+ * set, and their count in *n_matched.
+ *
+ * When matches is NULL, only the indices are produced, by one run of
+ * the combined program.  Otherwise matches is parallel to matched
+ * and holds the match data for the encoder, which remains valid
+ * until the next call to rosie_match_set() on this engine.  To
+ * produce it, each pattern that matched is matched again, alone,
+ * with the encoder.  If the encoder is not valid, *n_matched is 0
+ * and matches[0] has data with NULL ptr and len ERR_NO_ENCODER.
+ * Returns ERR_NO_PATTERN if set does not refer to a pattern set.
+ */
+EXPORT
+int rosie_match_set(Engine *e, int set, int start, char *encoder_name, str *input,
+		    int *matched, match *matches, int *n_matched) {
+  int t, i, n, k, pat, results, subject, encoder, bool_encoder;
+  match m;
+  lua_State *L = e->L;
+  (*n_matched) = 0;
+  ACQUIRE_ENGINE_LOCK(e);
+  /* Release the results of the previous call before checking memory */
+  lua_pushnil(L);
+  set_registry(set_results_key);
+  lua_pop(L, 1);
+  collect_if_needed(L);
+  get_registry(pattern_set_table_key);
+  if ((set <= 0) || (lua_rawgeti(L, -1, set) != LUA_TTABLE)) {
+    LOGf("rosie_match_set() called with invalid pattern set reference: %d\n", set);
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return ERR_NO_PATTERN;
+  }
+  /* Stack: set table, set.  One run of the set's program leaves in
+     state.hits the positions in the set of the patterns that match. */
+  lua_getfield(L, 2, "state");	/* 3 */
+  lua_newtable(L);		/* 4: hits */
+  lua_pushvalue(L, 4);
+  lua_setfield(L, 3, "hits");
+  lua_getfield(L, 2, "program");
+  lua_pushcfunction(L, r_match_C);
+  bool_encoder = encoder_name_to_code("bool");
+  push_subject(L, bool_encoder, input);
+  t = call_matcher_on(L, 6, 7, start, bool_encoder, "bool", input, &m);
+  if (t != SUCCESS) {
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return t;
   }
-  case LUA_TSTRING: {
-    if (encoder) {
-      LOG("Invalid return type from rmatch (string)\n");
-      match = NULL;
+  lua_settop(L, 4);
+  n = lua_rawlen(L, 4);
+  lua_getfield(L, 2, "pats");	/* 5 */
+  if (!matches) {
+    for (i = 1; i <= n; i++) {
+      lua_rawgeti(L, 4, i);
+      lua_rawgeti(L, 5, lua_tointeger(L, -1));
+      matched[i - 1] = lua_tointeger(L, -1);
+      lua_pop(L, 2);
+    }
+    (*n_matched) = n;
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return SUCCESS;
+  }
+
+  /* Match data was asked for, so match again each one that matched */
+  encoder = encoder_name_to_code(encoder_name);
+  lua_createtable(L, n, 0);
+  set_registry(set_results_key);
+  results = lua_gettop(L);	/* 6 */
+  lua_getfield(L, 2, "rplx");	/* 7 */
+  push_subject(L, encoder, input);
+  subject = lua_gettop(L);	/* 8 */
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, 4, i);
+    k = lua_tointeger(L, -1);
+    lua_rawgeti(L, 5, k);
+    pat = lua_tointeger(L, -1);
+    lua_settop(L, subject);
+    /* The match function and its first argument, as from push_matcher() */
+    lua_rawgeti(L, 7, k);
+    if (!encoder) {
+      get_registry(cmatch_key);
+    } else {
+      lua_getfield(L, -1, "pattern");
+      lua_getfield(L, -1, "peg");
+      lua_replace(L, -3);
+      lua_pop(L, 1);
+      lua_pushcfunction(L, r_match_C);
+    }
+    t = call_matcher_on(L, lua_gettop(L), subject, start, encoder, encoder_name, input, &m);
+    if (t == SUCCESS) t = set_match_data(L, encoder, FALSE, &m);
+    if (t != SUCCESS) {
       lua_settop(L, 0);
       RELEASE_ENGINE_LOCK(e);
-      return ERR_ENGINE_CALL_FAILED;
+      return t;
     }
-    /* The client does not need to manage the storage for match
-     * results when they are in an rBuffer (userdata), so we do not
-     * want the client to manage the storage when it has the form of a
-     * Lua string (returned by common.rmatch).  So we alloc the
-     * string, and stash a pointer to it in the registry, to be freed
-     * the next time around.
-    */
-    get_registry(prev_string_result_key);
-    str *rs = lua_touserdata(L, -1);
-    if (rs) rosie_free_string_ptr(rs);
-    lua_pop(L, 1);
-    temp_str = (unsigned char *)lua_tolstring(L, -1, &temp_len);
-    rs = rosie_new_string_ptr(temp_str, temp_len);
-    lua_pushlightuserdata(L, (void *) rs);
-    set_registry(prev_string_result_key);
-    (*match).data.ptr = rs->ptr;
-    (*match).data.len = rs->len;
-    break;
+    if (!m.data.ptr && (m.data.len > MATCH_WITHOUT_DATA)) {
+      (*n_matched) = 0;
+      matches[0] = m;
+      break;
+    }
+    if (m.data.ptr || (m.data.len == MATCH_WITHOUT_DATA)) {
+      matched[*n_matched] = pat;
+      matches[*n_matched] = m;
+      /* Keep the match data alive until the next call */
+      if (m.data.ptr) lua_rawseti(L, results, (*n_matched) + 1);
+      (*n_matched)++;
+    }
+    lua_settop(L, subject);
   }
-  default: {
-    t = lua_type(L, -1);
-    LOGf("Invalid return type from rmatch (%d)\n", t);
-    match = NULL;
-    lua_settop(L, 0);
-    RELEASE_ENGINE_LOCK(e);
-    return ERR_ENGINE_CALL_FAILED;
-  } }
 
   lua_settop(L, 0);
   RELEASE_ENGINE_LOCK(e);
@@ -935,6 +2518,7 @@ int rosie_load(Engine *e, int *ok, str *src, str *pkgname, str *messages) {
 
   *ok = lua_toboolean(L, -3);
   LOGf("engine.load() %s\n", *ok ? "succeeded\n" : "failed\n");
+  if (*ok) record_history(L, "load", src, NULL);
   
   if (lua_isstring(L, -2)) {
     temp_str = (unsigned char *)lua_tolstring(L, -2, &temp_len);
@@ -989,6 +2573,7 @@ int rosie_loadfile(Engine *e, int *ok, str *fn, str *pkgname, str *messages) {
 
   *ok = lua_toboolean(L, -3);
   LOGf("engine.loadfile() %s\n", *ok ? "succeeded" : "failed");
+  if (*ok) record_history(L, "loadfile", fn, NULL);
   LOGstack(L);
   
   if (lua_isstring(L, -2)) {
@@ -1050,6 +2635,7 @@ int rosie_import(Engine *e, int *ok, str *pkgname, str *as, str *actual_pkgname,
 
   *ok = lua_toboolean(L, -3);
   LOGf("import %*s %s\n", pkgname->len, pkgname->ptr, *ok ? "succeeded" : "failed");
+  if (*ok) record_history(L, "import", pkgname, as);
   
   if (lua_isstring(L, -2)) {
     temp_str = (unsigned char *)lua_tolstring(L, -2, &temp_len);
@@ -1076,23 +2662,416 @@ int rosie_import(Engine *e, int *ok, str *pkgname, str *as, str *actual_pkgname,
   return SUCCESS;
 }
 
+/* Define the dictionary called name, used in rpl by dictionary:#name,
+ * from entries, which holds one entry per line.  When entries is NULL,
+ * the file called name is read.  Patterns already compiled from the
+ * dictionary match its new entries without being compiled again.
+ *
+ * N.B. Client must free 'messages'
+ */
+EXPORT
+int rosie_set_dictionary(Engine *e, int *ok, str *name, str *entries, str *messages) {
+  int t;
+  size_t temp_len;
+  const char *temp_str;
+  lua_State *L = e->L;
+  ACQUIRE_ENGINE_LOCK(e);
+  get_registry(engine_key);
+  t = lua_getfield(L, -1, "set_dictionary");
+  CHECK_TYPE("engine.set_dictionary()", t, LUA_TFUNCTION);
+  lua_pushvalue(L, -2);		/* push engine object again */
+  lua_pushlstring(L, (const char *)name->ptr, name->len);
+  if (entries && entries->ptr) {
+    lua_pushlstring(L, (const char *)entries->ptr, entries->len);
+  }
+  else {
+    lua_pushnil(L);
+  }
+
+  t = lua_pcall(L, 3, 2, 0);
+  if (t != LUA_OK) {
+    LOG("engine.set_dictionary() failed\n");
+    LOGstack(L);
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return ERR_ENGINE_CALL_FAILED;
+  }
+
+  *ok = lua_toboolean(L, -2);
+  LOGf("set_dictionary %.*s %s\n", (int) name->len, name->ptr, *ok ? "succeeded" : "failed");
+  if (*ok) {
+    record_setting(L, "dictionary", name, name, entries);
+    messages->ptr = NULL;
+    messages->len = 0;
+  }
+  else {
+    temp_str = lua_tolstring(L, -1, &temp_len);
+    if (temp_str) *messages = rosie_new_string((byte_ptr) temp_str, temp_len);
+    else *messages = rosie_new_string_from_const("cannot define dictionary");
+  }
+
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  return SUCCESS;
+}
+
+/* ----------------------------------------------------------------------------------------
+ * Matching files in C
+ * ----------------------------------------------------------------------------------------
+ */
+
+/* When the input is a regular file, rosie_matchfile() and
+ * rosie_matchfile_parallel() mmap it and scan for newlines in C.
+ * Each line is given to the matcher as a wrapped buffer (or a
+ * rosie_string, for the C encoders), so no Lua string is created for
+ * the input.  Stdin and other unmappable inputs are still read by
+ * engine_process_file() in Lua.  A mapped input that is compressed
+ * is decompressed on another thread (see decompress.c), when this
+ * librosie was built to decompress its format.
+ *
+ * The input is divided into line-aligned chunks of at least
+ * MATCHFILE_CHUNK_SIZE bytes (except the last one), and the output
+ * of a chunk is accumulated in memory and written in one piece.
+ */
+#define MATCHFILE_CHUNK_SIZE (4 * 1024 * 1024)
+#define MATCHFILE_CHUNKS_PER_ENGINE 4
+
+typedef struct matchfile_chunk {
+  const char *start;
+  const char *end;
+  output_buffer out;
+  output_buffer err;
+  int cin, cout, cerr;
+  int count_only;		/* write nothing, only count */
+  int limit;			/* stop after this many matches, if > 0 */
+  int done;
+} matchfile_chunk;
+
+/* The "count" encoder is implemented in Lua, where it matches without
+ * building any match data.  When it is used, matchfile writes neither
+ * the matches nor the non-matching lines.
+ */
+#define COUNT_ENCODER "count"
+
+static int is_count_encoder(const char *name) {
+  return !strncmp(name, COUNT_ENCODER, MAX_ENCODER_NAME_LENGTH);
+}
+
+/* Returns SUCCESS, an error code (negative), or a match error code
+ * (positive, like ERR_NO_ENCODER).  In whole file mode, the chunk is
+ * matched as a single input, even when it is empty.  When c->limit
+ * is positive, matching stops after that many lines have matched.
+ */
+static int match_chunk(lua_State *L, int fn, int encoder, char *encoder_name,
+		       int wholefileflag, matchfile_chunk *c) {
+  int t, ok;
+  str input;
+  match m;
+  const char *eol, *line = c->start;
+  do {
+    eol = wholefileflag ? NULL : memchr(line, '\n', c->end - line);
+    if (!eol) eol = c->end;
+    input.ptr = (byte_ptr) line;
+    input.len = eol - line;
+    t = call_matcher(L, fn, 1, encoder, encoder_name, &input, &m);
+    if (t == SUCCESS) t = set_match_data(L, encoder, FALSE, &m);
+    if (t != SUCCESS) return t;
+    c->cin++;
+    if (m.data.ptr) {
+      ok = output_append(&c->out, (const char *)m.data.ptr, m.data.len) &&
+	output_append(&c->out, "\n", 1);
+      c->cout++;
+    } else if (m.data.len == MATCH_WITHOUT_DATA) {
+      ok = TRUE;		/* there is no data to write */
+      c->cout++;
+    } else if (m.data.len == NO_MATCH) {
+      ok = c->count_only ||
+	(output_append(&c->err, line, eol - line) &&
+	 output_append(&c->err, "\n", 1));
+      c->cerr++;
+    } else {
+      return m.data.len;
+    }
+    if (!ok) return ERR_OUT_OF_MEMORY;
+    lua_settop(L, fn);
+    if ((c->limit > 0) && (c->cout >= c->limit)) break;
+    line = eol + 1;
+  } while (line < c->end);
+  return SUCCESS;
+}
+
+/* Write the output of a chunk and add its counts to the totals */
+static int write_chunk(matchfile_chunk *c, FILE *outfile, FILE *errfile,
+		       int *cin, int *cout, int *cerr) {
+  if ((fwrite(c->out.ptr, 1, c->out.len, outfile) != c->out.len) ||
+      (fwrite(c->err.ptr, 1, c->err.len, errfile) != c->err.len))
+    return ERR_SYSCALL_FAILED;
+  (*cin) += c->cin;
+  (*cout) += c->cout;
+  (*cerr) += c->cerr;
+  output_free(&(c->out));
+  output_free(&(c->err));
+  return SUCCESS;
+}
+
+/* The chunk that starts at pos ends after the first newline found
+ * MATCHFILE_CHUNK_SIZE or more bytes later, or at end.
+ */
+static const char *chunk_end(const char *pos, const char *end) {
+  const char *nl = ((end - pos) > MATCHFILE_CHUNK_SIZE) ? pos + MATCHFILE_CHUNK_SIZE : end;
+  if (nl < end) {
+    nl = memchr(nl, '\n', end - nl);
+    nl = nl ? nl + 1 : end;
+  }
+  return nl;
+}
+
+static FILE *open_output(char *filename, FILE *dflt) {
+  if (!filename || !*filename) return dflt;
+  return fopen(filename, "w");
+}
+
+static void close_output(FILE *f) {
+  if (f && (f != stdout) && (f != stderr)) fclose(f);
+  else if (f) fflush(f);
+}
+
+static void set_no_file_error(char *filename, int *cin, int *cout, str *err) {
+  char *msg = NULL;
+  (*cin) = -1;
+  (*cout) = ERR_NO_FILE;
+  if (asprintf(&msg, "No such file %s", filename ? filename : "") > 0)
+    *err = rosie_string_from((byte_ptr) msg, strlen(msg));
+}
+
+/* Map the named input file into memory.  Returns SUCCESS (with *data
+ * set to NULL when the file is empty), ERR_NO_FILE when the file
+ * cannot be opened, or ERR_SYSCALL_FAILED.  When mappable_only is
+ * set, an input that is not a regular file (e.g. a pipe) gives
+ * ERR_NO_FILE.
+ */
+static int map_input_file(char *filename, int mappable_only, const char **data, size_t *size) {
+  struct stat st;
+  int fd;
+  *data = NULL;
+  *size = 0;
+  /* Check by name first, because opening a pipe would take its input */
+  if (!filename || !*filename || (stat(filename, &st) < 0) ||
+      (mappable_only && !S_ISREG(st.st_mode)))
+    return ERR_NO_FILE;
+  fd = open(filename, O_RDONLY);
+  if ((fd < 0) || (fstat(fd, &st) < 0) || (mappable_only && !S_ISREG(st.st_mode))) {
+    if (fd >= 0) close(fd);
+    return ERR_NO_FILE;
+  }
+  if (st.st_size > 0) {
+    *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (*data == MAP_FAILED) {
+      LOGf("mmap failed for %s (errno=%d)\n", filename, errno);
+      *data = NULL;
+      close(fd);
+      return ERR_SYSCALL_FAILED;
+    }
+    madvise((void *) *data, st.st_size, MADV_SEQUENTIAL);
+    *size = st.st_size;
+  }
+  close(fd);
+  return SUCCESS;
+}
+
+/* Match the input from start to end as one chunk and write its output,
+ * with at most the matches that are left before maxcount (if
+ * maxcount > 0).  Returns as match_chunk() does.
+ */
+static int match_and_write(lua_State *L, int fn, int encoder, char *encoder_name,
+			   int wholefileflag, int maxcount, matchfile_chunk *c,
+			   const char *start, const char *end,
+			   FILE *outfile, FILE *errfile,
+			   int *cin, int *cout, int *cerr) {
+  int t;
+  c->start = start;
+  c->end = end;
+  c->cin = c->cout = c->cerr = 0;
+  c->limit = (maxcount > 0) ? maxcount - *cout : 0;
+  collect_if_needed(L);
+  t = match_chunk(L, fn, encoder, encoder_name, wholefileflag, c);
+  if (t == SUCCESS) t = write_chunk(c, outfile, errfile, cin, cout, cerr);
+  return t;
+}
+
+/* Match the mapped input one chunk at a time, writing each chunk's
+ * output as soon as it is done, and stopping early when maxcount
+ * lines have matched (if maxcount > 0).  Returns as match_chunk()
+ * does.
+ */
+static int matchfile_mapped(lua_State *L, int fn, int encoder, char *encoder_name,
+			    int wholefileflag, int maxcount, const char *data, size_t size,
+			    FILE *outfile, FILE *errfile,
+			    int *cin, int *cout, int *cerr) {
+  int t = SUCCESS;
+  matchfile_chunk c;
+  const char *pos = data, *end = data + size;
+  if (!data) {
+    if (!wholefileflag) return SUCCESS; /* no lines */
+    pos = data = end = "";	      /* one empty input */
+  }
+  memset(&c, 0, sizeof(c));
+  c.count_only = is_count_encoder(encoder_name);
+  do {
+    t = match_and_write(L, fn, encoder, encoder_name, wholefileflag, maxcount, &c,
+			pos, wholefileflag ? end : chunk_end(pos, end),
+			outfile, errfile, cin, cout, cerr);
+    if (t != SUCCESS) break;
+    if ((maxcount > 0) && (*cout >= maxcount)) break;
+    pos = c.end;
+  } while (pos < end);
+  output_free(&(c.out));
+  output_free(&(c.err));
+  return t;
+}
+
+static const char *last_newline(const char *data, size_t len) {
+  while (len > 0)
+    if (data[--len] == '\n') return data + len;
+  return NULL;
+}
+
+/* Like matchfile_mapped(), for an input that is compressed in the
+ * given format.  The lines of each decompressed buffer are matched
+ * where they are, except for a line that continues into the next
+ * buffer, which is copied.  In whole file mode, all of the output of
+ * the decompressor is collected before it is matched.  Returns as
+ * match_chunk() does, or ERR_CORRUPT_INPUT.
+ */
+static int matchfile_compressed(lua_State *L, int fn, int encoder, char *encoder_name,
+				int wholefileflag, int maxcount, int format,
+				const char *data, size_t size,
+				FILE *outfile, FILE *errfile,
+				int *cin, int *cout, int *cerr) {
+  int t, err;
+  decompressor d;
+  matchfile_chunk c;
+  output_buffer partial;	/* a line that began in an earlier buffer */
+  const char *buf, *nl, *last;
+  size_t len;
+  memset(&c, 0, sizeof(c));
+  memset(&partial, 0, sizeof(partial));
+  c.count_only = is_count_encoder(encoder_name);
+  t = decompressor_start(&d, format, data, size);
+  if (t != SUCCESS) return t;
+  while ((t == SUCCESS) && !((maxcount > 0) && (*cout >= maxcount))
+	 && decompressor_next(&d, &buf, &len)) {
+    last = wholefileflag ? NULL : last_newline(buf, len);
+    if (!last) {
+      if (!output_append(&partial, buf, len)) t = ERR_OUT_OF_MEMORY;
+    } else {
+      if (partial.len > 0) {
+	nl = memchr(buf, '\n', len);
+	if (!output_append(&partial, buf, nl - buf)) t = ERR_OUT_OF_MEMORY;
+	else t = match_and_write(L, fn, encoder, encoder_name, FALSE, maxcount, &c,
+				 partial.ptr, partial.ptr + partial.len,
+				 outfile, errfile, cin, cout, cerr);
+	partial.len = 0;
+	len -= (nl + 1) - buf;
+	buf = nl + 1;
+      }
+      if ((t == SUCCESS) && (buf <= last) && !((maxcount > 0) && (*cout >= maxcount)))
+	t = match_and_write(L, fn, encoder, encoder_name, FALSE, maxcount, &c,
+			    buf, last + 1, outfile, errfile, cin, cout, cerr);
+      if ((t == SUCCESS) && !output_append(&partial, last + 1, (buf + len) - (last + 1)))
+	t = ERR_OUT_OF_MEMORY;
+    }
+    decompressor_release(&d);
+  }
+  /* The last line may not end with a newline */
+  if ((t == SUCCESS) && !((maxcount > 0) && (*cout >= maxcount)) &&
+      (wholefileflag || (partial.len > 0))) {
+    buf = partial.ptr ? partial.ptr : "";
+    t = match_and_write(L, fn, encoder, encoder_name, wholefileflag, maxcount, &c,
+			buf, buf + partial.len, outfile, errfile, cin, cout, cerr);
+  }
+  err = decompressor_stop(&d);
+  if (t == SUCCESS) t = err;
+  output_free(&partial);
+  output_free(&(c.out));
+  output_free(&(c.err));
+  return t;
+}
+
 /* FUTURE: Expose engine_process_file() ? */
 
-/* N.B. Client must free err */
+/* As rosie_matchfile(), but stop after maxcount lines have matched
+ * when maxcount > 0.  With the "count" encoder, nothing is written,
+ * and a maxcount of 1 makes *cout tell whether any line matches.
+ *
+ * N.B. Client must free err
+ */
 EXPORT
-int rosie_matchfile(Engine *e, int pat, char *encoder, int wholefileflag,
-		    char *infilename, char *outfilename, char *errfilename,
-		    int *cin, int *cout, int *cerr,
-		    str *err) {
-  int t;
+int rosie_matchfile_max(Engine *e, int pat, char *encoder, int wholefileflag, int maxcount,
+			char *infilename, char *outfilename, char *errfilename,
+			int *cin, int *cout, int *cerr,
+			str *err) {
+  int t, encoder_code, mapped, format;
   unsigned char *temp_str;
   size_t temp_len;
+  const char *data;
+  FILE *outfile, *errfile;
   lua_State *L = e->L;
   (*err).ptr = NULL;
   (*err).len = 0;
 
   ACQUIRE_ENGINE_LOCK(e);
   collect_if_needed(L);
+
+  /* A regular file is mapped and matched in C.  Any other input
+     (including stdin, a file that could not be mapped, or a file
+     compressed in a format that this librosie cannot decompress) is
+     processed in Lua. */
+  mapped = encoder && (map_input_file(infilename, TRUE, &data, &temp_len) == SUCCESS);
+  if (mapped) {
+    format = input_format(data, temp_len);
+    if ((format != INPUT_PLAIN) && !can_decompress(format)) {
+      munmap((void *) data, temp_len);
+      mapped = FALSE;
+    }
+  }
+  if (mapped) {
+    encoder_code = encoder_name_to_code(encoder);
+    t = SUCCESS;
+    if (!push_matcher(L, pat, encoder_code)) {
+      LOGf("rosie_matchfile() called with invalid compiled pattern reference: %d\n", pat);
+      (*cin) = -1;
+      (*cout) = ERR_NO_PATTERN;
+      goto unmap;
+    }
+    outfile = open_output(outfilename, stdout);
+    errfile = open_output(errfilename, stderr);
+    if (!outfile || !errfile) {
+      set_no_file_error(outfile ? errfilename : outfilename, cin, cout, err);
+    } else {
+      (*cin) = (*cout) = (*cerr) = 0;
+      if (format == INPUT_PLAIN)
+	t = matchfile_mapped(L, lua_gettop(L), encoder_code, encoder, wholefileflag, maxcount,
+			     data, temp_len, outfile, errfile, cin, cout, cerr);
+      else
+	t = matchfile_compressed(L, lua_gettop(L), encoder_code, encoder, wholefileflag, maxcount,
+				 format, data, temp_len, outfile, errfile, cin, cout, cerr);
+      if (t > 0) {
+	/* A match error, such as an invalid encoder */
+	(*cin) = -1;
+	(*cout) = t;
+	t = SUCCESS;
+      }
+    }
+    close_output(outfile);
+    close_output(errfile);
+  unmap:
+    if (data) munmap((void *) data, temp_len);
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(e);
+    return t;
+  }
+
   get_registry(engine_key);
   t = lua_getfield(L, -1, "matchfile");
   CHECK_TYPE("engine.matchfile()", t, LUA_TFUNCTION);
@@ -1124,8 +3103,9 @@ int rosie_matchfile(Engine *e, int pat, char *encoder, int wholefileflag,
   lua_pushstring(L, errfilename); /* arg 5 */
   lua_pushstring(L, encoder);	  /* arg 6 */
   lua_pushboolean(L, wholefileflag); /* arg 7 */
+  lua_pushinteger(L, maxcount);	     /* arg 8 */
 
-  t = lua_pcall(L, 7, 3, 0); 
+  t = lua_pcall(L, 8, 3, 0); 
   if (t != LUA_OK) {  
     LOG("matchfile() failed\n");  
     LOGstack(L); 
@@ -1160,6 +3140,386 @@ int rosie_matchfile(Engine *e, int pat, char *encoder, int wholefileflag,
   return SUCCESS;
 }
 
+/* N.B. Client must free err */
+EXPORT
+int rosie_matchfile(Engine *e, int pat, char *encoder, int wholefileflag,
+		    char *infilename, char *outfilename, char *errfilename,
+		    int *cin, int *cout, int *cerr,
+		    str *err) {
+  return rosie_matchfile_max(e, pat, encoder, wholefileflag, 0,
+			     infilename, outfilename, errfilename,
+			     cin, cout, cerr, err);
+}
+
+/* ----------------------------------------------------------------------------------------
+ * Parallel matchfile
+ * ----------------------------------------------------------------------------------------
+ */
+
+/* Each engine matches whole chunks, and the output of each chunk is
+ * held in memory until all earlier chunks have been written.  To
+ * bound memory use, at most MATCHFILE_CHUNKS_PER_ENGINE chunks per
+ * engine may be matched ahead of the writer.
+ */
+typedef struct matchfile_job {
+  matchfile_chunk *chunks;
+  int nchunks;
+  int next;			/* next chunk to be matched */
+  int written;			/* number of chunks written so far */
+  int window;			/* how far ahead of the writer to match */
+  char *encoder_name;
+  int encoder;
+  int status;			/* first error encountered, if any */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} matchfile_job;
+
+typedef struct matchfile_worker {
+  Engine *e;
+  int pat;
+  matchfile_job *job;
+  pthread_t thread;
+} matchfile_worker;
+
+static void matchfile_fail(matchfile_job *job, int status) {
+  ACQUIRE_LOCK(job->lock);
+  if (job->status == SUCCESS) job->status = status;
+  pthread_cond_broadcast(&(job->cond));
+  RELEASE_LOCK(job->lock);
+}
+
+static void *matchfile_worker_main(void *arg) {
+  int i, t, fn;
+  matchfile_worker *w = (matchfile_worker *) arg;
+  matchfile_job *job = w->job;
+  lua_State *L = w->e->L;
+  ACQUIRE_ENGINE_LOCK(w->e);
+  if (!w->pat || !push_matcher(L, w->pat, job->encoder)) {
+    LOGf("rosie_matchfile_parallel() called with invalid compiled pattern reference: %d\n", w->pat);
+    matchfile_fail(job, ERR_NO_PATTERN);
+    goto done;
+  }
+  fn = lua_gettop(L);
+  while (1) {
+    ACQUIRE_LOCK(job->lock);
+    while ((job->status == SUCCESS) &&
+	   (job->next < job->nchunks) &&
+	   (job->next >= job->written + job->window))
+      pthread_cond_wait(&(job->cond), &(job->lock));
+    if ((job->status != SUCCESS) || (job->next >= job->nchunks)) {
+      RELEASE_LOCK(job->lock);
+      break;
+    }
+    i = job->next++;
+    RELEASE_LOCK(job->lock);
+    collect_if_needed(L);
+    t = match_chunk(L, fn, job->encoder, job->encoder_name, FALSE, &(job->chunks[i]));
+    lua_settop(L, fn);
+    if (t != SUCCESS) {
+      matchfile_fail(job, t);
+      break;
+    }
+    ACQUIRE_LOCK(job->lock);
+    job->chunks[i].done = TRUE;
+    pthread_cond_broadcast(&(job->cond));
+    RELEASE_LOCK(job->lock);
+  }
+ done:
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(w->e);
+  return NULL;
+}
+
+/* Match each line of infilename using n engines in parallel, where
+ * pats[i] is a pattern compiled in engines[i].  The engines must be
+ * distinct, and the patterns should be the same, because the lines
+ * matched by each engine are not predictable.  Output is written in
+ * the order of the input lines.  The outputs and return values are as
+ * for rosie_matchfile().  An input that cannot be mapped and split
+ * (stdin, a pipe, or a compressed file) is processed by engines[0]
+ * alone, as rosie_matchfile() would.  There is no "whole file" mode,
+ * because a whole file is one match that cannot be split; use
+ * rosie_matchfile() for that.
+ *
+ * N.B. Client must free err
+ */
+EXPORT
+int rosie_matchfile_parallel(Engine **engines, int *pats, int n, char *encoder,
+			     char *infilename, char *outfilename, char *errfilename,
+			     int *cin, int *cout, int *cerr,
+			     str *err) {
+  int i, t, status;
+  size_t size;
+  const char *data = NULL, *pos, *end;
+  FILE *outfile = NULL, *errfile = NULL;
+  matchfile_job job;
+  matchfile_worker *workers;
+  (*err).ptr = NULL;
+  (*err).len = 0;
+  (*cin) = (*cout) = (*cerr) = 0;
+
+  if ((n < 1) || !engines || !pats) {
+    LOG("rosie_matchfile_parallel() called without any engines\n");
+    return ERR_ENGINE_CALL_FAILED;
+  }
+  if (!encoder) {
+    LOG("rosie_matchfile_parallel() called with null encoder name\n");
+    (*cin) = -1;
+    (*cout) = ERR_NO_ENCODER;
+    return SUCCESS;
+  }
+
+  t = map_input_file(infilename, TRUE, &data, &size);
+  if ((t == SUCCESS) && (input_format(data, size) != INPUT_PLAIN)) {
+    munmap((void *) data, size);
+    t = ERR_NO_FILE;
+  }
+  if (t != SUCCESS) {
+    LOG("rosie_matchfile_parallel() cannot split the input, so one engine will process it\n");
+    return rosie_matchfile(engines[0], pats[0], encoder, FALSE,
+			   infilename, outfilename, errfilename, cin, cout, cerr, err);
+  }
+
+  outfile = open_output(outfilename, stdout);
+  errfile = open_output(errfilename, stderr);
+  if (!outfile || !errfile) {
+    set_no_file_error(outfile ? errfilename : outfilename, cin, cout, err);
+    status = SUCCESS;
+    goto cleanup_files;
+  }
+
+  job.nchunks = 0;
+  job.chunks = calloc((size / MATCHFILE_CHUNK_SIZE) + 1, sizeof(matchfile_chunk));
+  workers = calloc(n, sizeof(matchfile_worker));
+  if (!job.chunks || !workers) {
+    if (job.chunks) free(job.chunks);
+    if (workers) free(workers);
+    status = ERR_OUT_OF_MEMORY;
+    goto cleanup_files;
+  }
+  pos = data;
+  end = data + size;
+  while (pos < end) {
+    job.chunks[job.nchunks].start = pos;
+    job.chunks[job.nchunks].end = chunk_end(pos, end);
+    pos = job.chunks[job.nchunks++].end;
+  }
+  job.next = 0;
+  job.written = 0;
+  job.window = n * MATCHFILE_CHUNKS_PER_ENGINE;
+  for (i = 0; i < job.nchunks; i++) job.chunks[i].count_only = is_count_encoder(encoder);
+  job.encoder_name = encoder;
+  job.encoder = encoder_name_to_code(encoder);
+  job.status = SUCCESS;
+  pthread_mutex_init(&(job.lock), NULL);
+  pthread_cond_init(&(job.cond), NULL);
+  LOGf("rosie_matchfile_parallel() using %d engines for %d chunks\n", n, job.nchunks);
+
+  for (i = 0; i < n; i++) {
+    workers[i].e = engines[i];
+    workers[i].pat = pats[i];
+    workers[i].job = &job;
+    t = pthread_create(&(workers[i].thread), NULL, matchfile_worker_main, &workers[i]);
+    if (t) {
+      LOGf("pthread_create failed with %d\n", t);
+      matchfile_fail(&job, ERR_SYSCALL_FAILED);
+      n = i;			/* number of threads to join */
+      break;
+    }
+  }
+
+  /* The writer: output each chunk, in order, as soon as it is done */
+  for (i = 0; i < job.nchunks; i++) {
+    matchfile_chunk *c = &(job.chunks[i]);
+    ACQUIRE_LOCK(job.lock);
+    while (!c->done && (job.status == SUCCESS))
+      pthread_cond_wait(&(job.cond), &(job.lock));
+    RELEASE_LOCK(job.lock);
+    if (!c->done) break;
+    t = write_chunk(c, outfile, errfile, cin, cout, cerr);
+    if (t != SUCCESS) {
+      matchfile_fail(&job, t);
+      break;
+    }
+    ACQUIRE_LOCK(job.lock);
+    job.written++;
+    pthread_cond_broadcast(&(job.cond));
+    RELEASE_LOCK(job.lock);
+  }
+
+  for (i = 0; i < n; i++) pthread_join(workers[i].thread, NULL);
+  for (i = 0; i < job.nchunks; i++) {
+    output_free(&(job.chunks[i].out));
+    output_free(&(job.chunks[i].err));
+  }
+  free(job.chunks);
+  free(workers);
+  pthread_cond_destroy(&(job.cond));
+  pthread_mutex_destroy(&(job.lock));
+
+  status = job.status;
+  if (status > 0) {
+    /* A match error, such as an invalid encoder or pattern */
+    (*cin) = -1;
+    (*cout) = status;
+    status = SUCCESS;
+  }
+
+ cleanup_files:
+  close_output(outfile);
+  close_output(errfile);
+  if (data) munmap((void *) data, size);
+  return status;
+}
+
+/* ----------------------------------------------------------------------------------------
+ * Streaming
+ * ----------------------------------------------------------------------------------------
+ */
+
+/* A stream matches newline-terminated records that arrive in pieces
+ * of any size, e.g. from a pipe or socket.  Complete records are
+ * matched where they lie in the caller's buffer.  Only a record that
+ * spans two feeds is copied, into a buffer that is reused.
+ */
+struct rosie_stream {
+  Engine *e;
+  int pat;
+  int encoder;
+  char *encoder_name;
+  rosie_stream_callback callback;
+  void *context;
+  output_buffer pending;	/* start of a record that spans feeds */
+  int cin, cout, cerr;
+};
+
+static int stream_record(lua_State *L, int fn, rosie_stream *s, const char *ptr, size_t len) {
+  int t;
+  str record;
+  match m;
+  record.ptr = (byte_ptr) ptr;
+  record.len = len;
+  t = call_matcher(L, fn, 1, s->encoder, s->encoder_name, &record, &m);
+  if (t == SUCCESS) t = set_match_data(L, s->encoder, FALSE, &m);
+  if (t != SUCCESS) return t;
+  if (!m.data.ptr && (m.data.len > MATCH_WITHOUT_DATA)) return m.data.len;
+  s->cin++;
+  if (m.data.ptr || (m.data.len == MATCH_WITHOUT_DATA)) s->cout++;
+  else s->cerr++;
+  t = s->callback(s->context, &record, &m);
+  lua_settop(L, fn);
+  return t;
+}
+
+/* Returns NULL if the arguments are not valid, e.g. pat does not refer
+ * to a compiled pattern.  The callback is called once per record,
+ * while the engine is locked, so it must not call into the same
+ * engine.  The record and match data are valid only until the
+ * callback returns.  The callback returns SUCCESS to continue.
+ */
+EXPORT
+rosie_stream *rosie_stream_open(Engine *e, int pat, char *encoder,
+				rosie_stream_callback callback, void *context) {
+  int ok;
+  rosie_stream *s;
+  if (!e || !encoder || !callback) return NULL;
+  ACQUIRE_ENGINE_LOCK(e);
+  ok = push_matcher(e->L, pat, encoder_name_to_code(encoder));
+  lua_settop(e->L, 0);
+  RELEASE_ENGINE_LOCK(e);
+  if (!ok) {
+    LOGf("rosie_stream_open() called with invalid compiled pattern reference: %d\n", pat);
+    return NULL;
+  }
+  s = calloc(1, sizeof(rosie_stream));
+  if (!s) return NULL;
+  s->encoder_name = strndup(encoder, MAX_ENCODER_NAME_LENGTH);
+  if (!s->encoder_name) {
+    free(s);
+    return NULL;
+  }
+  s->e = e;
+  s->pat = pat;
+  s->encoder = encoder_name_to_code(encoder);
+  s->callback = callback;
+  s->context = context;
+  return s;
+}
+
+/* Match every record completed by the len bytes in buf.  Returns
+ * SUCCESS, an error code, a match error code (e.g. ERR_NO_PATTERN if
+ * the pattern has been freed), or the first value other than SUCCESS
+ * returned by the callback.  In all but the first case, the rest of
+ * buf is discarded.
+ */
+EXPORT
+int rosie_stream_feed(rosie_stream *s, byte_ptr buf, size_t len) {
+  int t = SUCCESS, fn;
+  const char *pos = (const char *) buf, *end = pos + len, *eol;
+  lua_State *L;
+  if (!s) return ERR_ENGINE_CALL_FAILED;
+  L = s->e->L;
+  ACQUIRE_ENGINE_LOCK(s->e);
+  collect_if_needed(L);
+  if (!push_matcher(L, s->pat, s->encoder)) {
+    t = ERR_NO_PATTERN;
+    goto done;
+  }
+  fn = lua_gettop(L);
+  while (pos < end) {
+    eol = memchr(pos, '\n', end - pos);
+    if (!eol) {
+      /* The record is not complete, so save it for the next feed */
+      if (!output_append(&(s->pending), pos, end - pos)) t = ERR_OUT_OF_MEMORY;
+      break;
+    }
+    if (s->pending.len) {
+      if (!output_append(&(s->pending), pos, eol - pos)) {
+	t = ERR_OUT_OF_MEMORY;
+	break;
+      }
+      t = stream_record(L, fn, s, s->pending.ptr, s->pending.len);
+      s->pending.len = 0;
+    } else {
+      t = stream_record(L, fn, s, pos, eol - pos);
+    }
+    if (t != SUCCESS) break;
+    pos = eol + 1;
+  }
+ done:
+  lua_settop(L, 0);
+  RELEASE_ENGINE_LOCK(s->e);
+  return t;
+}
+
+/* Match the last record, if it was not terminated by a newline, and
+ * free the stream.  The counts are as for rosie_matchfile().  Returns
+ * as rosie_stream_feed() does.
+ */
+EXPORT
+int rosie_stream_close(rosie_stream *s, int *cin, int *cout, int *cerr) {
+  int t = SUCCESS;
+  lua_State *L;
+  if (!s) return ERR_ENGINE_CALL_FAILED;
+  if (s->pending.len) {
+    L = s->e->L;
+    ACQUIRE_ENGINE_LOCK(s->e);
+    if (push_matcher(L, s->pat, s->encoder))
+      t = stream_record(L, lua_gettop(L), s, s->pending.ptr, s->pending.len);
+    else
+      t = ERR_NO_PATTERN;
+    lua_settop(L, 0);
+    RELEASE_ENGINE_LOCK(s->e);
+  }
+  if (cin) (*cin) = s->cin;
+  if (cout) (*cout) = s->cout;
+  if (cerr) (*cerr) = s->cerr;
+  output_free(&(s->pending));
+  free(s->encoder_name);
+  free(s);
+  return t;
+}
+
 static int rosie_syntax_op(const char *fname, Engine *e, str *input, str *refs, str *messages) {
   int t;
   str r;
@@ -1383,6 +3743,7 @@ int rosie_execute_rcfile(Engine *e, str *filename, int *file_exists, int *no_err
   if (lua_toboolean(L, -2)) {
     LOG("rc file processed successfully\n");
     *no_errors = TRUE;
+    record_history(L, "rcfile", filename, NULL);
   }
   else {
     LOG("file FAILED to process without errors\n");
@@ -1418,6 +3779,7 @@ void rosie_finalize(Engine *e) {
   } 
   LOGf("Finalizing engine %p\n", L);
   lua_close(L);
+  if (STATE(e)->allocator) free_allocator(STATE(e)->allocator);
   /*
    * We do not RELEASE_ENGINE_LOCK(e) here because a waiting thread
    * would then have access to an engine which we have closed, and
@@ -29,6 +29,13 @@
 #define ERR_NO_ENCODER 2	/* also used for "no trace style" */
 #define ERR_NO_FILE 3		/* no such file or directory */
 #define ERR_NO_PATTERN 4
+#define ERR_BUFFER_TOO_SMALL 5	/* for rosie_match_into() */
+#define ERR_CORRUPT_INPUT 6	/* compressed input could not be decompressed */
+
+/* Garbage collector modes for rosie_gc_mode() */
+#define ROSIE_GC_INCREMENTAL 0	/* Lua's default */
+#define ROSIE_GC_GENERATIONAL 1	/* only when built with Lua 5.4 */
+#define ROSIE_GC_MANUAL 2	/* collect only in rosie_gc_step(), or at the alloc limit */
 
 
 #include <stdint.h>
@@ -37,6 +44,22 @@
 
 #include "rpeg.h"
 
+typedef struct rosie_stats {
+     uint64_t matches;		/* inputs matched */
+     uint64_t matched;		/* inputs that matched */
+     uint64_t bytes;		/* total length of the inputs */
+     uint64_t ttotal_us;	/* sum of ttotal over all matches */
+     uint64_t tmatch_us;	/* sum of tmatch (time in the matching vm) */
+     uint64_t gc_forced;	/* collections forced by the allocation limit */
+     uint64_t gc_us;		/* time spent in forced collections */
+     uint64_t heap_kb;		/* current size of the Lua heap */
+     uint64_t peak_heap_kb;
+     uint64_t lock_waits;	/* calls that found the engine lock held */
+     uint64_t lock_wait_us;	/* time those calls waited for the lock */
+     uint64_t gc_steps;		/* calls to rosie_gc_step() */
+     uint64_t gc_step_us;	/* time spent in those calls */
+} EngineStats;
+
 typedef struct rosie_engine {
      lua_State *L;
      pthread_mutex_t lock;
@@ -52,6 +75,9 @@ typedef struct rosie_matchresult {
      int tmatch;
 } match;
 
+typedef struct rosie_stream rosie_stream;
+typedef int (*rosie_stream_callback)(void *context, str *record, match *match);
+
 
 str rosie_new_string(byte_ptr msg, size_t len);
 str *rosie_new_string_ptr(byte_ptr msg, size_t len);
@@ -61,21 +87,55 @@ void rosie_free_string(str s);
 void rosie_free_string_ptr(str *s);
 
 Engine *rosie_new(str *messages);
+Engine *rosie_new_with_allocator(str *messages, lua_Alloc allocf, void *ud, size_t limit);
+Engine *rosie_clone(Engine *e, str *messages);
 void rosie_finalize(Engine *e);
 int rosie_libpath(Engine *e, str *newpath);
+int rosie_set_memoize(Engine *e, int flag);
+int rosie_set_lazy_import(Engine *e, int flag);
+int rosie_set_cachedir(Engine *e, str *dir);
+int rosie_match_limits(Engine *e, int steps, int ms);
+int rosie_profile(Engine *e, int flag);
+int rosie_profile_report(Engine *e, str *report);
 int rosie_alloc_limit(Engine *e, int *newlimit, int *usage);
 int rosie_config(Engine *e, str *retvals);
+int rosie_stats(Engine *e, EngineStats *stats);
+int rosie_gc_step(Engine *e, int budget, int *finished);
+int rosie_gc_mode(Engine *e, int mode, int param1, int param2);
 int rosie_compile(Engine *e, str *expression, int *pat, str *messages);
+int rosie_compile_cached(Engine *e, str *expression, int *pat, str *messages);
+int rosie_compile_projected(Engine *e, str *expression, str *keep, int *pat, str *messages);
 int rosie_free_rplx(Engine *e, int pat);
 int rosie_match(Engine *e, int pat, int start, char *encoder, str *input, match *match);
+int rosie_match_into(Engine *e, int pat, int start, char *encoder, str *input,
+		     byte_ptr buffer, size_t bufsize, size_t *needed, match *match);
+int rosie_match_batch(Engine *e, int pat, int start, char *encoder,
+		      int n, str *inputs, match *matches);
+int rosie_compile_set(Engine *e, int *pats, int n, int *set);
+int rosie_free_set(Engine *e, int set);
+int rosie_match_set(Engine *e, int set, int start, char *encoder, str *input,
+		    int *matched, match *matches, int *n_matched);
 int rosie_matchfile(Engine *e, int pat, char *encoder, int wholefileflag,
 		    char *infilename, char *outfilename, char *errfilename,
 		    int *cin, int *cout, int *cerr,
 		    str *err);
+int rosie_matchfile_max(Engine *e, int pat, char *encoder, int wholefileflag, int maxcount,
+			char *infilename, char *outfilename, char *errfilename,
+			int *cin, int *cout, int *cerr,
+			str *err);
+int rosie_matchfile_parallel(Engine **engines, int *pats, int n, char *encoder,
+			     char *infilename, char *outfilename, char *errfilename,
+			     int *cin, int *cout, int *cerr,
+			     str *err);
+rosie_stream *rosie_stream_open(Engine *e, int pat, char *encoder,
+				rosie_stream_callback callback, void *context);
+int rosie_stream_feed(rosie_stream *s, byte_ptr buf, size_t len);
+int rosie_stream_close(rosie_stream *s, int *cin, int *cout, int *cerr);
 int rosie_trace(Engine *e, int pat, int start, char *trace_style, str *input, int *matched, str *trace);
 int rosie_load(Engine *e, int *ok, str *src, str *pkgname, str *messages);
 int rosie_loadfile(Engine *e, int *ok, str *fn, str *pkgname, str *messages);
 int rosie_import(Engine *e, int *ok, str *pkgname, str *as, str *actual_pkgname, str *messages);
+int rosie_set_dictionary(Engine *e, int *ok, str *name, str *entries, str *messages);
 int rosie_read_rcfile(Engine *e, str *filename, int *file_exists, str *options, str *messages);
 int rosie_execute_rcfile(Engine *e, str *filename, int *file_exists, int *no_errors, str *messages);
 
@@ -93,9 +153,11 @@ Administrative:
 +  status:int = finalize(void *engine)
 +  status:int, desc:string = config(void *engine)
 *  status:int = setlibpath(void *engine, const char *libpath)
++  status:int = set_cachedir(void *engine, const char *dir)  (caches parse trees only)
 +  set soft memory limit to m MB, with optional logging of when it is hit
++  engine:void* = new_with_allocator(lua_Alloc allocf, void *ud, size_t hard_limit)
   logging level (to stderr)?
-  clone an engine?  (to avoid setup cost; but cloned engine must be in new Lua state)
++  engine:void* = clone(void *engine)  (cloned engine is in new Lua state, so setup is replayed)
 
 
 RPL:
@@ -110,6 +172,10 @@ Match/trace:
 +  status:int = free_rplx(void *engine, int pat)
 +  status:int = match(void *engine, int pat, int start, str *encoder,
 		str *input, match *match);
++  status:int, needed:int = match_into(void *engine, int pat, int start, str *encoder,
+		str *input, buffer *output, match *match);
++  status:int = match_batch(void *engine, int pat, int start, str *encoder,
+		int n, str *inputs, match *matches);
 +  status:int, tracestring:*buffer = trace(void *engine, int pat, buffer *input, int start, int encoder, int tracestyle)
 
   status:int, cin:int, cout:int, cerr:int, errors:strings =
@@ -117,6 +183,15 @@ Match/trace:
        const char *infilename, const char *outfilename, const char *errfilename, 
        int start, int encoder, int wholefile)
 
++  status:int, cin:int, cout:int, cerr:int, errors:strings =
+    matchfile_parallel(void **engines, int *pats, int n, const char *encoder,
+       const char *infilename, const char *outfilename, const char *errfilename)
+
++  stream:void* = stream_open(void *engine, int pat, const char *encoder,
+       callback(void *context, str *record, match *match), void *context)
++  status:int = stream_feed(void *stream, buffer *data)
++  status:int, cin:int, cout:int, cerr:int = stream_close(void *stream)
+
   status:int, cin:int, cout:int, cerr:int, errors:strings =
     tracefile(void *engine, void pat, 
        const char *infilename, const char *outfilename, const char *errfilename, 
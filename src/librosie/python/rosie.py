@@ -42,26 +42,77 @@ typedef struct rosie_matchresult {
      int tmatch;
 } match;
 
+typedef struct rosie_stats {
+     uint64_t matches;
+     uint64_t matched;
+     uint64_t bytes;
+     uint64_t ttotal_us;
+     uint64_t tmatch_us;
+     uint64_t gc_forced;
+     uint64_t gc_us;
+     uint64_t heap_kb;
+     uint64_t peak_heap_kb;
+     uint64_t lock_waits;
+     uint64_t lock_wait_us;
+     uint64_t gc_steps;
+     uint64_t gc_step_us;
+} EngineStats;
+
 str *rosie_string_ptr_from(byte_ptr msg, size_t len);
 void rosie_free_string_ptr(str *s);
 void rosie_free_string(str s);
 
 void *rosie_new(str *errors);
+void *rosie_new_with_allocator(str *errors, void *allocf, void *ud, size_t limit);
+void *rosie_clone(void *L, str *errors);
 void rosie_finalize(void *L);
 int rosie_libpath(void *L, str *newpath);
+int rosie_set_memoize(void *L, int flag);
+int rosie_set_lazy_import(void *L, int flag);
+int rosie_set_cachedir(void *L, str *dir);
+int rosie_match_limits(void *L, int steps, int ms);
+int rosie_profile(void *L, int flag);
+int rosie_profile_report(void *L, str *report);
+int rosie_stats(void *L, EngineStats *stats);
+int rosie_gc_step(void *L, int budget, int *finished);
+int rosie_gc_mode(void *L, int mode, int param1, int param2);
 int rosie_alloc_limit(void *L, int *newlimit, int *usage);
 int rosie_config(void *L, str *retvals);
 int rosie_compile(void *L, str *expression, int *pat, str *errors);
+int rosie_compile_cached(void *L, str *expression, int *pat, str *errors);
+int rosie_compile_projected(void *L, str *expression, str *keep, int *pat, str *errors);
 int rosie_free_rplx(void *L, int pat);
 int rosie_match(void *L, int pat, int start, char *encoder, str *input, match *match);
+int rosie_match_into(void *L, int pat, int start, char *encoder, str *input,
+		     byte_ptr buffer, size_t bufsize, size_t *needed, match *match);
+int rosie_match_batch(void *L, int pat, int start, char *encoder,
+		      int n, str *inputs, match *matches);
+int rosie_compile_set(void *L, int *pats, int n, int *set);
+int rosie_free_set(void *L, int set);
+int rosie_match_set(void *L, int set, int start, char *encoder, str *input,
+		    int *matched, match *matches, int *n_matched);
 int rosie_matchfile(void *L, int pat, char *encoder, int wholefileflag,
 		    char *infilename, char *outfilename, char *errfilename,
 		    int *cin, int *cout, int *cerr,
 		    str *err);
+int rosie_matchfile_max(void *L, int pat, char *encoder, int wholefileflag, int maxcount,
+			char *infilename, char *outfilename, char *errfilename,
+			int *cin, int *cout, int *cerr,
+			str *err);
+int rosie_matchfile_parallel(void **engines, int *pats, int n, char *encoder,
+			     char *infilename, char *outfilename, char *errfilename,
+			     int *cin, int *cout, int *cerr,
+			     str *err);
+void *rosie_stream_open(void *L, int pat, char *encoder,
+			int (*callback)(void *context, str *record, match *match),
+			void *context);
+int rosie_stream_feed(void *s, byte_ptr buf, size_t len);
+int rosie_stream_close(void *s, int *cin, int *cout, int *cerr);
 int rosie_trace(void *L, int pat, int start, char *trace_style, str *input, int *matched, str *trace);
 int rosie_load(void *L, int *ok, str *src, str *pkgname, str *errors);
 int rosie_loadfile(void *e, int *ok, str *fn, str *pkgname, str *errors);
 int rosie_import(void *e, int *ok, str *pkgname, str *as, str *actual_pkgname, str *messages);
+int rosie_set_dictionary(void *e, int *ok, str *name, str *entries, str *messages);
 int rosie_read_rcfile(void *e, str *filename, int *file_exists, str *options, str *messages);
 int rosie_execute_rcfile(void *e, str *filename, int *file_exists, int *no_errors, str *messages);
 
@@ -106,6 +157,11 @@ librosie_local = _librosie_config('*local*')
 
 _librosie_name = None
 
+# Garbage collector modes for engine.gc_mode(), as in librosie.h
+GC_INCREMENTAL = 0
+GC_GENERATIONAL = 1             # only when librosie is built with Lua 5.4
+GC_MANUAL = 2
+
 # -----------------------------------------------------------------------------
 # ffi utilities
 
@@ -127,12 +183,47 @@ def _new_cstr(bstring=None):
     else:
         raise ValueError("Unsupported argument type: " + str(type(pystring)))
 
+# Return a rosie string that refers to the contents of input (bytes,
+# bytearray, memoryview, or other buffer) without copying them, and
+# the cffi object that keeps the reference valid.  The caller must
+# hold on to both for as long as librosie may use the string.
+def _str_view(input):
+    Cinput = ffi.new("struct rosie_string *")
+    buf = ffi.from_buffer(input)
+    Cinput.ptr = ffi.cast("byte_ptr", buf)
+    Cinput.len = len(buf)
+    return Cinput, buf
+
 def _read_cstr(cstr_ptr):
     if cstr_ptr.ptr == ffi.NULL:
         return None
     else:
         return bytes(ffi.buffer(cstr_ptr.ptr, cstr_ptr.len)[:])
 
+# With copy false, the match data is returned as a memoryview of the
+# engine's own buffer instead of as bytes.  The view is valid only
+# until the next call of any kind on the same engine, because any call
+# (e.g. compile, load or gc_step) can collect the buffer.
+def _read_match(Cmatch, copy=True):
+    left = Cmatch.leftover
+    abend = Cmatch.abend
+    ttotal = Cmatch.ttotal
+    tmatch = Cmatch.tmatch
+    if Cmatch.data.ptr == ffi.NULL:
+        if Cmatch.data.len == 0:
+            return False, left, abend, ttotal, tmatch
+        elif Cmatch.data.len == 1:
+            return True, left, abend, ttotal, tmatch
+        elif Cmatch.data.len == 2:
+            raise ValueError("invalid output encoder")
+        elif Cmatch.data.len == 4:
+            raise ValueError("invalid compiled pattern")
+    if copy:
+        data = _read_cstr(Cmatch.data)
+    else:
+        data = memoryview(ffi.buffer(Cmatch.data.ptr, Cmatch.data.len))
+    return data, left, abend, ttotal, tmatch
+
 # -----------------------------------------------------------------------------
 
 def load(path = None, **kwargs):
@@ -185,20 +276,60 @@ class engine ():
     A Rosie pattern matching engine is used to load/import RPL code
     (patterns) and to do matching.  Create as many engines as you need.
     '''
-    def __init__(self):
+    # When pool is true, the engine uses librosie's pool allocator.  A
+    # non-zero hard_limit (in bytes) caps the memory used by the engine,
+    # and implies pool.
+    def __init__(self, pool=False, hard_limit=0):
         global _lib
         if not _lib: load()
         Cerrs = _new_cstr()
-        self.engine = _lib.rosie_new(Cerrs)
+        if pool or hard_limit:
+            self.engine = _lib.rosie_new_with_allocator(Cerrs, ffi.NULL, ffi.NULL, hard_limit)
+        else:
+            self.engine = _lib.rosie_new(Cerrs)
         if self.engine == ffi.NULL:
             raise RuntimeError("librosie: " + str(_read_cstr(Cerrs)))
         return
+
+    # Returns a new engine with the same environment as this one, and
+    # for each of the given compiled patterns, the corresponding
+    # compiled pattern in the new engine.  The new engine is booted and
+    # its packages loaded and patterns compiled again, so a clone takes
+    # as long to make as a new engine set up the same way.
+    def clone(self, pats=[]):
+        Cerrs = _new_cstr()
+        new = engine.__new__(engine)
+        new.engine = _lib.rosie_clone(self.engine, Cerrs)
+        if new.engine == ffi.NULL:
+            raise RuntimeError("librosie: " + str(_read_cstr(Cerrs)))
+        new_pats = []
+        for pat in pats:
+            if (pat is None) or (pat.id[0] == 0) or (pat.engine is not self):
+                raise ValueError("invalid compiled pattern")
+            new_pat = rplx(new)
+            new_pat.id[0] = pat.id[0]
+            new_pats.append(new_pat)
+        return new, new_pats
     
-    def compile(self, exp):
+    # With cached true, an expression compiled before is fetched
+    # from the engine's cache of compiled expressions, which is
+    # emptied by load(), import_pkg() and changes to compiler options.
+    # With keep, a list of capture names (or one bytes object holding
+    # names separated by spaces), the matches of the pattern hold only
+    # those captures, under a top-level capture named "*".  Such a
+    # pattern is never taken from the cache.
+    def compile(self, exp, cached=False, keep=None):
         Cerrs = _new_cstr()
         Cexp = _new_cstr(exp)
         pat = rplx(self)
-        ok = _lib.rosie_compile(self.engine, Cexp, pat.id, Cerrs)
+        if keep is not None:
+            if not isinstance(keep, (bytes, bytearray)):
+                keep = b" ".join(keep)
+            Ckeep = _new_cstr(keep or b" ")
+            ok = _lib.rosie_compile_projected(self.engine, Cexp, Ckeep, pat.id, Cerrs)
+        else:
+            compile_fn = _lib.rosie_compile_cached if cached else _lib.rosie_compile
+            ok = compile_fn(self.engine, Cexp, pat.id, Cerrs)
         if ok != 0:
             raise RuntimeError("compile() failed (please report this as a bug)")
         if pat.id[0] == 0:
@@ -249,39 +380,117 @@ class engine ():
         errs = _read_cstr(Cerrs)
         return Csuccess[0], actual_pkgname, errs
 
+    # Entries are a list of bytes or a single bytes value holding one
+    # entry per line.  When entries is None, the file called name is read.
+    def set_dictionary(self, name, entries=None):
+        Cerrs = _new_cstr()
+        Cname = _new_cstr(name)
+        if entries is None:
+            Centries = ffi.NULL
+        elif isinstance(entries, bytes):
+            Centries = _new_cstr(entries)
+        else:
+            Centries = _new_cstr(b"\n".join(entries))
+        Csuccess = ffi.new("int *")
+        ok = _lib.rosie_set_dictionary(self.engine, Csuccess, Cname, Centries, Cerrs)
+        if ok != 0:
+            raise RuntimeError("set_dictionary() failed (please report this as a bug)")
+        errs = _read_cstr(Cerrs)
+        return Csuccess[0], errs
+
     # -----------------------------------------------------------------------------
     # Functions for matching and tracing (debugging)
     # -----------------------------------------------------------------------------
 
-    def match(self, pat, input, start, encoder):
+    # The input (bytes or any other buffer) is not copied.  With copy
+    # false, the match data is returned as a memoryview that is valid
+    # only until the next call of any kind on this engine.
+    def match(self, pat, input, start, encoder, copy=True):
         if (pat is None) or (pat.id[0] == 0):
             raise ValueError("invalid compiled pattern")
         Cmatch = ffi.new("struct rosie_matchresult *")
-        Cinput = _new_cstr(input)
+        Cinput, inbuf = _str_view(input)
         ok = _lib.rosie_match(self.engine, pat.id[0], start, encoder, Cinput, Cmatch)
         if ok != 0:
             raise RuntimeError("match() failed (please report this as a bug)")
-        left = Cmatch.leftover
-        abend = Cmatch.abend
-        ttotal = Cmatch.ttotal
-        tmatch = Cmatch.tmatch
+        return _read_match(Cmatch, copy)
+
+    # Like match(), but the match data is written into buffer (a
+    # bytearray or other writable buffer), and returned as a
+    # memoryview of it.  Raises BufferError, with the needed size as
+    # its second argument, when the buffer is too small.
+    def match_into(self, pat, input, start, encoder, buffer):
+        if (pat is None) or (pat.id[0] == 0):
+            raise ValueError("invalid compiled pattern")
+        Cmatch = ffi.new("struct rosie_matchresult *")
+        Cinput, inbuf = _str_view(input)
+        outbuf = ffi.from_buffer(buffer)
+        Cneeded = ffi.new("size_t *")
+        ok = _lib.rosie_match_into(self.engine, pat.id[0], start, encoder, Cinput,
+                                   ffi.cast("byte_ptr", outbuf), len(buffer), Cneeded, Cmatch)
+        if ok != 0:
+            raise RuntimeError("match_into() failed (please report this as a bug)")
         if Cmatch.data.ptr == ffi.NULL:
-            if Cmatch.data.len == 0:
-                return False, left, abend, ttotal, tmatch
-            elif Cmatch.data.len == 1:
-                return True, left, abend, ttotal, tmatch
-            elif Cmatch.data.len == 2:
-                raise ValueError("invalid output encoder")
-            elif Cmatch.data.len == 4:
+            if Cmatch.data.len == 5:
+                raise BufferError("buffer too small for match data", Cneeded[0])
+            return _read_match(Cmatch)
+        return (memoryview(buffer)[0:Cneeded[0]], Cmatch.leftover, Cmatch.abend,
+                Cmatch.ttotal, Cmatch.tmatch)
+
+    # Match each of the inputs (a list of bytes or other buffers),
+    # returning a list of (data, leftover, abend, ttotal, tmatch)
+    # tuples like those returned by match().  A single call into
+    # librosie processes the whole list, and the inputs are not
+    # copied.  With copy false, the data are memoryviews that are
+    # valid only until the next call of any kind on this engine.
+    def match_batch(self, pat, inputs, start, encoder, copy=True):
+        if (pat is None) or (pat.id[0] == 0):
+            raise ValueError("invalid compiled pattern")
+        n = len(inputs)
+        if n == 0:
+            return []
+        Cinputs = ffi.new("struct rosie_string[]", n)
+        Cmatches = ffi.new("struct rosie_matchresult[]", n)
+        buffers = [ffi.from_buffer(input) for input in inputs]
+        for i in range(n):
+            Cinputs[i].ptr = ffi.cast("byte_ptr", buffers[i])
+            Cinputs[i].len = len(buffers[i])
+        ok = _lib.rosie_match_batch(self.engine, pat.id[0], start, encoder, n, Cinputs, Cmatches)
+        if ok != 0:
+            raise RuntimeError("match_batch() failed (please report this as a bug)")
+        return [_read_match(Cmatches[i], copy) for i in range(n)]
+
+    # Match the records of data (bytes or other buffer) that end at
+    # the offsets in ends, i.e. record i is data[ends[i-1]:ends[i]]
+    # and record 0 starts at 0.  No record is copied, and there is a
+    # single call into librosie.  Otherwise like match_batch().
+    def match_records(self, pat, data, ends, start, encoder, copy=True):
+        view = memoryview(data)
+        bounds = zip([0] + list(ends[:-1]), ends)
+        return self.match_batch(pat, [view[s:e] for s, e in bounds], start, encoder, copy)
+
+    # Compile a list of rplx objects into a pattern_set, which matches
+    # all of them against an input in one run of a combined program.
+    # Each pattern is still tried in turn, so the cost of a match grows
+    # with the number of patterns.
+    def compile_set(self, pats):
+        for pat in pats:
+            if (pat is None) or (pat.id[0] == 0):
                 raise ValueError("invalid compiled pattern")
-        data = _read_cstr(Cmatch.data)
-        return data, left, abend, ttotal, tmatch
+        Cpats = ffi.new("int[]", [pat.id[0] for pat in pats])
+        s = pattern_set(self, pats)
+        ok = _lib.rosie_compile_set(self.engine, Cpats, len(pats), s.id)
+        if ok != 0:
+            raise RuntimeError("compile_set() failed (please report this as a bug)")
+        if s.id[0] == 0:
+            raise ValueError("invalid compiled pattern")
+        return s
 
     def trace(self, pat, input, start, style):
         if pat.id[0] == 0:
             raise ValueError("invalid compiled pattern")
         Cmatched = ffi.new("int *")
-        Cinput = _new_cstr(input)
+        Cinput, inbuf = _str_view(input)
         Ctrace = _new_cstr()
         ok = _lib.rosie_trace(self.engine, pat.id[0], start, style, Cinput, Cmatched, Ctrace)
         if ok != 0:
@@ -299,7 +508,8 @@ class engine ():
                   infile=None,  # stdin
                   outfile=None, # stdout
                   errfile=None, # stderr
-                  wholefile=False):
+                  wholefile=False,
+                  maxcount=0):  # > 0 means stop after that many matches
         if pat.id[0] == 0:
             raise ValueError("invalid compiled pattern")
         Ccin = ffi.new("int *")
@@ -307,14 +517,15 @@ class engine ():
         Ccerr = ffi.new("int *")
         wff = 1 if wholefile else 0
         Cerrmsg = _new_cstr()
-        ok = _lib.rosie_matchfile(self.engine,
-                                 pat.id[0],
-                                 encoder,
-                                 wff,
-                                 infile or b"",
-                                 outfile or b"",
-                                 errfile or b"",
-                                 Ccin, Ccout, Ccerr, Cerrmsg)
+        ok = _lib.rosie_matchfile_max(self.engine,
+                                      pat.id[0],
+                                      encoder,
+                                      wff,
+                                      maxcount,
+                                      infile or b"",
+                                      outfile or b"",
+                                      errfile or b"",
+                                      Ccin, Ccout, Ccerr, Cerrmsg)
         if ok != 0:
             raise RuntimeError("matchfile() failed: " + str(_read_cstr(Cerrmsg)))
 
@@ -325,10 +536,26 @@ class engine ():
                 raise ValueError(str(_read_cstr(Cerrmsg))) # file i/o error
             elif Ccout[0] == 4:
                 raise ValueError("invalid compiled pattern (already freed?)")
+            elif Ccout[0] == 6:
+                raise ValueError("compressed input could not be decompressed")
             else:
                 raise ValueError("unknown error caused matchfile to fail")
         return Ccin[0], Ccout[0], Ccerr[0]
 
+    # Count the matching lines of infile without writing any output.
+    def countfile(self, pat, infile=None, wholefile=False, maxcount=0):
+        cin, cout, cerr = self.matchfile(pat, b"count", infile, b"", b"", wholefile, maxcount)
+        return cout
+
+    # True if any line of infile matches.  Stops at the first match.
+    def anymatch(self, pat, infile=None, wholefile=False):
+        return self.countfile(pat, infile, wholefile, 1) > 0
+
+    # Returns a match_stream that matches each line of the data fed to
+    # it, calling callback(record, data) for each one.
+    def stream(self, pat, encoder, callback):
+        return match_stream(self, pat, encoder, callback)
+
     # -----------------------------------------------------------------------------
     # Functions for reading and processing rcfile (init file) contents
     # -----------------------------------------------------------------------------
@@ -456,6 +683,89 @@ class engine ():
             raise RuntimeError("libpath() failed (please report this as a bug)")
         return _read_cstr(libpath_arg) if libpath is None else None
 
+    # Grammars compiled while memoization is on do not retry a rule
+    # where it failed before.  A rule that makes no captures is also
+    # not retried where it succeeded; one that captures is.
+    def memoize(self, flag=True):
+        ok = _lib.rosie_set_memoize(self.engine, 1 if flag else 0)
+        if ok != 0:
+            raise RuntimeError("memoize() failed (please report this as a bug)")
+
+    # Compile the bindings of packages imported from now on only when
+    # they are first referenced.
+    def lazy_import(self, flag=True):
+        ok = _lib.rosie_set_lazy_import(self.engine, 1 if flag else 0)
+        if ok != 0:
+            raise RuntimeError("lazy_import() failed (please report this as a bug)")
+
+    # Cache the parse trees of rpl in the directory cachedir (which
+    # must exist), or stop caching when cachedir is None.  Loading rpl
+    # from the cache skips only the parsing, not the compiling.
+    def set_cachedir(self, cachedir=None):
+        ok = _lib.rosie_set_cachedir(self.engine, _new_cstr(cachedir) if cachedir else ffi.NULL)
+        if ok != 0:
+            raise RuntimeError("set_cachedir() failed (please report this as a bug)")
+
+    # A match that takes more than steps steps or more than ms
+    # milliseconds returns with abend set.  Zero means no limit.
+    # Whether a pattern is limited is fixed when it is compiled: only
+    # patterns compiled (or loaded) while there is a limit are limited.
+    def match_limits(self, steps=0, ms=0):
+        ok = _lib.rosie_match_limits(self.engine, steps, ms)
+        if ok != 0:
+            raise RuntimeError("match_limits() failed (please report this as a bug)")
+
+    # Count attempts, matches, and failures for each named pattern in
+    # the patterns compiled (or imported) from now on, and the bytes
+    # consumed by and time spent in each when time is true (slower).
+    # Resets the counters.
+    def profile(self, flag=True, time=False):
+        ok = _lib.rosie_profile(self.engine, (2 if time else 1) if flag else 0)
+        if ok != 0:
+            raise RuntimeError("profile() failed (please report this as a bug)")
+
+    # Return the profiling counters as a list of dictionaries, with
+    # the most expensive pattern first.
+    def profile_report(self):
+        Creport = _new_cstr()
+        ok = _lib.rosie_profile_report(self.engine, Creport)
+        if ok != 0:
+            raise RuntimeError("profile_report() failed (please report this as a bug)")
+        return json.loads(_read_cstr(Creport)) or []
+
+    _stats_fields = ['matches', 'matched', 'bytes', 'ttotal_us', 'tmatch_us',
+                     'gc_forced', 'gc_us', 'heap_kb', 'peak_heap_kb',
+                     'lock_waits', 'lock_wait_us', 'gc_steps', 'gc_step_us']
+
+    # Return the engine's cumulative counters (matches, bytes matched,
+    # match times, forced collections, heap size, and waits for the
+    # engine lock) as a dictionary.
+    def stats(self):
+        Cstats = ffi.new("EngineStats *")
+        ok = _lib.rosie_stats(self.engine, Cstats)
+        if ok != 0:
+            raise RuntimeError("stats() failed (please report this as a bug)")
+        d = dict((f, getattr(Cstats, f)) for f in self._stats_fields)
+        d['unmatched'] = d['matches'] - d['matched']
+        return d
+
+    # Do a bounded amount of garbage collection work (budget is in KB
+    # of allocation; zero means one basic step), e.g. between batches
+    # of matches.  Returns True when a collection cycle finished.
+    def gc_step(self, budget=0):
+        Cfinished = ffi.new("int *")
+        ok = _lib.rosie_gc_step(self.engine, budget, Cfinished)
+        if ok != 0:
+            raise ValueError("gc_step() failed: invalid budget")
+        return Cfinished[0] != 0
+
+    # Set the collector mode (GC_INCREMENTAL, GC_GENERATIONAL or
+    # GC_MANUAL) and its parameters.  Zero leaves a parameter unchanged.
+    def gc_mode(self, mode, param1=0, param2=0):
+        ok = _lib.rosie_gc_mode(self.engine, mode, param1, param2)
+        if ok != 0:
+            raise ValueError("gc_mode() failed: unsupported mode or invalid parameters")
+
     def alloc_limit(self, newlimit=None):
         limit_arg = ffi.new("int *")
         usage_arg = ffi.new("int *")
@@ -479,6 +789,140 @@ class engine ():
 
 # -----------------------------------------------------------------------------
 
+# Match each line of infile using several engines in parallel.  Each
+# item in pats must be the same expression, compiled in a different
+# engine.  Returns (cin, cout, cerr) like engine.matchfile().
+def matchfile_parallel(pats, encoder, infile, outfile=None, errfile=None):
+    n = len(pats)
+    if n == 0:
+        raise ValueError("no compiled patterns")
+    for pat in pats:
+        if (pat is None) or (pat.id[0] == 0):
+            raise ValueError("invalid compiled pattern")
+    if len(set([pat.engine for pat in pats])) != n:
+        raise ValueError("each compiled pattern must come from a different engine")
+    Cengines = ffi.new("void *[]", [pat.engine.engine for pat in pats])
+    Cpats = ffi.new("int[]", [pat.id[0] for pat in pats])
+    Ccin = ffi.new("int *")
+    Ccout = ffi.new("int *")
+    Ccerr = ffi.new("int *")
+    Cerrmsg = _new_cstr()
+    ok = _lib.rosie_matchfile_parallel(Cengines, Cpats, n, encoder,
+                                       infile,
+                                       outfile or b"",
+                                       errfile or b"",
+                                       Ccin, Ccout, Ccerr, Cerrmsg)
+    if ok != 0:
+        raise RuntimeError("matchfile_parallel() failed: " + str(_read_cstr(Cerrmsg)))
+    if Ccin[0] == -1:       # Error occurred
+        if Ccout[0] == 2:
+            raise ValueError("invalid encoder")
+        elif Ccout[0] == 3:
+            raise ValueError(str(_read_cstr(Cerrmsg))) # file i/o error
+        elif Ccout[0] == 4:
+            raise ValueError("invalid compiled pattern (already freed?)")
+        else:
+            raise ValueError("unknown error caused matchfile_parallel to fail")
+    return Ccin[0], Ccout[0], Ccerr[0]
+
+# -----------------------------------------------------------------------------
+
+# Lines may be split across calls to feed().  For each line, callback
+# is called with the line (without its newline) and the match data
+# (as returned by engine.match).  An exception raised by the callback
+# stops the feed and is re-raised by feed() or close().
+class match_stream(object):
+    def __init__(self, engine, pat, encoder, callback):
+        if (pat is None) or (pat.id[0] == 0):
+            raise ValueError("invalid compiled pattern")
+        self.error = None
+        def handler(context, Crecord, Cmatch):
+            try:
+                data = _read_match(Cmatch)[0]
+                callback(bytes(ffi.buffer(Crecord.ptr, Crecord.len)), data)
+                return 0
+            except Exception as e:
+                self.error = e
+                return -1
+        self.handler = ffi.callback("int(void *, str *, match *)", handler)
+        self.engine = engine        # keep the engine and pattern alive
+        self.pat = pat
+        self.stream = _lib.rosie_stream_open(engine.engine, pat.id[0], encoder, self.handler, ffi.NULL)
+        if self.stream == ffi.NULL:
+            raise ValueError("invalid compiled pattern")
+
+    def _check(self, ok):
+        if self.error:
+            e = self.error
+            self.error = None
+            raise e
+        if ok == 2:
+            raise ValueError("invalid encoder")
+        elif ok == 4:
+            raise ValueError("invalid compiled pattern (already freed?)")
+        elif ok != 0:
+            raise RuntimeError("stream failed (please report this as a bug)")
+
+    def feed(self, data):
+        if self.stream is None:
+            raise ValueError("stream is closed")
+        buf = ffi.from_buffer(data)
+        self._check(_lib.rosie_stream_feed(self.stream, ffi.cast("byte_ptr", buf), len(data)))
+
+    # Returns (cin, cout, cerr) like engine.matchfile()
+    def close(self):
+        if self.stream is None:
+            raise ValueError("stream is closed")
+        Ccin = ffi.new("int *")
+        Ccout = ffi.new("int *")
+        Ccerr = ffi.new("int *")
+        s = self.stream
+        self.stream = None
+        self._check(_lib.rosie_stream_close(s, Ccin, Ccout, Ccerr))
+        return Ccin[0], Ccout[0], Ccerr[0]
+
+    def __del__(self):
+        if getattr(self, 'stream', None) is not None:
+            s = self.stream
+            self.stream = None
+            _lib.rosie_stream_close(s, ffi.NULL, ffi.NULL, ffi.NULL)
+
+# -----------------------------------------------------------------------------
+
+class pattern_set(object):
+    def __init__(self, engine, pats):
+        self.id = ffi.new("int *")
+        self.engine = engine
+        self.pats = list(pats)      # keep the patterns alive
+
+    def __del__(self):
+        if self.id[0] and self.engine.engine:
+            _lib.rosie_free_set(self.engine.engine, self.id[0])
+
+    # Return the list of patterns in the set that match input at
+    # start, in set order.  When an encoder is given, return instead a
+    # list of (pattern, data) pairs, where data is the match data.
+    def match(self, input, start=1, encoder=None):
+        n = max(len(self.pats), 1)
+        Cinput = _new_cstr(input)
+        Cmatched = ffi.new("int[]", n)
+        Cmatches = ffi.new("struct rosie_matchresult[]", n) if encoder else ffi.NULL
+        Cn = ffi.new("int *")
+        ok = _lib.rosie_match_set(self.engine.engine, self.id[0], start,
+                                  encoder or ffi.NULL, Cinput, Cmatched, Cmatches, Cn)
+        if ok == 4:
+            raise ValueError("invalid pattern set")
+        elif ok != 0:
+            raise RuntimeError("match_set() failed (please report this as a bug)")
+        by_id = dict((pat.id[0], pat) for pat in self.pats)
+        if not encoder:
+            return [by_id[Cmatched[i]] for i in range(Cn[0])]
+        if Cn[0] == 0:
+            _read_match(Cmatches[0])     # raises an exception for an invalid encoder
+        return [(by_id[Cmatched[i]], _read_match(Cmatches[i])[0]) for i in range(Cn[0])]
+
+# -----------------------------------------------------------------------------
+
 class rplx(object):    
     def __init__(self, engine):
         self.id = ffi.new("int *")
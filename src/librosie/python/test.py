@@ -6,7 +6,7 @@
 from __future__ import unicode_literals, print_function
 
 import unittest
-import sys, os, json
+import sys, os, json, threading, gzip
 import rosie
 
 # Notes
@@ -39,6 +39,65 @@ class RosieInitTest(unittest.TestCase):
         path = rosie.librosie_path()
         assert(path)
 
+        # Engines using the pool allocator, with and without a hard limit
+        for e in [rosie.engine(pool=True), rosie.engine(hard_limit=512*1024*1024)]:
+            ok, pkgname, errs = e.import_pkg(b'net')
+            assert(ok)
+            pat, errs = e.compile(b"net.ipv4")
+            m, left, abend, tt, tm = e.match(pat, b"1.2.3.4", 1, b"json")
+            assert(json.loads(m)['type'] == "net.ipv4")
+        # Not enough memory to boot
+        self.assertRaises(RuntimeError, rosie.engine, hard_limit=64*1024)
+
+class RosieCloneTest(unittest.TestCase):
+
+    engine = None
+
+    def setUp(self):
+        rosie.load(librosiedir, quiet=True)
+        self.engine = rosie.engine()
+
+    def tearDown(self):
+        pass
+
+    def test(self):
+        ok, pkgname, errs = self.engine.import_pkg(b'net')
+        self.assertTrue(ok)
+        ok, pkgname, errs = self.engine.load(b'package x; foo = "foo"')
+        self.assertTrue(ok)
+        ip, errs = self.engine.compile(b"net.ipv4")
+        self.assertTrue(ip)
+        tmp, errs = self.engine.compile(b"[:digit:]")
+        self.assertTrue(tmp)
+        foo, errs = self.engine.compile(b"x.foo")
+        self.assertTrue(foo)
+        del tmp                 # leave a free rplx index in the original engine
+
+        new, pats = self.engine.clone([ip, foo])
+        self.assertTrue(new.engine)
+        self.assertTrue(len(pats) == 2)
+        new_ip, new_foo = pats
+        self.assertTrue(new_ip.valid())
+        self.assertTrue(new_ip.id[0] == ip.id[0])
+
+        m, left, abend, tt, tm = new.match(new_ip, b"1.2.3.4", 1, b"json")
+        self.assertTrue(m)
+        self.assertTrue(json.loads(m)['type'] == "net.ipv4")
+        m, left, abend, tt, tm = new.match(new_foo, b"foo", 1, b"json")
+        self.assertTrue(m)
+        self.assertTrue(json.loads(m)['type'] == "x.foo")
+
+        # The clone is independent of the original
+        ok, pkgname, errs = new.load(b'package x; foo = "bar"')
+        self.assertTrue(ok)
+        m, left, abend, tt, tm = self.engine.match(foo, b"foo", 1, b"json")
+        self.assertTrue(m)
+        bar, errs = new.compile(b"x.foo")
+        m, left, abend, tt, tm = new.match(bar, b"bar", 1, b"json")
+        self.assertTrue(m)
+
+        self.assertRaises(ValueError, self.engine.clone, [bar])
+
 class RosieLoadTest(unittest.TestCase):
 
     engine = None
@@ -181,6 +240,397 @@ class RosieAlloclimitTest(unittest.TestCase):
         limit, usage = self.engine.alloc_limit()
         self.assertTrue(limit == 8199)
 
+class RosieMemoizeTest(unittest.TestCase):
+
+    engine = None
+
+    def setUp(self):
+        rosie.load(librosiedir, quiet=True)
+        self.engine = rosie.engine()
+
+    def tearDown(self):
+        pass
+
+    def test(self):
+        self.engine.memoize(True)
+        ok, pkgname, errs = self.engine.load(b'grammar alias X = {"a" X "b"} / {"a" X "c"} / "a" in g = X end')
+        self.assertTrue(ok)
+        g, errs = self.engine.compile(b"g")
+        self.assertTrue(g.valid())
+        m, left, abend, tt, tm = self.engine.match(g, b"a" * 30 + b"c" * 29, 1, b"json")
+        self.assertTrue(m)
+        self.assertTrue(left == 0)
+        self.engine.memoize(False)
+        # A clone replays the setting along with the load
+        new, _ = self.engine.clone()
+        self.assertTrue(new)
+        new_g, errs = new.compile(b"g")
+        m, left, abend, tt, tm = new.match(new_g, b"aaacb", 1, b"json")
+        self.assertTrue(m)
+        self.assertTrue(left == 0)
+
+class RosieMatchLimitsTest(unittest.TestCase):
+
+    engine = None
+
+    def setUp(self):
+        rosie.load(librosiedir, quiet=True)
+        self.engine = rosie.engine()
+
+    def tearDown(self):
+        pass
+
+    def test(self):
+        self.engine.match_limits(10000, 0)
+        ok, pkgname, errs = self.engine.load(b'grammar alias X = {"a" X "b"} / {"a" X "c"} / "a" in g = X end')
+        self.assertTrue(ok)
+        g, errs = self.engine.compile(b"g")
+        self.assertTrue(g.valid())
+        m, left, abend, tt, tm = self.engine.match(g, b"a" * 30 + b"c" * 29, 1, b"json")
+        self.assertTrue(abend)
+        m, left, abend, tt, tm = self.engine.match(g, b"aaacc", 1, b"json")
+        self.assertTrue(m)
+        self.assertFalse(abend)
+        self.engine.match_limits(0, 50)
+        m, left, abend, tt, tm = self.engine.match(g, b"a" * 40 + b"c" * 39, 1, b"json")
+        self.assertTrue(abend)
+        self.engine.match_limits(0, 0)
+
+class RosieProfileTest(unittest.TestCase):
+
+    engine = None
+
+    def setUp(self):
+        rosie.load(librosiedir, quiet=True)
+        self.engine = rosie.engine()
+
+    def tearDown(self):
+        pass
+
+    def test(self):
+        self.engine.profile(True)
+        ok, pkgname, errs = self.engine.load(b'd = [:digit:]+; ds = d {"," d}*')
+        self.assertTrue(ok)
+        ds, errs = self.engine.compile(b"ds")
+        m, left, abend, tt, tm = self.engine.match(ds, b"1,22,x", 1, b"json")
+        self.assertTrue(m)
+        self.assertTrue(left == 2)
+        report = dict((r['name'], r) for r in self.engine.profile_report())
+        self.assertTrue(report['d']['attempts'] == 3)
+        self.assertTrue(report['d']['matches'] == 2)
+        self.assertTrue(report['d']['failures'] == 1)
+        self.assertTrue(report['d']['bytes'] == 0)
+        self.engine.profile(True, time=True)
+        ok, pkgname, errs = self.engine.load(b'd2 = [:digit:]+; ds2 = d2 {"," d2}*')
+        ds2, errs = self.engine.compile(b"ds2")
+        m, left, abend, tt, tm = self.engine.match(ds2, b"1,22,x", 1, b"json")
+        report = dict((r['name'], r) for r in self.engine.profile_report())
+        self.assertTrue(report['d2']['attempts'] == 3)
+        self.assertTrue(report['d2']['bytes'] == 3)
+        self.engine.profile(False)
+        self.assertTrue(self.engine.profile_report() == [])
+
+class RosieZeroCopyTest(unittest.TestCase):
+
+    engine = None
+
+    def setUp(self):
+        rosie.load(librosiedir, quiet=True)
+        self.engine = rosie.engine()
+
+    def tearDown(self):
+        pass
+
+    def test(self):
+        digits, errs = self.engine.compile(b"[:digit:]+")
+        self.assertTrue(digits)
+        # Inputs may be any buffer
+        m, left, abend, tt, tm = self.engine.match(digits, bytearray(b"123 "), 1, b"json")
+        self.assertTrue(m)
+        self.assertTrue(left == 1)
+        m, left, abend, tt, tm = self.engine.match(digits, memoryview(b"x123 45")[1:], 1, b"json")
+        self.assertTrue(left == 3)
+        # Data returned without a copy
+        m, left, abend, tt, tm = self.engine.match(digits, b"42", 1, b"json", copy=False)
+        self.assertTrue(isinstance(m, memoryview))
+        self.assertTrue(json.loads(bytes(m))['data'] == '42')
+        m, left, abend, tt, tm = self.engine.match(digits, b"x", 1, b"json", copy=False)
+        self.assertFalse(m)
+        # Records in one buffer
+        results = self.engine.match_records(digits, b"12ab345", [2, 4, 7], 1, b"line")
+        self.assertTrue(len(results) == 3)
+        self.assertTrue(results[0][0] == b"12")
+        self.assertFalse(results[1][0])
+        self.assertTrue(results[2][0] == b"345")
+
+class RosieCompileCacheTest(unittest.TestCase):
+
+    engine = None
+
+    def setUp(self):
+        rosie.load(librosiedir, quiet=True)
+        self.engine = rosie.engine()
+
+    def tearDown(self):
+        pass
+
+    def test(self):
+        ok, pkgname, errs = self.engine.load(b'd = [:digit:]')
+        self.assertTrue(ok)
+        d1, errs = self.engine.compile(b"d", cached=True)
+        d2, errs = self.engine.compile(b"d", cached=True)
+        self.assertTrue(d1 and d2)
+        self.assertTrue(d1.id[0] != d2.id[0])
+        m, left, abend, tt, tm = self.engine.match(d2, b"12", 1, b"json")
+        self.assertTrue(m)
+        self.assertTrue(left == 1)
+        del d1
+        m, left, abend, tt, tm = self.engine.match(d2, b"12", 1, b"json")
+        self.assertTrue(left == 1)
+        # A load empties the cache
+        ok, pkgname, errs = self.engine.load(b'd = [:digit:]+')
+        self.assertTrue(ok)
+        d3, errs = self.engine.compile(b"d", cached=True)
+        m, left, abend, tt, tm = self.engine.match(d3, b"12", 1, b"json")
+        self.assertTrue(m)
+        self.assertTrue(left == 0)
+        bad, errs = self.engine.compile(b"[:nosuchclass:]", cached=True)
+        self.assertFalse(bad)
+        self.assertTrue(errs)
+
+class RosieProjectionTest(unittest.TestCase):
+
+    engine = None
+
+    def setUp(self):
+        rosie.load(librosiedir, quiet=True)
+        self.engine = rosie.engine()
+
+    def tearDown(self):
+        pass
+
+    def test(self):
+        ok, pkgname, errs = self.engine.load(b'd = [:digit:]+; w = [:alpha:]+; p = {d "=" w}; ps = p+')
+        self.assertTrue(ok)
+        full, errs = self.engine.compile(b"ps")
+        m, left, abend, tt, tm = self.engine.match(full, b"1=a 2=b", 1, b"json")
+        full_m = json.loads(m)
+        self.assertTrue(full_m['type'] == "ps")
+        self.assertTrue(full_m['subs'][0]['type'] == "p")
+        ws, errs = self.engine.compile(b"ps", keep=[b"w"])
+        self.assertTrue(ws)
+        m, left, abend, tt, tm = self.engine.match(ws, b"1=a 2=b", 1, b"json")
+        self.assertTrue(m)
+        self.assertTrue(left == 0)
+        m = json.loads(m)
+        self.assertTrue(m['type'] == "*")
+        self.assertTrue(m['e'] == full_m['e'])
+        self.assertTrue([sub['type'] for sub in m['subs']] == ["w", "w"])
+        self.assertTrue([sub['data'] for sub in m['subs']] == ["a", "b"])
+        # Kept captures hold only their kept subs
+        pw, errs = self.engine.compile(b"ps", keep=b"p w")
+        m, left, abend, tt, tm = self.engine.match(pw, b"1=a", 1, b"json")
+        m = json.loads(m)
+        self.assertTrue(m['subs'][0]['type'] == "p")
+        self.assertTrue([sub['type'] for sub in m['subs'][0]['subs']] == ["w"])
+        none, errs = self.engine.compile(b"ps", keep=[])
+        m, left, abend, tt, tm = self.engine.match(none, b"1=a", 1, b"json")
+        self.assertTrue(not json.loads(m).get('subs'))
+        # A clone keeps the projection
+        new, pats = self.engine.clone([ws])
+        m, left, abend, tt, tm = new.match(pats[0], b"1=a", 1, b"json")
+        self.assertTrue([sub['type'] for sub in json.loads(m)['subs']] == ["w"])
+        # A grammar compiled with profiling counters is projected whole, keeping them
+        self.engine.profile(True)
+        ok, pkgname, errs = self.engine.load(b'grammar pr = {d "=" w} in gs = {pr {"," gs}?} end')
+        self.assertTrue(ok)
+        gw, errs = self.engine.compile(b"gs", keep=[b"w"])
+        m, left, abend, tt, tm = self.engine.match(gw, b"1=a,2=b", 1, b"json")
+        self.assertTrue(m)
+        self.assertTrue(left == 0)
+        report = dict((r['name'], r) for r in self.engine.profile_report())
+        self.assertTrue(report['pr']['matches'] == 2)
+        self.engine.profile(False)
+
+class RosieDictionaryTest(unittest.TestCase):
+
+    engine = None
+
+    def setUp(self):
+        rosie.load(librosiedir, quiet=True)
+        self.engine = rosie.engine()
+
+    def tearDown(self):
+        pass
+
+    def test(self):
+        ok, errs = self.engine.set_dictionary(b"colors", [b"red", b"redder", b"blue"])
+        self.assertTrue(ok)
+        longest, errs = self.engine.compile(b"dictionary:#colors")
+        self.assertTrue(longest)
+        m, left, abend, tt, tm = self.engine.match(longest, b"redder!", 1, b"json")
+        self.assertTrue(m)
+        self.assertTrue(left == 1)
+        shortest, errs = self.engine.compile(b"dictionary:(#colors, #shortest)")
+        m, left, abend, tt, tm = self.engine.match(shortest, b"redder!", 1, b"json")
+        self.assertTrue(left == 4)
+        m, left, abend, tt, tm = self.engine.match(longest, b"green", 1, b"json")
+        self.assertFalse(m)
+        # Inside an ordinary pattern, and with findall
+        ok, pkgname, errs = self.engine.load(b'color = dictionary:#colors')
+        self.assertTrue(ok)
+        pat, errs = self.engine.compile(b"findall:color")
+        m, left, abend, tt, tm = self.engine.match(pat, b"a blue and red sky", 1, b"json")
+        m = json.loads(m)
+        self.assertTrue([sub['data'] for sub in m['subs']] == ["blue", "red"])
+        # New entries are seen by patterns already compiled
+        ok, errs = self.engine.set_dictionary(b"colors", b"green\nsky\n")
+        self.assertTrue(ok)
+        m, left, abend, tt, tm = self.engine.match(pat, b"a blue and red sky", 1, b"json")
+        m = json.loads(m)
+        self.assertTrue([sub['data'] for sub in m['subs']] == ["sky"])
+        # A clone has the same dictionary
+        new, pats = self.engine.clone([pat])
+        m, left, abend, tt, tm = new.match(pats[0], b"green sky", 1, b"json")
+        self.assertTrue([sub['data'] for sub in json.loads(m)['subs']] == ["green", "sky"])
+        # A dictionary that is not defined is read from a file
+        ok, errs = self.engine.set_dictionary(b"/no/such/dictionary")
+        self.assertFalse(ok)
+        self.assertTrue(errs)
+        nope, errs = self.engine.compile(b"dictionary:#nosuchdictionary")
+        self.assertFalse(nope)
+
+class RosieStatsTest(unittest.TestCase):
+
+    engine = None
+
+    def setUp(self):
+        rosie.load(librosiedir, quiet=True)
+        self.engine = rosie.engine()
+
+    def tearDown(self):
+        pass
+
+    def test(self):
+        s = self.engine.stats()
+        self.assertTrue(s['matches'] == 0)
+        self.assertTrue(s['heap_kb'] > 0)
+        digits, errs = self.engine.compile(b"[:digit:]+")
+        self.assertTrue(digits)
+        m, left, abend, tt, tm = self.engine.match(digits, b"123", 1, b"json")
+        self.assertTrue(m)
+        m, left, abend, tt, tm = self.engine.match(digits, b"abcde", 1, b"json")
+        self.assertFalse(m)
+        s = self.engine.stats()
+        self.assertTrue(s['matches'] == 2)
+        self.assertTrue(s['matched'] == 1)
+        self.assertTrue(s['unmatched'] == 1)
+        self.assertTrue(s['bytes'] == 8)
+        self.assertTrue(s['ttotal_us'] >= s['tmatch_us'])
+        self.assertTrue(s['peak_heap_kb'] >= s['heap_kb'])
+
+class RosieGCTest(unittest.TestCase):
+
+    engine = None
+
+    def setUp(self):
+        rosie.load(librosiedir, quiet=True)
+        self.engine = rosie.engine()
+
+    def tearDown(self):
+        pass
+
+    def test(self):
+        digits, errs = self.engine.compile(b"[:digit:]+")
+        self.assertTrue(digits)
+        self.engine.gc_mode(rosie.GC_MANUAL)
+        for i in range(100):
+            m, left, abend, tt, tm = self.engine.match(digits, b"12345", 1, b"json")
+            self.assertTrue(m)
+        finished = False
+        for i in range(10000):
+            if self.engine.gc_step(64):
+                finished = True
+                break
+        self.assertTrue(finished)
+        s = self.engine.stats()
+        self.assertTrue(s['gc_steps'] >= 1)
+        self.assertTrue(s['gc_steps'] == i + 1)
+        # The clone is made in manual mode too
+        clone, pats = self.engine.clone()
+        self.assertTrue(clone)
+        self.assertTrue(clone.gc_step(0) in [True, False])
+        self.engine.gc_mode(rosie.GC_INCREMENTAL, 150, 300)
+        self.engine.gc_step()
+        self.assertRaises(ValueError, self.engine.gc_step, -1)
+        self.assertRaises(ValueError, self.engine.gc_mode, 99)
+        self.assertRaises(ValueError, self.engine.gc_mode, rosie.GC_INCREMENTAL, -1)
+
+class RosieLazyImportTest(unittest.TestCase):
+
+    engine = None
+
+    def setUp(self):
+        rosie.load(librosiedir, quiet=True)
+        self.engine = rosie.engine()
+
+    def tearDown(self):
+        pass
+
+    def test(self):
+        self.engine.lazy_import(True)
+        ok, pkgname, errs = self.engine.import_pkg(b'net')
+        self.assertTrue(ok)
+        ipv4, errs = self.engine.compile(b"net.ipv4")
+        self.assertTrue(ipv4)
+        m, left, abend, tt, tm = self.engine.match(ipv4, b"192.168.1.1 x", 1, b"json")
+        self.assertTrue(m)
+        self.assertTrue(left == 2)
+        self.assertTrue(json.loads(m)['type'] == 'net.ipv4')
+        # net.any refers to bindings in net and in its dependencies
+        netany, errs = self.engine.compile(b"net.any")
+        self.assertTrue(netany)
+        m, left, abend, tt, tm = self.engine.match(netany, b"www.ibm.com", 1, b"json")
+        self.assertTrue(m)
+        self.assertTrue(left == 0)
+        # A clone imports lazily, too
+        new, _ = self.engine.clone()
+        self.assertTrue(new)
+        ipv4, errs = new.compile(b"net.ipv4")
+        m, left, abend, tt, tm = new.match(ipv4, b"10.0.0.1", 1, b"json")
+        self.assertTrue(m)
+        self.assertTrue(left == 0)
+
+class RosieCacheDirTest(unittest.TestCase):
+
+    engine = None
+
+    def setUp(self):
+        rosie.load(librosiedir, quiet=True)
+        self.engine = rosie.engine()
+
+    def tearDown(self):
+        pass
+
+    def test(self):
+        cachedir = "/tmp/rosie-parsecache-test"
+        if not os.path.isdir(cachedir): os.mkdir(cachedir)
+        for name in os.listdir(cachedir): os.remove(os.path.join(cachedir, name))
+        self.engine.set_cachedir(bytes23(cachedir))
+        ok, pkgname, errs = self.engine.load(b'cached_abc = "abc"+')
+        self.assertTrue(ok)
+        self.assertTrue([name for name in os.listdir(cachedir) if name.endswith(".rplpt")])
+        # A new engine given the directory loads the tree from the cache
+        new = rosie.engine()
+        new.set_cachedir(bytes23(cachedir))
+        ok, pkgname, errs = new.load(b'cached_abc = "abc"+')
+        self.assertTrue(ok)
+        pat, errs = new.compile(b"cached_abc")
+        m, left, abend, tt, tm = new.match(pat, b"abcabc", 1, b"json")
+        self.assertTrue(m)
+        self.assertTrue(left == 0)
+        self.engine.set_cachedir(None)
+
 class RosieImportTest(unittest.TestCase):
 
     engine = None
@@ -332,7 +782,131 @@ class RosieMatchTest(unittest.TestCase):
 
         self.assertRaises(ValueError, self.engine.match, b, inp, 1, b"this_is_not_a_valid_encoder_name")
 
-            
+class RosieMatchBatchTest(unittest.TestCase):
+
+    engine = None
+    
+    def setUp(self):
+        rosie.load(librosiedir, quiet=True)
+        self.engine = rosie.engine()
+
+    def tearDown(self):
+        pass
+
+    def test(self):
+
+        b, errs = self.engine.compile(b"[:digit:]+")
+        self.assertTrue(b.valid())
+        self.assertTrue(errs == None)
+
+        inputs = [b"321", b"xyz", b"", b"889900112233xyz"]
+
+        for encoder in [b"json", b"line", b"bool"]:
+            results = self.engine.match_batch(b, inputs, 1, encoder)
+            self.assertTrue(len(results) == len(inputs))
+            for inp, result in zip(inputs, results):
+                self.assertTrue(result[0:3] == self.engine.match(b, inp, 1, encoder)[0:3])
+
+        results = self.engine.match_batch(b, inputs, 1, b"json")
+        m, left, abend, tt, tm = results[0]
+        m = json.loads(m)
+        self.assertTrue(m['data'] == "321")
+        self.assertTrue(left == 0)
+        m, left, abend, tt, tm = results[1]
+        self.assertTrue(m == False)
+        self.assertTrue(left == 3)
+        m, left, abend, tt, tm = results[3]
+        m = json.loads(m)
+        self.assertTrue(m['data'] == "889900112233")
+        self.assertTrue(left == 3)
+        self.assertTrue(abend == False)
+
+        self.assertTrue(self.engine.match_batch(b, [], 1, b"json") == [])
+        self.assertRaises(ValueError, self.engine.match_batch, b, inputs, 1, b"this_is_not_a_valid_encoder_name")
+
+class RosieMatchSetTest(unittest.TestCase):
+
+    engine = None
+    
+    def setUp(self):
+        rosie.load(librosiedir, quiet=True)
+        self.engine = rosie.engine()
+
+    def tearDown(self):
+        pass
+
+    def test(self):
+        exps = [b"[:digit:]+", b"[:alpha:]+", b"\"abc\"", b"find:\"x\"", b"\"z\"?"]
+        pats = []
+        for exp in exps:
+            pat, errs = self.engine.compile(exp)
+            self.assertTrue(pat.valid())
+            pats.append(pat)
+        digits, alpha, abc, findx, opt = pats
+        s = self.engine.compile_set(pats)
+
+        self.assertTrue(s.match(b"123") == [digits, opt])
+        self.assertTrue(s.match(b"abcd") == [alpha, abc, opt])
+        self.assertTrue(s.match(b"abx") == [alpha, findx, opt])
+        self.assertTrue(s.match(b"") == [opt])
+        self.assertTrue(s.match(b"ab 12", 4) == [digits, opt])
+
+        # Same result as matching each pattern separately
+        for inp in [b"123", b"abcd", b"abx", b"", b"-x-", b"\xe4x"]:
+            expected = [pat for pat in pats if self.engine.match(pat, inp, 1, b"bool")[0]]
+            self.assertTrue(s.match(inp) == expected)
+
+        results = s.match(b"abc", 1, b"json")
+        self.assertTrue([pat for pat, data in results] == [alpha, abc, opt])
+        self.assertTrue(json.loads(results[0][1])['data'] == "abc")
+        self.assertTrue(json.loads(results[1][1])['data'] == "abc")
+
+        self.assertRaises(ValueError, s.match, b"abc", 1, b"this_is_not_a_valid_encoder_name")
+        self.assertRaises(ValueError, self.engine.compile_set, [digits, None])
+        self.assertTrue(self.engine.compile_set([]).match(b"abc") == [])
+
+class RosieMatchIntoTest(unittest.TestCase):
+
+    engine = None
+
+    def setUp(self):
+        rosie.load(librosiedir, quiet=True)
+        self.engine = rosie.engine()
+
+    def tearDown(self):
+        pass
+
+    def test(self):
+        b, errs = self.engine.compile(b"[:digit:]+")
+        self.assertTrue(b.valid())
+        buf = bytearray(100)
+
+        for encoder in [b"json", b"line", b"color"]:
+            expected = self.engine.match(b, b"321xyz", 1, encoder)
+            m, left, abend, tt, tm = self.engine.match_into(b, b"321xyz", 1, encoder, buf)
+            self.assertTrue(bytes(m) == expected[0])
+            self.assertTrue(left == 3)
+            self.assertTrue(abend == False)
+
+        m, left, abend, tt, tm = self.engine.match_into(b, b"xyz", 1, b"json", buf)
+        self.assertTrue(m == False)
+        self.assertTrue(left == 3)
+        m, left, abend, tt, tm = self.engine.match_into(b, b"321", 1, b"bool", buf)
+        self.assertTrue(m == True)
+
+        # The match data lives in the caller's buffer, so it survives later calls
+        m1 = self.engine.match_into(b, b"111", 1, b"line", buf)[0]
+        m2 = self.engine.match_into(b, b"22", 1, b"line", bytearray(10))[0]
+        self.assertTrue(bytes(m1) == b"111")
+        self.assertTrue(bytes(m2) == b"22")
+
+        try:
+            self.engine.match_into(b, b"123456789", 1, b"line", bytearray(4))
+            self.assertTrue(False)
+        except BufferError as e:
+            self.assertTrue(e.args[1] == 9)
+        self.assertRaises(ValueError, self.engine.match_into, b, b"1", 1, b"this_is_not_a_valid_encoder_name", buf)
+
 class RosieTraceTest(unittest.TestCase):
 
     def setUp(self):
@@ -423,6 +997,186 @@ class RosieMatchFileTest(unittest.TestCase):
             self.assertTrue(cout == 0)
             self.assertTrue(cerr == 1)
 
+        # An empty file has no lines, but is one (empty) input in whole file mode
+        open("/tmp/empty.txt", "w").close()
+        cin, cout, cerr = self.engine.matchfile(self.net_any, b"json", b"/tmp/empty.txt",
+                                                b"/dev/null", b"/dev/null")
+        self.assertTrue((cin, cout, cerr) == (0, 0, 0))
+        cin, cout, cerr = self.engine.matchfile(self.net_any, b"json", b"/tmp/empty.txt",
+                                                b"/dev/null", b"/dev/null", wholefile=True)
+        self.assertTrue((cin, cout, cerr) == (1, 0, 1))
+
+        self.assertRaises(ValueError, self.engine.matchfile, self.net_any, b"json",
+                          b"/tmp/this_file_does_not_exist")
+
+    def test_count_and_max(self):
+        if not testdir: return
+        infile = bytes23(os.path.join(testdir, "resolv.conf"))
+        # The count encoder writes nothing, not even the lines that do not match
+        cin, cout, cerr = self.engine.matchfile(self.findall_net_any, b"count", infile,
+                                                b"/tmp/resolv.out", b"/tmp/resolv.err")
+        self.assertTrue((cin, cout, cerr) == (10, 5, 5))
+        for suffix in ["out", "err"]:
+            self.assertTrue(os.path.getsize("/tmp/resolv." + suffix) == 0)
+        self.assertTrue(self.engine.countfile(self.findall_net_any, infile) == 5)
+
+        cin, cout, cerr = self.engine.matchfile(self.findall_net_any, b"json", infile,
+                                                b"/tmp/resolv.out", b"/dev/null", maxcount=2)
+        self.assertTrue(cout == 2)
+        self.assertTrue(cin == cout + cerr)
+        self.assertTrue(cin < 10)
+        with open("/tmp/resolv.out", "rb") as f:
+            self.assertTrue(len(f.read().splitlines()) == 2)
+        self.assertTrue(self.engine.countfile(self.findall_net_any, infile, maxcount=9) == 5)
+
+        self.assertTrue(self.engine.anymatch(self.findall_net_any, infile))
+        self.assertTrue(self.engine.anymatch(self.net_any, infile, wholefile=True) == False)
+        absent, errs = self.engine.compile(b'findall:"this text is not in the file"')
+        self.assertTrue(absent)
+        self.assertTrue(self.engine.anymatch(absent, infile) == False)
+
+    def test_compressed(self):
+        if not testdir: return
+        infile = os.path.join(testdir, "resolv.conf")
+        with open(infile, "rb") as f:
+            data = f.read()
+        with gzip.open("/tmp/resolv.conf.gz", "wb") as f:
+            f.write(data)
+        plain = self.engine.matchfile(self.findall_net_any, b"json", bytes23(infile),
+                                      b"/tmp/resolv.out", b"/tmp/resolv.err")
+        with open("/tmp/resolv.out", "rb") as f:
+            plain_out = f.read()
+        cin, cout, cerr = self.engine.matchfile(self.findall_net_any, b"json",
+                                                b"/tmp/resolv.conf.gz",
+                                                b"/tmp/resolv.out", b"/tmp/resolv.err")
+        self.assertTrue((cin, cout, cerr) == plain)
+        with open("/tmp/resolv.out", "rb") as f:
+            self.assertTrue(f.read() == plain_out)
+        self.assertTrue(self.engine.countfile(self.findall_net_any, b"/tmp/resolv.conf.gz",
+                                              maxcount=2) == 2)
+
+class RosieMatchFileParallelTest(unittest.TestCase):
+
+    engines = None
+    pats = None
+    
+    def setUp(self):
+        rosie.load(librosiedir, quiet=True)
+        self.engines = [rosie.engine() for i in range(3)]
+        self.pats = []
+        for engine in self.engines:
+            ok, pkgname, errs = engine.import_pkg(b'net')
+            self.assertTrue(ok)
+            pat, errs = engine.compile(b"findall:net.any")
+            self.assertTrue(pat)
+            self.pats.append(pat)
+
+    def tearDown(self):
+        pass
+
+    def test(self):
+        if testdir:
+            infile = bytes23(os.path.join(testdir, "resolv.conf"))
+            cin, cout, cerr = rosie.matchfile_parallel(self.pats,
+                                                       b"json",
+                                                       infile,
+                                                       b"/tmp/resolv.parallel.out",
+                                                       b"/tmp/resolv.parallel.err")
+            self.assertTrue(cin == 10)
+            self.assertTrue(cout == 5)
+            self.assertTrue(cerr == 5)
+
+            cin, cout, cerr = self.engines[0].matchfile(self.pats[0],
+                                                        b"json",
+                                                        infile,
+                                                        b"/tmp/resolv.out",
+                                                        b"/tmp/resolv.err")
+            for suffix in ["out", "err"]:
+                with open("/tmp/resolv." + suffix, "rb") as f:
+                    expected = f.read()
+                with open("/tmp/resolv.parallel." + suffix, "rb") as f:
+                    self.assertTrue(f.read() == expected)
+
+            self.assertRaises(ValueError, rosie.matchfile_parallel, self.pats, b"json", b"/no/such/file")
+            self.assertRaises(ValueError, rosie.matchfile_parallel, [self.pats[0], self.pats[0]], b"json", infile)
+
+    def test_unsplittable(self):
+        # A pipe or a compressed file is processed by one engine
+        if not testdir: return
+        infile = os.path.join(testdir, "resolv.conf")
+        with open(infile, "rb") as f:
+            data = f.read()
+        with gzip.open("/tmp/resolv.conf.gz", "wb") as f:
+            f.write(data)
+        cin, cout, cerr = rosie.matchfile_parallel(self.pats, b"json", b"/tmp/resolv.conf.gz",
+                                                   b"/tmp/resolv.parallel.out",
+                                                   b"/tmp/resolv.parallel.err")
+        self.assertTrue((cin, cout, cerr) == (10, 5, 5))
+        fifo = "/tmp/resolv.parallel.fifo"
+        if os.path.exists(fifo): os.remove(fifo)
+        os.mkfifo(fifo)
+        def writer():
+            with open(fifo, "wb") as f:
+                f.write(data)
+        t = threading.Thread(target=writer)
+        t.start()
+        cin, cout, cerr = rosie.matchfile_parallel(self.pats, b"json", bytes23(fifo),
+                                                   b"/tmp/resolv.parallel.out",
+                                                   b"/tmp/resolv.parallel.err")
+        t.join()
+        os.remove(fifo)
+        self.assertTrue((cin, cout, cerr) == (10, 5, 5))
+
+class RosieStreamTest(unittest.TestCase):
+
+    engine = None
+    findall_net_any = None
+
+    def setUp(self):
+        rosie.load(librosiedir, quiet=True)
+        self.engine = rosie.engine()
+        self.assertTrue(self.engine)
+        ok, pkgname, errs = self.engine.import_pkg(b'net')
+        self.assertTrue(ok)
+        self.findall_net_any, errs = self.engine.compile(b"findall:net.any")
+        self.assertTrue(self.findall_net_any)
+
+    def tearDown(self):
+        pass
+
+    def test(self):
+        results = []
+        s = self.engine.stream(self.findall_net_any, b"json",
+                               lambda record, data: results.append((record, data)))
+        # Lines are split across feeds, and the last one has no newline
+        s.feed(b"nameserver 10.0.1.1\nsearch ")
+        s.feed(b"")
+        s.feed(b"example")
+        s.feed(b".com\nno addresses here\n\n127.0.0.1")
+        self.assertTrue(len(results) == 4)
+        cin, cout, cerr = s.close()
+        self.assertTrue((cin, cout, cerr) == (5, 3, 2))
+        self.assertTrue([r[0] for r in results] ==
+                        [b"nameserver 10.0.1.1", b"search example.com", b"no addresses here", b"", b"127.0.0.1"])
+        self.assertTrue(results[0][1] == self.engine.match(self.findall_net_any, b"nameserver 10.0.1.1", 1, b"json")[0])
+        self.assertTrue(results[2][1] == False)
+        self.assertRaises(ValueError, s.close)
+
+        if testdir:
+            with open(os.path.join(testdir, "resolv.conf"), "rb") as f:
+                data = f.read()
+            s = self.engine.stream(self.findall_net_any, b"json", lambda record, data: None)
+            for i in range(0, len(data), 7):
+                s.feed(data[i:i+7])
+            self.assertTrue(s.close() == (10, 5, 5))
+
+        # An exception in the callback stops the feed
+        def fail(record, data):
+            raise KeyError(record)
+        s = self.engine.stream(self.findall_net_any, b"json", fail)
+        self.assertRaises(KeyError, s.feed, b"one\ntwo\n")
+        self.assertTrue(s.close() == (1, 0, 1))
+
 class RosieReadRcfileTest(unittest.TestCase):
 
     engine = None
@@ -21,6 +21,15 @@ enum KEYS {
   alloc_actual_limit_key,
   prev_string_result_key,
   violation_format_key,
+  batch_results_key,
+  rplx_peg_table_key,
+  cmatch_key,
+  rplx_source_table_key,
+  history_key,
+  pattern_set_table_key,
+  pattern_set_program_key,
+  set_results_key,
+  settings_key,
   KEY_ARRAY_SIZE
 };
 
@@ -287,6 +287,55 @@ if (#results <=0) or (code ~= 0) then
    print(cmd)
 end
 
+---------------------------------------------------------------------------------------------------
+test.heading("Bench command")
+
+cmd = rosie_cmd .. " bench -n 2 net.any test/resolv.conf 2>&1"
+results, status, code = util.os_execute_capture(cmd, nil)
+check(#results>0, "command failed")
+check(code==0, "Return code is not zero")
+txt = table.concat(results, '\n')
+check(txt:find("throughput:"))
+check(txt:find("latency:"))
+check(txt:find("peak heap:"))
+if (#results <=0) or (code ~= 0) then
+   print(cmd)
+end
+
+---------------------------------------------------------------------------------------------------
+test.heading("Count and early exit")
+
+cmd = rosie_cmd .. " grep -c net.any test/resolv.conf 2>&1"
+results, status, code = util.os_execute_capture(cmd, nil, "l")
+check(code==0, "Return code is not zero")
+check(#results==1 and results[1]=="5", "expected only the count of matching lines")
+
+cmd = rosie_cmd .. " grep -o json -m 2 net.any test/resolv.conf 2>&1"
+results, status, code = util.os_execute_capture(cmd, nil, "l")
+check(code==0, "Return code is not zero")
+check(#results==2, "expected output for only two matching lines")
+
+cmd = rosie_cmd .. " grep -q net.any test/resolv.conf 2>&1"
+results, status, code = util.os_execute_capture(cmd, nil, "l")
+check(code==0, "Return code is not zero")
+check(#results==0, "quiet mode should print nothing")
+
+cmd = rosie_cmd .. " grep -q '\"not in the file\"' test/resolv.conf 2>&1"
+results, status, code = util.os_execute_capture(cmd, nil, "l")
+check(code~=0, "Return code should not be zero when nothing matches")
+check(#results==0, "quiet mode should print nothing")
+
+---------------------------------------------------------------------------------------------------
+test.heading("Compressed input")
+
+local gzfile = os.tmpname()
+os.execute("gzip -c test/resolv.conf > " .. gzfile)
+cmd = rosie_cmd .. " grep -c net.any " .. gzfile .. " 2>&1"
+results, status, code = util.os_execute_capture(cmd, nil, "l")
+check(code==0, "Return code is not zero")
+check(#results==1 and results[1]=="5", "expected the count of matching lines in the decompressed input")
+os.remove(gzfile)
+
 ---------------------------------------------------------------------------------------------------
 test.heading("Error reporting")
 
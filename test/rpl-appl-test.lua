@@ -301,6 +301,41 @@ for line in lines do
    i = i + 1
 end
 
+subheading("Find, skipping input that cannot begin a match")
+
+function test_find_span(exp, input, start, finish)
+   local p = e:compile(exp)
+   check(p, "failed to compile " .. exp, 1)
+   ok, m, leftover = e:match(p, input)
+   check(ok, "call failed", 1)
+   if not start then
+      check(not m, "matched where it should have failed to match", 1)
+      return
+   end
+   check(m, "failed to match where it should", 1)
+   local sub = m and m.subs and m.subs[1]
+   check(sub and sub.s==start and sub.e==finish, "wrong span for " .. exp .. " in " .. input, 1)
+end
+
+test_find_span('find:"ERROR"', "no errors here, ERROR: bad", 17, 22)
+test_find_span('find:"ERROR"', "no errors here", false)
+test_find_span('find:{[:digit:]+ "."}', "v 12 3.x", 6, 8)
+test_find_span('find:{!"b" [a-c]}', "xxba", 4, 5)
+test_find_span('find:[\\u03b1-\\u03c9]', "abc \u{3bb}x", 5, 7)    -- greek lambda
+test_find_span('find:{"a" / [:^alpha:]}', "xyz1", 4, 5)
+-- The text before the match is not valid UTF-8
+test_find_span('find:"a"', "\xe4a", 2, 3)
+
+p = e:compile('findall:{[:digit:]+}')
+ok, m, leftover = e:match(p, "a1b22c")
+check(ok and m and #m.subs==2)
+check(m.subs[1].s==2 and m.subs[1].e==3)
+check(m.subs[2].s==4 and m.subs[2].e==6)
+
+p = e:compile('keepto:"e"')
+ok, m, leftover = e:match(p, "abcdefg")
+check(ok and m and m.e==6 and leftover==2)
+
 
 ----------------------------------------------------------------------------------------
 heading("Message and halt")
@@ -515,6 +550,44 @@ check(leftover==7)
 
 
 ----------------------------------------------------------------------------------------
+heading("Dictionaries")
+
+ok, msg = e:set_dictionary("fruit", {"apple", "apples", "fig"})
+check(ok==3, "wrong number of dictionary entries")
+p, errs = e:compile('dictionary:#fruit')
+check(p)
+ok, m, leftover = e:match(p, 'apples!')
+check(ok and m and leftover==1, "dictionary did not match the longest entry")
+p, errs = e:compile('dictionary:(#fruit, #shortest)')
+check(p)
+ok, m, leftover = e:match(p, 'apples!')
+check(ok and m and leftover==2, "dictionary did not match the shortest entry")
+ok, m, leftover = e:match(p, 'pear')
+check(ok and not m)
+
+ok = e:load('fruit = dictionary:#fruit')
+check(ok)
+p, errs = e:compile('{fruit [ ]}+')
+check(p, "a dictionary pattern cannot be repeated")
+ok, m, leftover = e:match(p, 'fig apple fig ')
+check(ok and m and leftover==0)
+check(m and #m.subs==3)
+
+-- New entries are seen without compiling again
+ok = e:set_dictionary("fruit", "pear\nplum\n")
+check(ok==2)
+ok, m, leftover = e:match(p, 'fig ')
+check(ok and not m)
+ok, m, leftover = e:match(p, 'plum pear ')
+check(ok and m and leftover==0)
+
+ok, msg = e:set_dictionary("/no/such/dictionary/file")
+check(not ok and msg)
+p, errs = e:compile('dictionary:#nosuchdictionary')
+check(not p)
+p, errs = e:compile('dictionary:(#fruit, #most)')
+check(not p)
+
 heading("Case sensitivity")
 subheading("ci literals (shallow test)")
 
@@ -580,6 +653,14 @@ function check_match(exp, input)
    end
 end
 
+subheading("ci literals with escapes and uncased characters")
+
+check_match('ci:"Error: \\"x\\" at 10"', 'ERROR: "X" at 10')
+check_match('ci:"caf\\u00E9 \\t|"', 'CAF\u{E9} \t|')
+p = e:compile('ci:"a-b"'); check(p)
+ok, m, leftover = e:match(p, 'A_B')
+check(ok); check(not m)
+
 check_match('ci:[:upper:]+', 'ABCDEF')
 check_match('ci:[:upper:]+', 'abcdef')
 check_match('ci:[:upper:]+', 'ABcdeF')
@@ -598,6 +679,10 @@ check_match('ci:[A]{2}', 'Aa')
 check_match('ci:[a]{2}', 'Aa')
 check_match('ci:[ABc]+', 'aAbBcC')
 check_match('ci:[+/x]+', 'XXxX++/')
+p = e:compile('ci:[^ab]'); check(p)
+ok, m, leftover = e:match(p, 'B')
+check(ok); check(not m)
+check_match('ci:[^ab]', 'c')
 
 
 subheading("ci range character sets (shallow test)")
@@ -420,6 +420,23 @@ for _,char in ipairs{"abc", "aè", "eè", "iè", "Øè", "ßè"} do
    check_match(global_rplx, char, true, 2)	    -- 2 because BYTES, not characters
 end
 
+-- Ranges are compiled into sequences of byte ranges, split where the encoding changes
+set_expression('[\\u4e00-\\u9fff]')
+for _, cp in ipairs{0x4e00, 0x4e01, 0x4fff, 0x5000, 0x7fff, 0x9ffe, 0x9fff} do
+   check_match(global_rplx, utf8.char(cp), true, 0)
+end
+for _, cp in ipairs{0x4dff, 0xa000, 0x41, 0xe8, 0x10000} do
+   check_match(global_rplx, utf8.char(cp), false)
+end
+
+set_expression('[\\x7e-\\U00010001]')
+for _, cp in ipairs{0x7e, 0x7f, 0x80, 0x7ff, 0x800, 0xfff, 0x1000, 0xffff, 0x10000, 0x10001} do
+   check_match(global_rplx, utf8.char(cp), true, 0)
+end
+for _, cp in ipairs{0x7d, 0x10002, 0x10FFFF} do
+   check_match(global_rplx, utf8.char(cp), false)
+end
+
 
 ----------------------------------------------------------------------------------------
 heading("Character lists with escape sequences")
@@ -287,6 +287,21 @@ check_match('{{a b} / {b} / {a c}}', "bcL", true, 2)
 check_match('{{a b} / (b ~) / {a c}}', "bcL", false)
 check_match('{{a b} / (b ~) / {a c}}', "b.cL", true, 3)
 
+subheading("Wide alternations, which are compiled to dispatch on the next byte")
+days = '{"Mon" / "Tue" / "Wed" / "Thu" / "Fri" / "Sat" / "Sun" / "Ma" / "M" / [:digit:]+'
+check_match(days .. '}', "Monday", true, 3, "Mon")
+check_match(days .. '}', "Mar", true, 1, "Ma")
+check_match(days .. '}', "Mz", true, 1, "M")
+check_match(days .. '}', "Sat", true, 0, "Sat")
+check_match(days .. '}', "42x", true, 1, "42")
+check_match(days .. '}', "q", false)
+check_match(days .. '}', "", false)
+check_match(days .. ' / "x"?}', "Wed", true, 0, "Wed")
+check_match(days .. ' / "x"?}', "x", true, 0, "x")
+check_match(days .. ' / "x"?}', "q", true, 1, "")
+check_match(days .. ' / "x"?}', "", true, 0, "")
+check_match(days .. ' / >"q" "qq" / "q"}', "q", true, 0, "q")
+
 ----------------------------------------------------------------------------------------
 heading("Cooked groups")
 ----------------------------------------------------------------------------------------
@@ -1344,6 +1359,77 @@ check(m.subs)
 check(#m.subs==1)
 check(m.subs[1].type=="g1")
 
+subheading("Memoized")
+
+e:set_memoize(true)
+ok, msg = pcall(e.load, e, (g1_defn:gsub("g1", "g1m")))
+check(ok)
+check_match('g1m', "", true)
+check_match('g1m', "ab", true)
+check_match('g1m', "abb", false)
+check_match('g1m', "a", true, 1)
+check_match('g1m $', "aabb", true)
+m, leftover = check_match('g1m', "baab", true)
+check(m and m.subs[1].type=="g1m.S")
+check(m and m.subs[1].subs[1].subs[1].type=="g1m.B")
+
+-- Without memoization, matching X takes time exponential in the length of the input
+g_backtrack = [[grammar
+  alias X = {"a" X "b"} / {"a" X "c"} / "a"
+in
+  g_bt = X
+end]]
+
+ok, msg = pcall(e.load, e, g_backtrack)
+check(ok)
+check_match('g_bt', "aaacc", true, 0)
+check_match('g_bt', "aaacb", true, 0)
+check_match('g_bt', string.rep("a", 30) .. string.rep("c", 29), true, 0)
+check_match('g_bt', string.rep("a", 30) .. string.rep("c", 28) .. "b", true, 0)
+check_match('g_bt', "b", false)
+e:set_memoize(false)
+
+subheading("With a step limit")
+
+e:set_match_limits(10000, false)
+ok, msg = pcall(e.load, e, (g_backtrack:gsub("g_bt", "g_limited")))
+check(ok)
+ok, m, leftover, abend = e:match('g_limited', "aaacc")
+check(ok and m and (not abend))
+ok, m, leftover, abend = e:match('g_limited', string.rep("a", 30) .. string.rep("c", 29))
+check(ok and abend, "the step limit should halt this match")
+e:set_match_limits(false, false)
+ok, m, leftover, abend = e:match('g_limited', "aaacc")
+check(ok and m and (not abend))
+-- Whether a pattern is limited is fixed when it is compiled
+ok, msg = pcall(e.load, e, (g_backtrack:gsub("g_bt", "g_unlimited")))
+check(ok)
+e:set_match_limits(10000, false)
+ok, m, leftover, abend = e:match('g_unlimited', string.rep("a", 16) .. string.rep("c", 15))
+check(ok and m and (not abend), "a pattern compiled without a limit should not be limited")
+e:set_match_limits(false, false)
+
+subheading("Profiled")
+
+e:set_profile(true)
+ok, msg = pcall(e.load, e, (g1_defn:gsub("g1", "g1p")))
+check(ok)
+check_match('g1p', "ab", true)
+report = {}
+for _, r in ipairs(e:profile_report()) do report[r.name] = r; end
+check(report.S and report.S.attempts > 0 and report.S.matches > 0)
+check(report.S and (report.S.failures == report.S.attempts - report.S.matches))
+check(report.B and report.B.bytes == 0, "bytes are counted only with timing")
+e:set_profile(true, true)
+ok, msg = pcall(e.load, e, (g1_defn:gsub("g1", "g1t")))
+check(ok)
+check_match('g1t', "ab", true)
+report = {}
+for _, r in ipairs(e:profile_report()) do report[r.name] = r; end
+check(report.B and report.B.bytes > 0)
+e:set_profile(false)
+check(#e:profile_report() == 0)
+
 subheading("With errors")
 
 g_syntax_error = [[grammar
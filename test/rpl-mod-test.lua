@@ -201,6 +201,42 @@ check(ok)
 check(pkgname=="mod8")
 msg = table.concat(map(violation.tostring, msgs), "\n")
 
+subheading("Parse cache")
+util = import "util"
+cachedir = os.tmpname()
+os.remove(cachedir)
+check(os.execute("mkdir " .. cachedir))
+check(not rosie.get_cachedir())
+rosie.set_cachedir(cachedir)
+check(rosie.get_cachedir()==cachedir)
+
+e1 = rosie.engine.new()
+e1:set_libpath(TEST_HOME)
+ok, pkgname, msgs = e1:import("mod1")
+check(ok)
+files = util.os_execute_capture("ls " .. cachedir, nil, "l")
+check(files and #files > 0, "expected the parse cache to have been written")
+
+-- This engine gets the parse tree for mod1 from the cache
+e2 = rosie.engine.new()
+e2:set_libpath(TEST_HOME)
+ok, pkgname, msgs = e2:import("mod1")
+check(ok)
+ok, m1, left1 = e1:match("mod1.S", "baab")
+check(ok)
+ok, m2, left2 = e2:match("mod1.S", "baab")
+check(ok)
+check(left1==left2)
+check(util.table_to_pretty_string(m1)==util.table_to_pretty_string(m2))
+
+-- Syntax errors are reported the same way whether or not the cache is on
+ok, pkgname, msgs = e2:loadfile(TEST_HOME .. "/synerr.rpl")
+check(not ok)
+check(type(msgs)=="table" and #msgs > 0)
+
+rosie.set_cachedir(false)
+os.execute("rm -rf " .. cachedir)
+
 
 -- return the test results in case this file is being called by another one which is collecting
 -- up all the results:
@@ -332,6 +332,18 @@ check_structure('{{{a / b} {a / b} {a / b} {a / b}{,2}}}', {true, '{{a / b} {a /
 check_trace('({a/b}{3,5})', "ba", false, 1)
 check_structure('{{{a / b} {a / b} {a / b} {a / b}{,2}}}', {false, '{{a / b} {a / b} {a / b} {a / b}{,2}}'})
 
+----------------------------------------------------------------------------------------
+heading("Eval long inputs")
+----------------------------------------------------------------------------------------
+-- The input is matched once, so a trace of a long input does not take long
+check_trace('{a / b}*', string.rep("ab", 5000), true, 10001)
+check(#lasttrace.subs == 10001)
+check(lasttrace.subs[10000].match and (not lasttrace.subs[10001].match))
+check_structure(lasttrace.subs[2], '{a / b}', {false, 'a', 'b', true})
+
+check_trace('{a b}', string.rep("ab", 5000), true, 3)
+check_structure('{a b}', {true, 'a', 'b'})
+
 ----------------------------------------------------------------------------------------
 heading("Eval grammar")
 ----------------------------------------------------------------------------------------